@@ -1,5 +1,11 @@
+local _ENV = ...
 
-CMAKE_CONFIGURATIONS = { 'Debug', 'Release', 'RelWithDebInfo', 'MinSizeRel' }
+-- called again at the start of each phase, values set by a previous phase must not leak into the next one
+local function reset()
+    CMAKE_CONFIGURATIONS = { 'Debug', 'Release', 'RelWithDebInfo', 'MinSizeRel' }
+end
+
+reset()
 
 function table_append(dst, src)
     if type(src) ~= 'table' then
@@ -69,3 +75,5 @@ function CMAKE_BUILD(params)
     end
     pour.run('cmake-'..CMAKE_VERSION, '--build', '.', table.unpack(e))
 end
+
+return reset
@@ -0,0 +1,156 @@
+#include <common/script.h>
+#include <lualib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Micro-benchmark for the environment set up by Script_DoFile and Script_LoadFunctions. Compares copying every
+ * global into the new _ENV, as pushGlobals in src/common/script.c used to do, with pushGlobals itself, which
+ * chains _ENV to the global table through a shared metatable. The global table is filled with the standard
+ * library plus placeholders for the modules and globals that pour registers, so that it has about as many
+ * entries as in pour itself.
+ *
+ * Built with the rest of pour when BUILD_BENCHMARKS is on. Usage: bench_script_env [iterations]
+ */
+
+#define DEFAULT_ITERATIONS 200000
+#define WARMUP_ITERATIONS 1000
+#define ROUNDS 3
+
+typedef int (*PFNPushEnv)(lua_State* L, int envIndex);
+
+static const char* const modules[] = {
+    "pour", "mkdisk", "patch", "wingrp", "dosbox", "ext2read", NULL
+};
+
+static const char* const globals[] = {
+    "ROOT_DIR", "INSTALL_DIR", "DATA_DIR", "CMAKE_MODULES_DIR", "PACKAGES_DIR", "TARGETS_DIR", "PACKAGE_DIR",
+    "HOST_WINDOWS", "CMAKE_CONFIGURATIONS", "table_append", "CMAKE", "CMAKE_BUILD", NULL
+};
+
+static const char chunk[] = "CMAKE_GENERATOR = 'Ninja'; local t = table.concat({ ROOT_DIR, 'x' }); x = pour and 1";
+
+/********************************************************************************************************************/
+
+static int pushEnvCopy(lua_State* L, int envIndex)
+{
+    lua_pushvalue(L, envIndex);
+    lua_setfield(L, envIndex, "_G");
+
+    lua_pushglobaltable(L);
+    int globalsIndex = lua_gettop(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, globalsIndex)) {
+        lua_pushvalue(L, -2);
+        if (lua_rawget(L, envIndex) > LUA_TNIL)
+            lua_pop(L, 1);
+        else {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, envIndex);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, envIndex);
+    return envIndex;
+}
+
+/********************************************************************************************************************/
+
+/* returns microseconds per iteration */
+static double run(lua_State* L, PFNPushEnv pfnPushEnv, int iterations, int withChunk)
+{
+    clock_t start = clock();
+
+    for (int i = 0; i < iterations; i++) {
+        lua_newtable(L);
+        int env = lua_gettop(L);
+        lua_pushliteral(L, "pour.exe");
+        lua_setfield(L, env, "POUR_EXECUTABLE");
+
+        int function = 0;
+        if (withChunk) {
+            if (luaL_loadstring(L, chunk) != LUA_OK)
+                lua_error(L);
+            function = lua_gettop(L);
+        }
+
+        pfnPushEnv(L, env);
+        lua_pushliteral(L, "/dir");
+        lua_setfield(L, env, "SCRIPT_DIR");
+
+        if (withChunk) {
+            lua_setupvalue(L, function, 1);
+            lua_call(L, 0, 0);
+        }
+
+        lua_settop(L, env - 1);
+    }
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e6 / iterations;
+}
+
+static int pmain(lua_State* L)
+{
+    int iterations = (int)lua_tointeger(L, 1);
+
+    luaL_openlibs(L);
+    for (int i = 0; modules[i]; i++) {
+        lua_newtable(L);
+        lua_setglobal(L, modules[i]);
+    }
+    for (int i = 0; globals[i]; i++) {
+        lua_pushstring(L, globals[i]);
+        lua_setglobal(L, globals[i]);
+    }
+
+    int count = 0;
+    lua_pushglobaltable(L);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        ++count;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    printf("globals: %d, iterations: %d\n", count, iterations);
+
+    run(L, pushEnvCopy, WARMUP_ITERATIONS, 1);
+    run(L, Script_PushGlobals, WARMUP_ITERATIONS, 1);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        printf("environment setup only:        copy %6.2f us, chained %6.2f us\n",
+            run(L, pushEnvCopy, iterations, 0), run(L, Script_PushGlobals, iterations, 0));
+        printf("setup + load/run 1-line chunk: copy %6.2f us, chained %6.2f us\n",
+            run(L, pushEnvCopy, iterations, 1), run(L, Script_PushGlobals, iterations, 1));
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = (argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS);
+    if (iterations <= 0)
+        iterations = DEFAULT_ITERATIONS;
+
+    lua_State* L = luaL_newstate();
+    if (!L) {
+        fprintf(stderr, "ERROR: Lua initialization failed.\n");
+        return EXIT_FAILURE;
+    }
+
+    lua_pushcfunction(L, pmain);
+    lua_pushinteger(L, iterations);
+    int status = lua_pcall(L, 1, 0, 0);
+    if (status != LUA_OK)
+        fprintf(stderr, "ERROR: %s\n", lua_tostring(L, -1));
+
+    lua_close(L);
+    return (status == LUA_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
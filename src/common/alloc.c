@@ -0,0 +1,300 @@
+#include <common/alloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Lua passes the old block size to the allocator, so small blocks need no header: they are carved out of
+ * 64K pages, one free list per 16-byte size class. Blocks above ALLOC_MAX_SMALL_SIZE go to the C runtime.
+ * Pages are never returned to the system until the state is closed.
+ */
+
+#define ALLOC_PAGE_SIZE 65536
+
+#define ALLOCATOR_ENV "POUR_LUA_ALLOCATOR"
+
+STRUCT(FreeBlock) {
+    FreeBlock* next;
+};
+
+STRUCT(Page) {
+    Page* next;
+    void* padding; /* keep blocks 16-byte aligned on 64-bit targets */
+};
+
+STRUCT(Allocator) {
+    FreeBlock* freeList[ALLOC_CLASS_COUNT];
+    char* bumpPtr[ALLOC_CLASS_COUNT];
+    char* bumpEnd[ALLOC_CLASS_COUNT];
+    Page* pages;
+    AllocStats stats;
+    bool warningsOn;
+    bool warningContinued;
+};
+
+/********************************************************************************************************************/
+
+static int classOf(size_t size)
+{
+    return (size > ALLOC_MAX_SMALL_SIZE ? ALLOC_CLASS_COUNT : (int)((size - 1) / ALLOC_GRANULARITY));
+}
+
+static void countAlloc(Allocator* a, size_t size)
+{
+    int index = classOf(size);
+    ++a->stats.allocCount[index];
+    ++a->stats.liveCount[index];
+    a->stats.bytesLive += size;
+    if (a->stats.bytesLive > a->stats.bytesPeak)
+        a->stats.bytesPeak = a->stats.bytesLive;
+}
+
+static void countFree(Allocator* a, size_t size)
+{
+    --a->stats.liveCount[classOf(size)];
+    a->stats.bytesLive -= size;
+}
+
+static void countResize(Allocator* a, size_t osize, size_t nsize)
+{
+    a->stats.bytesLive += nsize - osize;
+    if (a->stats.bytesLive > a->stats.bytesPeak)
+        a->stats.bytesPeak = a->stats.bytesLive;
+}
+
+static void* slabAcquire(Allocator* a, size_t size)
+{
+    if (size > ALLOC_MAX_SMALL_SIZE)
+        return malloc(size);
+
+    int index = classOf(size);
+
+    FreeBlock* block = a->freeList[index];
+    if (block) {
+        a->freeList[index] = block->next;
+        return block;
+    }
+
+    size_t blockSize = (size_t)(index + 1) * ALLOC_GRANULARITY;
+    if ((size_t)(a->bumpEnd[index] - a->bumpPtr[index]) < blockSize) {
+        Page* page = (Page*)malloc(ALLOC_PAGE_SIZE);
+        if (!page)
+            return NULL;
+        page->next = a->pages;
+        a->pages = page;
+        ++a->stats.pageCount;
+        a->bumpPtr[index] = (char*)(page + 1);
+        a->bumpEnd[index] = (char*)page + ALLOC_PAGE_SIZE;
+    }
+
+    char* ptr = a->bumpPtr[index];
+    a->bumpPtr[index] = ptr + blockSize;
+    return ptr;
+}
+
+static void slabRelease(Allocator* a, void* ptr, size_t size)
+{
+    if (size > ALLOC_MAX_SMALL_SIZE) {
+        free(ptr);
+        return;
+    }
+
+    int index = classOf(size);
+    FreeBlock* block = (FreeBlock*)ptr;
+    block->next = a->freeList[index];
+    a->freeList[index] = block;
+}
+
+static void* slabAlloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    Allocator* a = (Allocator*)ud;
+
+    if (!ptr)
+        osize = 0; /* 'osize' is a type tag for new blocks */
+
+    if (nsize == 0) {
+        if (ptr) {
+            countFree(a, osize);
+            slabRelease(a, ptr, osize);
+        }
+        return NULL;
+    }
+
+    if (ptr) {
+        int oldClass = classOf(osize);
+        if (oldClass == classOf(nsize)) {
+            if (oldClass == ALLOC_CLASS_COUNT) {
+                void* newPtr = realloc(ptr, nsize);
+                if (!newPtr)
+                    return NULL;
+                ptr = newPtr;
+            }
+            countResize(a, osize, nsize);
+            return ptr;
+        }
+    }
+
+    void* newPtr = slabAcquire(a, nsize);
+    if (!newPtr)
+        return NULL;
+
+    countAlloc(a, nsize);
+
+    if (ptr) {
+        memcpy(newPtr, ptr, (osize < nsize ? osize : nsize));
+        countFree(a, osize);
+        slabRelease(a, ptr, osize);
+    }
+
+    return newPtr;
+}
+
+static void* systemAlloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    Allocator* a = (Allocator*)ud;
+
+    if (!ptr)
+        osize = 0;
+
+    if (nsize == 0) {
+        if (ptr) {
+            countFree(a, osize);
+            free(ptr);
+        }
+        return NULL;
+    }
+
+    void* newPtr = realloc(ptr, nsize);
+    if (!newPtr)
+        return NULL;
+
+    if (ptr && classOf(osize) == classOf(nsize))
+        countResize(a, osize, nsize);
+    else {
+        if (ptr)
+            countFree(a, osize);
+        countAlloc(a, nsize);
+    }
+
+    return newPtr;
+}
+
+/********************************************************************************************************************/
+
+static int panic(lua_State* L)
+{
+    const char* msg = (lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "error object is not a string");
+    lua_writestringerror("PANIC: unprotected error in call to Lua API (%s)\n", msg);
+    return 0;
+}
+
+static void warning(void* ud, const char* message, int tocont)
+{
+    Allocator* a = (Allocator*)ud;
+
+    if (!a->warningContinued && *message == '@') { /* control message */
+        if (!strcmp(message, "@on"))
+            a->warningsOn = true;
+        else if (!strcmp(message, "@off"))
+            a->warningsOn = false;
+        return;
+    }
+
+    if (a->warningsOn) {
+        if (!a->warningContinued)
+            lua_writestringerror("%s", "Lua warning: ");
+        lua_writestringerror("%s", message);
+        if (!tocont)
+            lua_writestringerror("%s", "\n");
+    }
+
+    a->warningContinued = (tocont != 0);
+}
+
+lua_State* Alloc_NewState(void)
+{
+    Allocator* a = (Allocator*)calloc(1, sizeof(Allocator));
+    if (!a)
+        return NULL;
+
+    /* this runs before the Lua state exists, hence plain getenv() */
+    const char* env = getenv(ALLOCATOR_ENV);
+    if (env && !strcmp(env, "system"))
+        a->stats.type = ALLOCATOR_SYSTEM;
+    else
+        a->stats.type = ALLOCATOR_SLAB;
+
+    lua_State* L = lua_newstate((a->stats.type == ALLOCATOR_SLAB ? slabAlloc : systemAlloc), a);
+    if (!L) {
+        free(a);
+        return NULL;
+    }
+
+    lua_atpanic(L, panic);
+    lua_setwarnf(L, warning, a);
+
+    return L;
+}
+
+void Alloc_CloseState(lua_State* L)
+{
+    void* ud = NULL;
+    lua_getallocf(L, &ud);
+    lua_close(L);
+
+    Allocator* a = (Allocator*)ud;
+    Page* page = a->pages;
+    while (page) {
+        Page* next = page->next;
+        free(page);
+        page = next;
+    }
+
+    free(a);
+}
+
+/********************************************************************************************************************/
+
+const AllocStats* Alloc_GetStats(lua_State* L)
+{
+    void* ud = NULL;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    if (f != slabAlloc && f != systemAlloc)
+        return NULL;
+    return &((Allocator*)ud)->stats;
+}
+
+void Alloc_PushStats(lua_State* L)
+{
+    const AllocStats* stats = Alloc_GetStats(L);
+    if (!stats) {
+        lua_pushnil(L);
+        return;
+    }
+
+    lua_createtable(L, 0, 5);
+
+    lua_pushstring(L, (stats->type == ALLOCATOR_SLAB ? "slab" : "system"));
+    lua_setfield(L, -2, "allocator");
+    lua_pushinteger(L, (lua_Integer)stats->bytesLive);
+    lua_setfield(L, -2, "bytes_live");
+    lua_pushinteger(L, (lua_Integer)stats->bytesPeak);
+    lua_setfield(L, -2, "bytes_peak");
+    lua_pushinteger(L, (lua_Integer)stats->pageCount);
+    lua_setfield(L, -2, "pages");
+
+    lua_createtable(L, ALLOC_CLASS_COUNT + 1, 0);
+    for (int i = 0; i <= ALLOC_CLASS_COUNT; i++) {
+        lua_createtable(L, 0, 3);
+        if (i < ALLOC_CLASS_COUNT)
+            lua_pushinteger(L, (lua_Integer)(i + 1) * ALLOC_GRANULARITY);
+        else
+            lua_pushliteral(L, "large");
+        lua_setfield(L, -2, "size");
+        lua_pushinteger(L, (lua_Integer)stats->allocCount[i]);
+        lua_setfield(L, -2, "allocations");
+        lua_pushinteger(L, (lua_Integer)stats->liveCount[i]);
+        lua_setfield(L, -2, "live");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "classes");
+}
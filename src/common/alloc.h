@@ -0,0 +1,30 @@
+#ifndef COMMON_ALLOC_H
+#define COMMON_ALLOC_H
+
+#include <common/common.h>
+
+#define ALLOC_GRANULARITY 16
+#define ALLOC_MAX_SMALL_SIZE 256
+#define ALLOC_CLASS_COUNT (ALLOC_MAX_SMALL_SIZE / ALLOC_GRANULARITY)
+
+typedef enum allocator_t {
+    ALLOCATOR_SLAB = 0,
+    ALLOCATOR_SYSTEM,
+} allocator_t;
+
+STRUCT(AllocStats) {
+    allocator_t type;
+    size_t bytesLive;
+    size_t bytesPeak;
+    size_t pageCount;
+    uint64_t allocCount[ALLOC_CLASS_COUNT + 1];   /* last entry counts large blocks */
+    size_t liveCount[ALLOC_CLASS_COUNT + 1];
+};
+
+lua_State* Alloc_NewState(void);
+void Alloc_CloseState(lua_State* L);
+
+const AllocStats* Alloc_GetStats(lua_State* L);
+void Alloc_PushStats(lua_State* L);
+
+#endif
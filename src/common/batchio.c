@@ -0,0 +1,1012 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for copy_file_range() */
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t on 32-bit systems */
+#endif
+
+#include <common/batchio.h>
+#include <common/thread.h>
+#include <common/file.h>
+#include <common/dirs.h>
+#include <common/statcache.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+ #include <io.h>
+ #include <fcntl.h>
+#else
+ #include <unistd.h>
+ #include <fcntl.h>
+#endif
+
+#ifdef __linux__
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>
+#endif
+
+/*
+ * Requests are independent of each other, so workers only take the next request index under the lock. Each
+ * request is carried out with plain blocking system calls; overlapping them on several threads is what hides
+ * the per-file latency. Error codes are errno values, or GetLastError() values for the native Windows backend.
+ *
+ * A started batch is consumed in order while the workers are still running. To bound memory use, workers stop
+ * taking requests once the contents that have been read, but not released by the consumer yet, exceed a limit;
+ * the request the consumer is waiting for is always taken, so the pipeline can't stall.
+ */
+
+#define BATCHIO_MT "BatchIO*"
+
+#define BATCHIO_MIN_THREADS 4
+#define BATCHIO_MAX_THREADS 16
+
+#define COMPARE_CHUNK_SIZE 16384
+#define COPY_BUFFER_SIZE (1u << 20)
+
+#define MAX_TEMP_NAME_ATTEMPTS 100 /* temporary files left by a crashed process with the same pid are skipped */
+#define TEMP_NAME_EXTRA 48
+
+#if !defined(_WIN32) || defined(USE_POSIX_IO)
+
+#ifdef _WIN32
+ #define O_CLOEXEC 0
+ #define fsync _commit
+ #ifdef _MSC_VER
+  typedef intptr_t ssize_t;
+  #define stat _stat64 /* 64-bit st_size */
+  #define fstat _fstat64
+ #endif
+ #ifndef S_ISDIR
+  #define S_ISDIR(mode) (((mode) & _S_IFMT) == _S_IFDIR)
+ #endif
+ #ifndef S_ISREG
+  #define S_ISREG(mode) (((mode) & _S_IFMT) == _S_IFREG)
+ #endif
+#else
+ #define O_BINARY 0
+#endif
+
+#define MAX_IO_CHUNK (1u << 30) /* single read() or write() may transfer less than requested above 2 GB */
+
+#endif
+
+struct BatchIO
+{
+    BatchRequest* requests;
+    size_t count;
+    size_t capacity;
+    size_t nextRequest;
+    size_t bytesAhead;          /* contents read by workers, but not released yet */
+    size_t maxBytesAhead;
+    size_t wanted;              /* requests up to this index are taken regardless of maxBytesAhead */
+    Mutex* mutex;
+    CondVar* workCond;          /* workers may be able to take more requests */
+    CondVar* doneCond;          /* a request has been completed */
+    Thread* threads[BATCHIO_MAX_THREADS];
+    size_t threadCount;
+    bool stopping;
+};
+
+/********************************************************************************************************************/
+
+#if defined(_WIN32) && !defined(USE_POSIX_IO)
+
+static bool toUtf16(const char* path, WCHAR* buf, size_t bufSize)
+{
+    return MultiByteToWideChar(CP_UTF8, 0, path, -1, buf, (int)bufSize) != 0;
+}
+
+static bool readAll(HANDLE handle, void* buf, size_t size)
+{
+    char* ptr = (char*)buf;
+    while (size != 0) {
+        DWORD dwBytesToRead = (size > 0x40000000 ? 0x40000000 : (DWORD)size);
+        DWORD dwBytesRead;
+        if (!ReadFile(handle, ptr, dwBytesToRead, &dwBytesRead, NULL))
+            return false;
+        if (dwBytesRead == 0) {
+            SetLastError(ERROR_HANDLE_EOF);
+            return false;
+        }
+        ptr += dwBytesRead;
+        size -= dwBytesRead;
+    }
+    return true;
+}
+
+static bool writeAll(HANDLE handle, const void* buf, size_t size)
+{
+    const char* ptr = (const char*)buf;
+    while (size != 0) {
+        DWORD dwBytesToWrite = (size > 0x40000000 ? 0x40000000 : (DWORD)size);
+        DWORD dwBytesWritten;
+        if (!WriteFile(handle, ptr, dwBytesToWrite, &dwBytesWritten, NULL))
+            return false;
+        ptr += dwBytesWritten;
+        size -= dwBytesWritten;
+    }
+    return true;
+}
+
+static void fail(BatchRequest* request, const char* action)
+{
+    request->failedAction = action;
+    request->error = (int)GetLastError();
+}
+
+static void readFile(BatchRequest* request)
+{
+    WCHAR wpath[DIR_MAX];
+    if (!toUtf16(request->path, wpath, DIR_MAX)) {
+        fail(request, "open");
+        return;
+    }
+
+    HANDLE handle = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        fail(request, "open");
+        return;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size)) {
+        fail(request, "read");
+        CloseHandle(handle);
+        return;
+    }
+
+    if ((uint64_t)size.QuadPart > (uint64_t)(SIZE_MAX >> 1)) {
+        SetLastError(ERROR_FILE_TOO_LARGE);
+        fail(request, "read");
+        CloseHandle(handle);
+        return;
+    }
+
+    request->size = (size_t)size.QuadPart;
+    request->data = malloc(request->size + request->extraBytes + 1);
+    if (!request->data) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        fail(request, "read");
+    } else if (!readAll(handle, request->data, request->size))
+        fail(request, "read");
+
+    CloseHandle(handle);
+}
+
+static bool isIdentical(const WCHAR* wpath, const void* data, size_t size)
+{
+    HANDLE handle = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(handle, &fileSize) || (uint64_t)fileSize.QuadPart != (uint64_t)size) {
+        CloseHandle(handle);
+        return false;
+    }
+
+    char chunk[COMPARE_CHUNK_SIZE];
+    size_t offset = 0;
+    while (offset < size) {
+        size_t chunkSize = size - offset;
+        if (chunkSize > COMPARE_CHUNK_SIZE)
+            chunkSize = COMPARE_CHUNK_SIZE;
+
+        if (!readAll(handle, chunk, chunkSize) || memcmp(chunk, (const char*)data + offset, chunkSize) != 0) {
+            CloseHandle(handle);
+            return false;
+        }
+
+        offset += chunkSize;
+    }
+
+    CloseHandle(handle);
+    return true;
+}
+
+static bool makeTempName(BatchRequest* request, WCHAR* wtmpPath)
+{
+    char tmpPath[DIR_MAX + TEMP_NAME_EXTRA];
+    if (!File_MakeTempName(tmpPath, sizeof(tmpPath), request->path)
+            || !toUtf16(tmpPath, wtmpPath, DIR_MAX + TEMP_NAME_EXTRA)) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return false;
+    }
+    return true;
+}
+
+static void writeFile(BatchRequest* request)
+{
+    WCHAR wpath[DIR_MAX], wtmpPath[DIR_MAX + TEMP_NAME_EXTRA];
+    if (!toUtf16(request->path, wpath, DIR_MAX)) {
+        fail(request, "create");
+        return;
+    }
+
+    if (isIdentical(wpath, request->data, request->size))
+        return;
+
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < MAX_TEMP_NAME_ATTEMPTS && handle == INVALID_HANDLE_VALUE; i++) {
+        if (!makeTempName(request, wtmpPath))
+            break;
+        handle = CreateFileW(wtmpPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL);
+        if (handle == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_EXISTS)
+            break;
+    }
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        fail(request, "create");
+        return;
+    }
+
+    if (!writeAll(handle, request->data, request->size))
+        fail(request, "write");
+    else if (request->sync && !FlushFileBuffers(handle))
+        fail(request, "flush");
+
+    CloseHandle(handle);
+
+    if (request->error == 0 && !MoveFileExW(wtmpPath, wpath, MOVEFILE_REPLACE_EXISTING))
+        fail(request, "rename");
+
+    if (request->error != 0)
+        DeleteFileW(wtmpPath);
+    else
+        request->written = true;
+}
+
+static void copyFile(BatchRequest* request)
+{
+    WCHAR wsrcPath[DIR_MAX], wpath[DIR_MAX], wtmpPath[DIR_MAX + TEMP_NAME_EXTRA];
+    if (!toUtf16(request->srcPath, wsrcPath, DIR_MAX) || !toUtf16(request->path, wpath, DIR_MAX)) {
+        fail(request, "copy");
+        return;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA src, dst;
+    if (!GetFileAttributesExW(wsrcPath, GetFileExInfoStandard, &src)) {
+        fail(request, "open");
+        return;
+    }
+
+    if (GetFileAttributesExW(wpath, GetFileExInfoStandard, &dst)
+            && !(dst.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            && dst.nFileSizeHigh == src.nFileSizeHigh && dst.nFileSizeLow == src.nFileSizeLow
+            && CompareFileTime(&dst.ftLastWriteTime, &src.ftLastWriteTime) == 0)
+        return;
+
+    /* CopyFile keeps timestamps and attributes, and lets the system choose how to copy (including block cloning) */
+    bool copied = false;
+    for (int i = 0; i < MAX_TEMP_NAME_ATTEMPTS && !copied; i++) {
+        if (!makeTempName(request, wtmpPath)) {
+            fail(request, "copy");
+            return;
+        }
+        copied = CopyFileW(wsrcPath, wtmpPath, TRUE);
+        if (!copied && GetLastError() != ERROR_FILE_EXISTS) {
+            fail(request, "copy");
+            DeleteFileW(wtmpPath);
+            return;
+        }
+    }
+
+    if (!copied) {
+        fail(request, "copy");
+        return;
+    }
+
+    if (request->sync) {
+        HANDLE handle = CreateFileW(wtmpPath, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (handle == INVALID_HANDLE_VALUE || !FlushFileBuffers(handle))
+            fail(request, "flush");
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+    }
+
+    if (request->error == 0 && !MoveFileExW(wtmpPath, wpath, MOVEFILE_REPLACE_EXISTING))
+        fail(request, "rename");
+
+    if (request->error != 0)
+        DeleteFileW(wtmpPath);
+    else
+        request->written = true;
+}
+
+#else
+
+static bool readAll(int fd, void* buf, size_t size)
+{
+    char* ptr = (char*)buf;
+    while (size != 0) {
+        size_t bytesToRead = (size > MAX_IO_CHUNK ? MAX_IO_CHUNK : size);
+        ssize_t bytesRead = read(fd, ptr, bytesToRead);
+        if (bytesRead < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (bytesRead == 0) {
+            errno = EIO;
+            return false;
+        }
+        ptr += bytesRead;
+        size -= (size_t)bytesRead;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void* buf, size_t size)
+{
+    const char* ptr = (const char*)buf;
+    while (size != 0) {
+        size_t bytesToWrite = (size > MAX_IO_CHUNK ? MAX_IO_CHUNK : size);
+        ssize_t bytesWritten = write(fd, ptr, bytesToWrite);
+        if (bytesWritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        ptr += bytesWritten;
+        size -= (size_t)bytesWritten;
+    }
+    return true;
+}
+
+static void fail(BatchRequest* request, const char* action)
+{
+    request->failedAction = action;
+    request->error = errno;
+}
+
+static void readFile(BatchRequest* request)
+{
+    int fd = open(request->path, O_RDONLY | O_BINARY | O_CLOEXEC);
+    if (fd < 0) {
+        fail(request, "open");
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fail(request, "read");
+        close(fd);
+        return;
+    }
+
+    if ((uint64_t)st.st_size > (uint64_t)(SIZE_MAX >> 1)) {
+        errno = EFBIG;
+        fail(request, "read");
+        close(fd);
+        return;
+    }
+
+  #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  #endif
+
+    request->size = (size_t)st.st_size;
+    request->data = malloc(request->size + request->extraBytes + 1);
+    if (!request->data) {
+        errno = ENOMEM;
+        fail(request, "read");
+    } else if (!readAll(fd, request->data, request->size))
+        fail(request, "read");
+
+    close(fd);
+}
+
+static bool isIdentical(const char* path, const void* data, size_t size)
+{
+    /* files of different size are not opened at all */
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != (uint64_t)size)
+        return false;
+
+    int fd = open(path, O_RDONLY | O_BINARY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    char chunk[COMPARE_CHUNK_SIZE];
+    size_t offset = 0;
+    while (offset < size) {
+        size_t chunkSize = size - offset;
+        if (chunkSize > COMPARE_CHUNK_SIZE)
+            chunkSize = COMPARE_CHUNK_SIZE;
+
+        if (!readAll(fd, chunk, chunkSize) || memcmp(chunk, (const char*)data + offset, chunkSize) != 0) {
+            close(fd);
+            return false;
+        }
+
+        offset += chunkSize;
+    }
+
+    close(fd);
+    return true;
+}
+
+static void syncDirectoryOf(BatchRequest* request)
+{
+  #ifdef _WIN32
+    DONT_WARN_UNUSED(request);
+  #else
+    char dir[DIR_MAX];
+    size_t len = strlen(request->path);
+    if (len >= sizeof(dir))
+        return;
+
+    memcpy(dir, request->path, len + 1);
+    if (!Dir_RemoveLastPath(dir))
+        strcpy(dir, ".");
+
+    int fd = open(dir, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0)
+        fail(request, "flush directory of");
+    if (fd >= 0)
+        close(fd);
+  #endif
+}
+
+static char* createTempFile(BatchRequest* request, int* outFd)
+{
+    size_t tmpPathSize = strlen(request->path) + TEMP_NAME_EXTRA;
+    char* tmpPath = (char*)malloc(tmpPathSize);
+    if (!tmpPath) {
+        errno = ENOMEM;
+        fail(request, "create");
+        return NULL;
+    }
+
+    *outFd = -1;
+    for (int i = 0; i < MAX_TEMP_NAME_ATTEMPTS && *outFd < 0; i++) {
+        if (!File_MakeTempName(tmpPath, tmpPathSize, request->path)) {
+            errno = ENAMETOOLONG;
+            break;
+        }
+        *outFd = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_BINARY | O_CLOEXEC, 0666);
+        if (*outFd < 0 && errno != EEXIST)
+            break;
+    }
+
+    if (*outFd < 0) {
+        fail(request, "create");
+        free(tmpPath);
+        return NULL;
+    }
+
+    return tmpPath;
+}
+
+/* closes the temporary file and, unless the request failed, renames it over the target */
+static void replaceWithTempFile(BatchRequest* request, char* tmpPath, int fd)
+{
+    if (request->error == 0 && request->sync && fsync(fd) != 0)
+        fail(request, "flush");
+
+    close(fd);
+
+    if (request->error == 0 && rename(tmpPath, request->path) != 0)
+        fail(request, "rename");
+
+    if (request->error != 0)
+        unlink(tmpPath);
+    else {
+        request->written = true;
+        if (request->sync)
+            syncDirectoryOf(request);
+    }
+
+    free(tmpPath);
+}
+
+#ifndef _WIN32
+
+/* symbolic links and special files are written through rather than replaced */
+static void writeInPlace(BatchRequest* request)
+{
+    int fd = open(request->path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fail(request, "create");
+        return;
+    }
+
+    if (!writeAll(fd, request->data, request->size))
+        fail(request, "write");
+    else if (request->sync && fsync(fd) != 0)
+        fail(request, "flush");
+
+    close(fd);
+
+    if (request->error == 0)
+        request->written = true;
+}
+
+#endif
+
+static void writeFile(BatchRequest* request)
+{
+    if (isIdentical(request->path, request->data, request->size))
+        return;
+
+  #ifndef _WIN32
+    struct stat st;
+    bool exists = (lstat(request->path, &st) == 0);
+    if (exists && !S_ISREG(st.st_mode)) {
+        writeInPlace(request);
+        return;
+    }
+  #endif
+
+    int fd;
+    char* tmpPath = createTempFile(request, &fd);
+    if (!tmpPath)
+        return;
+
+    if (!writeAll(fd, request->data, request->size))
+        fail(request, "write");
+
+  #ifndef _WIN32
+    /* the replacement keeps the permissions of the file it replaces */
+    if (request->error == 0 && exists && fchmod(fd, st.st_mode & 07777) != 0)
+        fail(request, "write");
+  #endif
+
+    replaceWithTempFile(request, tmpPath, fd);
+}
+
+static bool isSameTime(const struct stat* a, const struct stat* b)
+{
+  #ifdef __linux__
+    return a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+  #else
+    return a->st_mtime == b->st_mtime;
+  #endif
+}
+
+/* reflink if the file system can share extents, then in-kernel copy, then read() and write() through a buffer */
+static bool copyData(int srcFd, int dstFd)
+{
+  #if defined(__linux__) && defined(FICLONE)
+    if (ioctl(dstFd, FICLONE, srcFd) == 0)
+        return true;
+  #endif
+
+  #ifdef __linux__
+    bool copied = false;
+    for (;;) {
+        ssize_t bytesCopied = copy_file_range(srcFd, NULL, dstFd, NULL, MAX_IO_CHUNK, 0);
+        if (bytesCopied > 0) {
+            copied = true;
+            continue;
+        }
+        if (bytesCopied == 0)
+            return true;
+        if (errno == EINTR)
+            continue;
+        if (copied || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP))
+            return false;
+        break;
+    }
+  #endif
+
+    char* buf = (char*)malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    for (;;) {
+        ssize_t bytesRead = read(srcFd, buf, COPY_BUFFER_SIZE);
+        if (bytesRead < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return false;
+        }
+        if (bytesRead == 0)
+            break;
+        if (!writeAll(dstFd, buf, (size_t)bytesRead)) {
+            free(buf);
+            return false;
+        }
+    }
+
+    free(buf);
+    return true;
+}
+
+static void copyFile(BatchRequest* request)
+{
+    int srcFd = open(request->srcPath, O_RDONLY | O_BINARY | O_CLOEXEC);
+    if (srcFd < 0) {
+        fail(request, "open");
+        return;
+    }
+
+    struct stat src, dst;
+    if (fstat(srcFd, &src) != 0) {
+        fail(request, "open");
+        close(srcFd);
+        return;
+    }
+
+    if (!S_ISREG(src.st_mode)) {
+        errno = (S_ISDIR(src.st_mode) ? EISDIR : EINVAL);
+        fail(request, "open");
+        close(srcFd);
+        return;
+    }
+
+    /* copies keep the modification time of the source, so a target of the same size and time is up to date */
+    if (stat(request->path, &dst) == 0 && S_ISREG(dst.st_mode)
+            && dst.st_size == src.st_size && isSameTime(&dst, &src)) {
+        close(srcFd);
+        return;
+    }
+
+  #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(srcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  #endif
+
+    int fd;
+    char* tmpPath = createTempFile(request, &fd);
+    if (!tmpPath) {
+        close(srcFd);
+        return;
+    }
+
+    if (!copyData(srcFd, fd))
+        fail(request, "copy");
+    close(srcFd);
+
+  #ifndef _WIN32
+    if (request->error == 0) {
+        struct timespec times[2];
+       #ifdef __linux__
+        times[0] = src.st_atim;
+        times[1] = src.st_mtim;
+       #else
+        times[0].tv_sec = src.st_atime;
+        times[0].tv_nsec = 0;
+        times[1].tv_sec = src.st_mtime;
+        times[1].tv_nsec = 0;
+       #endif
+        if (fchmod(fd, src.st_mode & 07777) != 0 || futimens(fd, times) != 0)
+            fail(request, "copy");
+    }
+  #endif
+
+    replaceWithTempFile(request, tmpPath, fd);
+}
+
+#endif
+
+/********************************************************************************************************************/
+
+static void work(BatchIO* batch, bool mayWait)
+{
+    Mutex_Lock(batch->mutex);
+
+    while (!batch->stopping && batch->nextRequest < batch->count) {
+        if (batch->bytesAhead >= batch->maxBytesAhead && batch->nextRequest > batch->wanted) {
+            if (!mayWait)
+                break;
+            CondVar_Wait(batch->workCond, batch->mutex);
+            continue;
+        }
+
+        BatchRequest* request = &batch->requests[batch->nextRequest++];
+        Mutex_Unlock(batch->mutex);
+
+        switch (request->op) {
+            case BATCH_READ: readFile(request); break;
+            case BATCH_WRITE: writeFile(request); break;
+            case BATCH_COPY: copyFile(request); break;
+        }
+
+        Mutex_Lock(batch->mutex);
+        request->done = true;
+        if (request->op == BATCH_READ)
+            batch->bytesAhead += request->size;
+        CondVar_Broadcast(batch->doneCond);
+    }
+
+    Mutex_Unlock(batch->mutex);
+}
+
+static void workerThread(void* arg)
+{
+    work((BatchIO*)arg, true);
+}
+
+static void stopWorkers(BatchIO* batch)
+{
+    if (batch->threadCount == 0)
+        return;
+
+    Mutex_Lock(batch->mutex);
+    batch->stopping = true;
+    CondVar_Broadcast(batch->workCond);
+    Mutex_Unlock(batch->mutex);
+
+    for (size_t i = 0; i < batch->threadCount; i++)
+        Thread_Join(batch->threads[i]);
+
+    batch->threadCount = 0;
+    batch->stopping = false;
+}
+
+static int batchio_gc(lua_State* L)
+{
+    BatchIO* batch = (BatchIO*)luaL_checkudata(L, 1, BATCHIO_MT);
+
+    BatchIO_Clear(batch);
+    free(batch->requests);
+    batch->requests = NULL;
+    batch->capacity = 0;
+
+    if (batch->doneCond) {
+        CondVar_Destroy(batch->doneCond);
+        batch->doneCond = NULL;
+    }
+
+    if (batch->workCond) {
+        CondVar_Destroy(batch->workCond);
+        batch->workCond = NULL;
+    }
+
+    if (batch->mutex) {
+        Mutex_Destroy(batch->mutex);
+        batch->mutex = NULL;
+    }
+
+    return 0;
+}
+
+BatchIO* BatchIO_PushNew(lua_State* L)
+{
+    BatchIO* batch = (BatchIO*)lua_newuserdatauv(L, sizeof(BatchIO), 0);
+    memset(batch, 0, sizeof(BatchIO));
+
+    if (luaL_newmetatable(L, BATCHIO_MT)) {
+        lua_pushcfunction(L, batchio_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    return batch;
+}
+
+static BatchRequest* addRequest(lua_State* L, BatchIO* batch, batchop_t op, const char* path)
+{
+    if (batch->threadCount != 0)
+        luaL_error(L, "can't add requests to a running batch.");
+
+    if (batch->count == batch->capacity) {
+        size_t newCapacity = (batch->capacity ? batch->capacity * 2 : 64);
+        BatchRequest* newRequests = (BatchRequest*)realloc(batch->requests, newCapacity * sizeof(BatchRequest));
+        if (!newRequests)
+            luaL_error(L, "out of memory.");
+        batch->requests = newRequests;
+        batch->capacity = newCapacity;
+    }
+
+    size_t pathLen = strlen(path) + 1;
+    char* pathCopy = (char*)malloc(pathLen);
+    if (!pathCopy)
+        luaL_error(L, "out of memory.");
+    memcpy(pathCopy, path, pathLen);
+
+    BatchRequest* request = &batch->requests[batch->count++];
+    memset(request, 0, sizeof(BatchRequest));
+    request->op = op;
+    request->path = pathCopy;
+
+    return request;
+}
+
+size_t BatchIO_AddRead(lua_State* L, BatchIO* batch, const char* path, size_t extraBytes)
+{
+    BatchRequest* request = addRequest(L, batch, BATCH_READ, path);
+    request->extraBytes = extraBytes;
+    return batch->count - 1;
+}
+
+void* BatchIO_AddWriteBuffer(lua_State* L, BatchIO* batch, const char* path, size_t size)
+{
+    BatchRequest* request = addRequest(L, batch, BATCH_WRITE, path);
+
+    request->data = malloc(size + 1);
+    if (!request->data)
+        luaL_error(L, "out of memory.");
+    request->size = size;
+
+    request->sync = !File_TryDeferSync(L, path);
+
+    return request->data;
+}
+
+size_t BatchIO_AddWrite(lua_State* L, BatchIO* batch, const char* path, const void* data, size_t size)
+{
+    memcpy(BatchIO_AddWriteBuffer(L, batch, path, size), data, size);
+    return batch->count - 1;
+}
+
+size_t BatchIO_AddCopy(lua_State* L, BatchIO* batch, const char* srcPath, const char* dstPath)
+{
+    BatchRequest* request = addRequest(L, batch, BATCH_COPY, dstPath);
+
+    size_t srcPathLen = strlen(srcPath) + 1;
+    request->srcPath = (char*)malloc(srcPathLen);
+    if (!request->srcPath)
+        luaL_error(L, "out of memory.");
+    memcpy(request->srcPath, srcPath, srcPathLen);
+
+    request->sync = !File_TryDeferSync(L, dstPath);
+
+    return batch->count - 1;
+}
+
+size_t BatchIO_GetCount(const BatchIO* batch)
+{
+    return batch->count;
+}
+
+BatchRequest* BatchIO_Get(BatchIO* batch, size_t index)
+{
+    assert(index < batch->count);
+    return &batch->requests[index];
+}
+
+static void startWorkers(lua_State* L, BatchIO* batch, size_t maxBytesAhead, size_t reservedThreads)
+{
+    if (!batch->mutex) {
+        batch->mutex = Mutex_Create();
+        batch->workCond = CondVar_Create();
+        batch->doneCond = CondVar_Create();
+        if (!batch->mutex || !batch->workCond || !batch->doneCond)
+            luaL_error(L, "out of memory.");
+    }
+
+    batch->maxBytesAhead = maxBytesAhead;
+    batch->wanted = batch->nextRequest;
+
+    /* workers spend most of their time waiting for the disk, so there may be more of them than CPUs */
+    size_t threadCount = (size_t)Thread_GetCPUCount();
+    if (threadCount < BATCHIO_MIN_THREADS)
+        threadCount = BATCHIO_MIN_THREADS;
+    if (threadCount > BATCHIO_MAX_THREADS)
+        threadCount = BATCHIO_MAX_THREADS;
+    if (threadCount > batch->count - batch->nextRequest)
+        threadCount = batch->count - batch->nextRequest;
+
+    while (batch->threadCount + reservedThreads < threadCount) {
+        Thread* thread = Thread_Start(workerThread, batch);
+        if (!thread)
+            break;
+        batch->threads[batch->threadCount++] = thread;
+    }
+}
+
+void BatchIO_Run(lua_State* L, BatchIO* batch)
+{
+    if (batch->nextRequest >= batch->count)
+        return;
+
+    startWorkers(L, batch, SIZE_MAX, 1);
+
+    /* calling thread works too, so requests are carried out even if no threads could be started */
+    work(batch, false);
+
+    BatchIO_Finish(batch);
+}
+
+void BatchIO_Start(lua_State* L, BatchIO* batch, size_t maxBytesAhead)
+{
+    if (batch->nextRequest >= batch->count)
+        return;
+
+    startWorkers(L, batch, maxBytesAhead, 0);
+}
+
+BatchRequest* BatchIO_Wait(BatchIO* batch, size_t index)
+{
+    BatchRequest* request = BatchIO_Get(batch, index);
+
+    Mutex_Lock(batch->mutex);
+    if (request->done) {
+        Mutex_Unlock(batch->mutex);
+        return request;
+    }
+
+    if (index > batch->wanted) {
+        batch->wanted = index;
+        CondVar_Broadcast(batch->workCond);
+    }
+
+    /* if no threads could be started, requests are carried out on the calling thread */
+    if (batch->threadCount == 0) {
+        Mutex_Unlock(batch->mutex);
+        work(batch, false);
+        return request;
+    }
+
+    while (!request->done)
+        CondVar_Wait(batch->doneCond, batch->mutex);
+    Mutex_Unlock(batch->mutex);
+
+    return request;
+}
+
+void BatchIO_Release(BatchIO* batch, size_t index)
+{
+    BatchRequest* request = BatchIO_Get(batch, index);
+    assert(request->done);
+
+    Mutex_Lock(batch->mutex);
+    if (request->op == BATCH_READ)
+        batch->bytesAhead -= request->size;
+    CondVar_Broadcast(batch->workCond);
+    Mutex_Unlock(batch->mutex);
+
+    free(request->data);
+    request->data = NULL;
+    request->size = 0;
+}
+
+void BatchIO_Finish(BatchIO* batch)
+{
+    stopWorkers(batch);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        if (batch->requests[i].written)
+            StatCache_Invalidate(batch->requests[i].path);
+    }
+}
+
+void BatchIO_Check(lua_State* L, const BatchRequest* request)
+{
+    if (request->error == 0)
+        return;
+
+    if (request->op == BATCH_COPY) {
+      #if defined(_WIN32) && !defined(USE_POSIX_IO)
+        luaL_error(L, "unable to copy file \"%s\" to \"%s\" (%s failed, code %p)",
+            request->srcPath, request->path, request->failedAction, (void*)(size_t)request->error);
+      #else
+        luaL_error(L, "unable to copy file \"%s\" to \"%s\" (%s failed): %s",
+            request->srcPath, request->path, request->failedAction, strerror(request->error));
+      #endif
+    }
+
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
+    luaL_error(L, "unable to %s file \"%s\" (code %p)",
+        request->failedAction, request->path, (void*)(size_t)request->error);
+  #else
+    luaL_error(L, "unable to %s file \"%s\": %s", request->failedAction, request->path, strerror(request->error));
+  #endif
+}
+
+void BatchIO_Clear(BatchIO* batch)
+{
+    stopWorkers(batch);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->requests[i].path);
+        free(batch->requests[i].srcPath);
+        free(batch->requests[i].data);
+    }
+
+    batch->count = 0;
+    batch->nextRequest = 0;
+    batch->bytesAhead = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef COMMON_BATCHIO_H
+#define COMMON_BATCHIO_H
+
+#include <common/common.h>
+
+/*
+ * Batched file I/O. Whole-file reads, "write unless identical" and copy requests are queued, then carried out together
+ * by a pool of worker threads, so that the latency of many small opens, reads and writes overlaps. Workers don't
+ * touch Lua: failures are recorded in the request and raised by BatchIO_Check on the calling thread.
+ *
+ * BatchIO_Run carries out all requests and returns when they are complete. Alternatively, BatchIO_Start lets the
+ * workers run in the background, and requests are consumed in order with BatchIO_Wait and BatchIO_Release.
+ */
+
+typedef enum batchop_t {
+    BATCH_READ,
+    BATCH_WRITE,
+    BATCH_COPY,
+} batchop_t;
+
+STRUCT(BatchIO);
+
+STRUCT(BatchRequest) {
+    batchop_t op;
+    char* path;
+    char* srcPath;              /* COPY only */
+    void* data;                 /* READ: contents, followed by extraBytes of space; WRITE: copy of the new contents */
+    size_t size;
+    size_t extraBytes;
+    bool sync;                  /* WRITE, COPY: flush file and directory, set when not inside of a sync batch */
+    bool written;               /* WRITE: false if the file already had the same contents;
+                                   COPY: false if the target already had the same size and modification time */
+    bool done;                  /* set by the worker that carried out the request */
+    const char* failedAction;
+    int error;
+};
+
+BatchIO* BatchIO_PushNew(lua_State* L);
+
+size_t BatchIO_AddRead(lua_State* L, BatchIO* batch, const char* path, size_t extraBytes);
+size_t BatchIO_AddWrite(lua_State* L, BatchIO* batch, const char* path, const void* data, size_t size);
+void* BatchIO_AddWriteBuffer(lua_State* L, BatchIO* batch, const char* path, size_t size); /* fill before running */
+size_t BatchIO_AddCopy(lua_State* L, BatchIO* batch, const char* srcPath, const char* dstPath);
+
+size_t BatchIO_GetCount(const BatchIO* batch);
+BatchRequest* BatchIO_Get(BatchIO* batch, size_t index);
+
+void BatchIO_Run(lua_State* L, BatchIO* batch);
+
+void BatchIO_Start(lua_State* L, BatchIO* batch, size_t maxBytesAhead);
+BatchRequest* BatchIO_Wait(BatchIO* batch, size_t index);
+void BatchIO_Release(BatchIO* batch, size_t index);
+void BatchIO_Finish(BatchIO* batch);
+
+void BatchIO_Check(lua_State* L, const BatchRequest* request);
+void BatchIO_Clear(BatchIO* batch);
+
+#endif
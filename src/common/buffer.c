@@ -0,0 +1,358 @@
+#include <common/buffer.h>
+#include <common/thread.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+#else
+ #include <sys/mman.h>
+#endif
+
+/* allocations of this size and larger bypass the C runtime heap and go directly to the OS */
+#define VIRTUAL_THRESHOLD (1024 * 1024)
+
+typedef enum storage_t {
+    STORAGE_HEAP = 0,
+    STORAGE_VIRTUAL,
+    STORAGE_MAPPED,
+} storage_t;
+
+struct BufferStorage
+{
+    volatile long refCount;
+    storage_t type;
+    size_t size;
+    char* data;
+};
+
+/********************************************************************************************************************/
+
+static int buffer_close(lua_State* L)
+{
+    Buffer* buffer = (Buffer*)luaL_checkudata(L, 1, BUFFER_MT);
+    Buffer_Close(buffer);
+    return 0;
+}
+
+static int buffer_len(lua_State* L)
+{
+    Buffer* buffer = Buffer_Check(L, 1);
+    lua_pushinteger(L, (lua_Integer)buffer->size);
+    return 1;
+}
+
+static int buffer_sub(lua_State* L)
+{
+    Buffer* buffer = Buffer_Check(L, 1);
+    lua_Integer size = (lua_Integer)buffer->size;
+    lua_Integer start = luaL_optinteger(L, 2, 1);
+    lua_Integer end = luaL_optinteger(L, 3, -1);
+
+    /* same index semantics as string.sub */
+    if (start < 0)
+        start = (start < -size ? 1 : size + start + 1);
+    else if (start == 0)
+        start = 1;
+    if (end < 0)
+        end = size + end + 1;
+    else if (end > size)
+        end = size;
+
+    if (start > end)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, buffer->data + start - 1, (size_t)(end - start + 1));
+
+    return 1;
+}
+
+static int buffer_byte(lua_State* L)
+{
+    Buffer* buffer = Buffer_Check(L, 1);
+    lua_Integer size = (lua_Integer)buffer->size;
+    lua_Integer start = luaL_optinteger(L, 2, 1);
+    lua_Integer end = luaL_optinteger(L, 3, start);
+
+    if (start < 0)
+        start = (start < -size ? 1 : size + start + 1);
+    else if (start == 0)
+        start = 1;
+    if (end < 0)
+        end = size + end + 1;
+    else if (end > size)
+        end = size;
+
+    if (start > end)
+        return 0;
+    if (end - start >= INT_MAX)
+        return luaL_error(L, "buffer slice too long");
+
+    int n = (int)(end - start) + 1;
+    luaL_checkstack(L, n, "buffer slice too long");
+    for (int i = 0; i < n; i++)
+        lua_pushinteger(L, (unsigned char)buffer->data[start + i - 1]);
+
+    return n;
+}
+
+/* plain search only, Lua patterns would need the data as a string */
+static int buffer_find(lua_State* L)
+{
+    Buffer* buffer = Buffer_Check(L, 1);
+    size_t needleLen;
+    const char* needle = luaL_checklstring(L, 2, &needleLen);
+    lua_Integer size = (lua_Integer)buffer->size;
+    lua_Integer init = luaL_optinteger(L, 3, 1);
+
+    if (init < 0)
+        init = (init < -size ? 1 : size + init + 1);
+    else if (init == 0)
+        init = 1;
+    if (init > size + 1) {
+        luaL_pushfail(L);
+        return 1;
+    }
+
+    const char* p = buffer->data + init - 1;
+    const char* end = buffer->data + buffer->size;
+    if (needleLen == 0) {
+        lua_pushinteger(L, init);
+        lua_pushinteger(L, init - 1);
+        return 2;
+    }
+
+    while ((size_t)(end - p) >= needleLen) {
+        p = (const char*)memchr(p, needle[0], (size_t)(end - p) - needleLen + 1);
+        if (!p)
+            break;
+        if (!memcmp(p, needle, needleLen)) {
+            lua_Integer offset = (lua_Integer)(p - buffer->data);
+            lua_pushinteger(L, offset + 1);
+            lua_pushinteger(L, offset + (lua_Integer)needleLen);
+            return 2;
+        }
+        ++p;
+    }
+
+    luaL_pushfail(L);
+    return 1;
+}
+
+static int buffer_tostring(lua_State* L)
+{
+    Buffer* buffer = (Buffer*)luaL_checkudata(L, 1, BUFFER_MT);
+    if (!buffer->data)
+        lua_pushliteral(L, "buffer (closed)");
+    else
+        lua_pushfstring(L, "buffer (%I bytes)", (lua_Integer)buffer->size);
+    return 1;
+}
+
+static const luaL_Reg buffer_methods[] = {
+    { "byte", buffer_byte },
+    { "close", buffer_close },
+    { "find", buffer_find },
+    { "len", buffer_len },
+    { "sub", buffer_sub },
+    { NULL, NULL }
+};
+
+static const luaL_Reg buffer_metamethods[] = {
+    { "__gc", buffer_close },
+    { "__close", buffer_close },
+    { "__len", buffer_len },
+    { "__tostring", buffer_tostring },
+    { NULL, NULL }
+};
+
+/********************************************************************************************************************/
+
+static Buffer* pushBuffer(lua_State* L)
+{
+    Buffer* buffer = (Buffer*)lua_newuserdatauv(L, sizeof(Buffer), 0);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->storage = NULL;
+
+    if (luaL_newmetatable(L, BUFFER_MT)) {
+        luaL_setfuncs(L, buffer_metamethods, 0);
+        luaL_newlib(L, buffer_methods);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    return buffer;
+}
+
+Buffer* Buffer_PushNew(lua_State* L, size_t size)
+{
+    Buffer* buffer = pushBuffer(L);
+
+    BufferStorage* storage = (BufferStorage*)malloc(sizeof(BufferStorage));
+    if (!storage)
+        luaL_error(L, "out of memory.");
+
+    storage->refCount = 1;
+    storage->type = STORAGE_HEAP;
+    storage->size = size;
+    storage->data = NULL;
+    buffer->storage = storage;
+
+    /* one extra zero byte, so that the contents could be used as a C string */
+    size_t allocSize = size + 1;
+    if (allocSize < size)
+        luaL_error(L, "buffer size is too large.");
+
+    if (allocSize < VIRTUAL_THRESHOLD)
+        storage->data = (char*)calloc(1, allocSize);
+    else {
+      #ifdef _WIN32
+        storage->data = (char*)VirtualAlloc(NULL, allocSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+      #else
+        void* ptr = mmap(NULL, allocSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        storage->data = (ptr != MAP_FAILED ? (char*)ptr : NULL);
+      #endif
+        storage->type = STORAGE_VIRTUAL;
+    }
+
+    if (!storage->data)
+        luaL_error(L, "unable to allocate buffer of %I bytes.", (lua_Integer)size);
+
+    buffer->data = storage->data;
+    buffer->size = size;
+    return buffer;
+}
+
+static void unmapView(void* view, size_t size)
+{
+  #ifdef _WIN32
+    DONT_WARN_UNUSED(size);
+    UnmapViewOfFile(view);
+  #else
+    munmap(view, size);
+  #endif
+}
+
+static int lua_pushbuffer(lua_State* L)
+{
+    pushBuffer(L);
+    return 1;
+}
+
+/* the view belongs to the buffer from now on, it is unmapped here if the buffer can't be created */
+Buffer* Buffer_PushMapped(lua_State* L, void* view, size_t size)
+{
+    lua_pushcfunction(L, lua_pushbuffer);
+    if (lua_pcall(L, 0, 1, 0) != LUA_OK) {
+        unmapView(view, size);
+        lua_error(L);
+    }
+    Buffer* buffer = (Buffer*)lua_touserdata(L, -1);
+
+    BufferStorage* storage = (BufferStorage*)malloc(sizeof(BufferStorage));
+    if (!storage) {
+        unmapView(view, size);
+        luaL_error(L, "out of memory.");
+    }
+
+    storage->refCount = 1;
+    storage->type = STORAGE_MAPPED;
+    storage->size = size;
+    storage->data = (char*)view;
+
+    buffer->storage = storage;
+    buffer->data = storage->data;
+    buffer->size = size;
+    return buffer;
+}
+
+void Buffer_Close(Buffer* buffer)
+{
+    BufferStorage* storage = buffer->storage;
+    if (!storage)
+        return;
+
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->storage = NULL;
+
+    Buffer_Release(storage);
+}
+
+/********************************************************************************************************************/
+
+BufferStorage* Buffer_Retain(Buffer* buffer)
+{
+    Atomic_Increment(&buffer->storage->refCount);
+    return buffer->storage;
+}
+
+void Buffer_Release(BufferStorage* storage)
+{
+    if (Atomic_Decrement(&storage->refCount) != 0)
+        return;
+
+    if (storage->data) {
+        switch (storage->type) {
+            case STORAGE_HEAP:
+                free(storage->data);
+                break;
+            case STORAGE_VIRTUAL:
+              #ifdef _WIN32
+                VirtualFree(storage->data, 0, MEM_RELEASE);
+              #else
+                munmap(storage->data, storage->size + 1);
+              #endif
+                break;
+            case STORAGE_MAPPED:
+              #ifdef _WIN32
+                UnmapViewOfFile(storage->data);
+              #else
+                munmap(storage->data, storage->size);
+              #endif
+                break;
+        }
+    }
+
+    free(storage);
+}
+
+Buffer* Buffer_PushShared(lua_State* L, BufferStorage* storage)
+{
+    Buffer* buffer = pushBuffer(L);
+    Atomic_Increment(&storage->refCount);
+    buffer->storage = storage;
+    buffer->data = storage->data;
+    buffer->size = storage->size;
+    return buffer;
+}
+
+/********************************************************************************************************************/
+
+Buffer* Buffer_Test(lua_State* L, int index)
+{
+    return (Buffer*)luaL_testudata(L, index, BUFFER_MT);
+}
+
+Buffer* Buffer_Check(lua_State* L, int index)
+{
+    Buffer* buffer = (Buffer*)luaL_checkudata(L, index, BUFFER_MT);
+    if (!buffer->data)
+        luaL_argerror(L, index, "buffer is closed");
+    return buffer;
+}
+
+const char* Buffer_CheckBytes(lua_State* L, int index, size_t* outSize)
+{
+    if (lua_type(L, index) == LUA_TUSERDATA) {
+        Buffer* buffer = Buffer_Check(L, index);
+        if (outSize)
+            *outSize = buffer->size;
+        return buffer->data;
+    }
+
+    return luaL_checklstring(L, index, outSize);
+}
@@ -0,0 +1,33 @@
+#ifndef COMMON_BUFFER_H
+#define COMMON_BUFFER_H
+
+#include <common/common.h>
+
+/* Large data is kept outside of the Lua heap so that it does not contribute to the GC debt */
+
+STRUCT(BufferStorage);
+
+STRUCT(Buffer) {
+    char* data;
+    size_t size;
+    BufferStorage* storage;
+};
+
+#define BUFFER_MT "Buffer*"
+
+Buffer* Buffer_PushNew(lua_State* L, size_t size);
+
+/* takes ownership of a read-only file view; its contents are not zero terminated */
+Buffer* Buffer_PushMapped(lua_State* L, void* view, size_t size);
+void Buffer_Close(Buffer* buffer);
+
+/* storage is reference counted and could be shared between Lua states on different threads */
+BufferStorage* Buffer_Retain(Buffer* buffer);
+void Buffer_Release(BufferStorage* storage);
+Buffer* Buffer_PushShared(lua_State* L, BufferStorage* storage);
+
+Buffer* Buffer_Test(lua_State* L, int index);
+Buffer* Buffer_Check(lua_State* L, int index);
+const char* Buffer_CheckBytes(lua_State* L, int index, size_t* outSize);
+
+#endif
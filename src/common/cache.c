@@ -0,0 +1,220 @@
+#include <common/cache.h>
+#include <common/console.h>
+#include <common/dirs.h>
+#include <common/file.h>
+#include <common/serialize.h>
+#include <string.h>
+
+/*
+ * Persistent key-value store for scripts, kept in file ".pour-cache" in the directory where it was first used.
+ * The file starts with CACHE_MAGIC followed by a serialized table which maps keys to serialized values. Values
+ * are kept serialized in memory too, so that scripts always get a fresh copy and can't modify the cache by
+ * accident. The file is mapped on first access and rewritten by Cache_Flush.
+ */
+
+#define CACHE_FILE ".pour-cache"
+#define CACHE_MAGIC "pour cache 1\n"
+
+static char CACHE;
+
+/********************************************************************************************************************/
+
+static void checkValue(lua_State* L, int index, int depth)
+{
+    index = lua_absindex(L, index);
+
+    switch (lua_type(L, index)) {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+            return;
+
+        case LUA_TTABLE:
+            if (depth > 100)
+                luaL_error(L, "table is too deep to be cached.");
+            luaL_checkstack(L, 2, "table is too deep");
+            lua_pushnil(L);
+            while (lua_next(L, index)) {
+                checkValue(L, -2, depth + 1);
+                checkValue(L, -1, depth + 1);
+                lua_pop(L, 1);
+            }
+            return;
+    }
+
+    luaL_error(L, "unable to cache value of type %s.", luaL_typename(L, index));
+}
+
+static int loadCache(lua_State* L)
+{
+    const char* path = lua_tostring(L, 1);
+
+    Buffer* buffer = File_PushMapped(L, path, FILE_ACCESS_SEQUENTIAL);
+    if (buffer->size < sizeof(CACHE_MAGIC) - 1 || memcmp(buffer->data, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) != 0) {
+        Buffer_Close(buffer);
+        return 0;
+    }
+
+    Serialized s;
+    Serialize_Init(&s);
+    s.data = (char*)buffer->data;
+    s.size = buffer->size;
+    s.dataOnly = true;
+
+    Serialize_PushValue(L, &s, sizeof(CACHE_MAGIC) - 1);
+    Buffer_Close(buffer);   /* file must not stay mapped, otherwise it can't be replaced on Windows */
+
+    return 1;
+}
+
+static int decodeValue(lua_State* L)
+{
+    Serialize_PushValue(L, (const Serialized*)lua_touserdata(L, 1), 0);
+    return 1;
+}
+
+static int pushCache(lua_State* L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &CACHE) == LUA_TTABLE)
+        return lua_gettop(L);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    int cacheIdx = lua_gettop(L);
+
+    File_PushCurrentDirectory(L);
+    lua_pushliteral(L, DIR_SEPARATOR CACHE_FILE);
+    lua_concat(L, 2);
+    const char* path = lua_tostring(L, -1);
+    lua_setfield(L, cacheIdx, "path");
+
+    bool loaded = false;
+    if (File_Exists(L, path)) {
+        /* a broken cache file is not fatal, it is simply rebuilt */
+        lua_pushcfunction(L, loadCache);
+        lua_getfield(L, cacheIdx, "path");
+        if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+            Con_PrintF(L, COLOR_WARNING, "WARNING: ignoring cache file \"%s\": %s\n", path, lua_tostring(L, -1));
+        else if (lua_istable(L, -1)) {
+            lua_setfield(L, cacheIdx, "values");
+            loaded = true;
+        }
+        if (!loaded)
+            lua_pop(L, 1);
+    }
+
+    if (!loaded) {
+        lua_newtable(L);
+        lua_setfield(L, cacheIdx, "values");
+    }
+
+    lua_pushvalue(L, cacheIdx);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &CACHE);
+
+    return cacheIdx;
+}
+
+/********************************************************************************************************************/
+
+void Cache_PushValue(lua_State* L, const char* key)
+{
+    int cacheIdx = pushCache(L);
+    lua_getfield(L, cacheIdx, "values");
+
+    size_t size;
+    const char* data = (lua_getfield(L, -1, key) == LUA_TSTRING ? lua_tolstring(L, -1, &size) : NULL);
+    if (!data) {
+        lua_settop(L, cacheIdx - 1);
+        lua_pushnil(L);
+        return;
+    }
+
+    Serialized s;
+    Serialize_Init(&s);
+    s.data = (char*)data;
+    s.size = size;
+    s.dataOnly = true;
+
+    /* a broken entry is a cache miss */
+    lua_pushcfunction(L, decodeValue);
+    lua_pushlightuserdata(L, &s);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+
+    lua_replace(L, cacheIdx);
+    lua_settop(L, cacheIdx);
+}
+
+void Cache_SetValue(lua_State* L, const char* key, int valueIdx)
+{
+    valueIdx = lua_absindex(L, valueIdx);
+    checkValue(L, valueIdx, 0);
+
+    int cacheIdx = pushCache(L);
+    lua_getfield(L, cacheIdx, "values");
+
+    if (lua_isnil(L, valueIdx))
+        lua_pushnil(L);
+    else {
+        Serialized s;
+        Serialize_Init(&s);
+        Serialize_Value(L, valueIdx, &s);   /* values are checked above, so this can only fail when out of memory */
+        lua_pushlstring(L, s.data, s.size);
+        Serialize_Free(&s);
+    }
+
+    lua_getfield(L, -2, key);
+    bool changed = !lua_rawequal(L, -1, -2);
+    lua_pop(L, 1);
+
+    if (changed) {
+        lua_setfield(L, -2, key);
+        lua_pushboolean(L, 1);
+        lua_setfield(L, cacheIdx, "dirty");
+    }
+
+    lua_settop(L, cacheIdx - 1);
+}
+
+int Cache_Flush(lua_State* L)
+{
+    int n = lua_gettop(L);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &CACHE) != LUA_TTABLE) {
+        lua_settop(L, n);
+        return 0;
+    }
+    int cacheIdx = lua_gettop(L);
+
+    lua_getfield(L, cacheIdx, "dirty");
+    bool dirty = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (!dirty) {
+        lua_settop(L, n);
+        return 0;
+    }
+
+    Serialized s;
+    Serialize_Init(&s);
+    lua_getfield(L, cacheIdx, "values");
+    Serialize_Value(L, -1, &s);
+
+    lua_pushliteral(L, CACHE_MAGIC);
+    lua_pushlstring(L, s.data, s.size);
+    Serialize_Free(&s);
+    lua_concat(L, 2);
+
+    size_t dataLen;
+    const char* data = lua_tolstring(L, -1, &dataLen);
+    lua_getfield(L, cacheIdx, "path");
+    File_Overwrite(L, lua_tostring(L, -1), data, dataLen);
+
+    lua_pushboolean(L, 0);
+    lua_setfield(L, cacheIdx, "dirty");
+
+    lua_settop(L, n);
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef COMMON_CACHE_H
+#define COMMON_CACHE_H
+
+#include <common/common.h>
+
+void Cache_PushValue(lua_State* L, const char* key);
+void Cache_SetValue(lua_State* L, const char* key, int valueIdx);
+int Cache_Flush(lua_State* L);
+
+#endif
@@ -2,7 +2,9 @@
 #include <common/console.h>
 #include <common/dirs.h>
 #include <common/script.h>
+#include <common/statcache.h>
 #include <common/utf8.h>
+#include <common/thread.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -22,11 +24,28 @@ static DWORD g_dwChildProcessId;
 static HANDLE g_hBackgroundJob;
 static HANDLE g_hBackgroundProcess;
 static DWORD g_dwBackgroundProcessId;
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #endif
 
 static bool g_initialized;
 bool g_dont_print_commands;
 
+#ifndef _WIN32
+/* processes whose handles were closed while they were still running, reaped later so they don't stay zombies */
+static Mutex* g_detachedMutex;
+static pid_t* g_detached;
+static size_t g_detachedCount;
+static size_t g_detachedCapacity;
+#endif
+
 #ifdef _WIN32
 static BOOL WINAPI Exec_CtrlHandler(DWORD ctrl)
 {
@@ -80,6 +99,10 @@ void Exec_Init(lua_State* L)
 
     SetConsoleCtrlHandler(Exec_CtrlHandler, TRUE);
 
+  #else
+
+    g_detachedMutex = Mutex_Create();
+
   #endif
 
     g_initialized = true;
@@ -122,11 +145,9 @@ bool Exec_Command(lua_State* L, const char* const* argv, int argc, const char* c
     return Exec_CommandV(L, argv[0], argv, argc, chdir, RUN_WAIT);
 }
 
-bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, int argc,
-    const char* chdir, runmode_t mode)
+static const char* pushCommandLine(lua_State* L, const char* command, const char* const* argv, int argc)
 {
-    int start = lua_gettop(L);
-    int argStart = start;
+    int argStart = lua_gettop(L);
 
     luaL_checkstack(L, 100, NULL);
 
@@ -146,7 +167,16 @@ bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, i
         pushArgument(L, argv[i]);
     }
     lua_concat(L, lua_gettop(L) - argStart);
-    const char* cmd = lua_tostring(L, -1);
+
+    return lua_tostring(L, -1);
+}
+
+bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, int argc,
+    const char* chdir, runmode_t mode)
+{
+    int start = lua_gettop(L);
+
+    const char* cmd = pushCommandLine(L, command, argv, argc);
 
     if (!g_dont_print_commands)
         Con_PrintF(L, COLOR_COMMAND, "# %s\n", cmd);
@@ -193,6 +223,7 @@ bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, i
     }
 
     if (mode != RUN_WAIT) {
+        StatCache_Flush();
         lua_settop(L, start);
         CloseHandle(pi.hThread);
         if (mode != RUN_BACKGROUND)
@@ -219,6 +250,7 @@ bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, i
     LeaveCriticalSection(&g_criticalSection);
 
     WaitForSingleObject(pi.hProcess, INFINITE);
+    StatCache_Flush();
 
     EnterCriticalSection(&g_criticalSection);
     g_dwChildProcessId = 0;
@@ -238,7 +270,10 @@ bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, i
 
   #else
 
-    if (system(cmd) != 0) {
+    int result = system(cmd);
+    StatCache_Flush();
+
+    if (result != 0) {
         lua_settop(L, start);
         return false;
     }
@@ -249,6 +284,299 @@ bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, i
     return true;
 }
 
+/********************************************************************************************************************/
+
+#ifndef _WIN32
+
+static void reapDetached(void)
+{
+    if (!g_detachedMutex)
+        return;
+
+    Mutex_Lock(g_detachedMutex);
+
+    size_t count = 0;
+    for (size_t i = 0; i < g_detachedCount; i++) {
+        pid_t result = waitpid(g_detached[i], NULL, WNOHANG);
+        if (result == 0 || (result < 0 && errno == EINTR))
+            g_detached[count++] = g_detached[i];
+    }
+    g_detachedCount = count;
+
+    Mutex_Unlock(g_detachedMutex);
+}
+
+static void detach(pid_t pid)
+{
+    if (waitpid(pid, NULL, WNOHANG) != 0 || !g_detachedMutex)
+        return;
+
+    Mutex_Lock(g_detachedMutex);
+
+    if (g_detachedCount == g_detachedCapacity) {
+        size_t newCapacity = (g_detachedCapacity ? g_detachedCapacity * 2 : 16);
+        pid_t* newDetached = (pid_t*)realloc(g_detached, newCapacity * sizeof(pid_t));
+        if (newDetached) {
+            g_detached = newDetached;
+            g_detachedCapacity = newCapacity;
+        }
+    }
+
+    /* without memory the process remains a zombie until pour exits */
+    if (g_detachedCount < g_detachedCapacity)
+        g_detached[g_detachedCount++] = pid;
+
+    Mutex_Unlock(g_detachedMutex);
+}
+
+#endif
+
+bool Exec_Spawn(lua_State* L, const char* const* argv, int argc, const char* dir, bool pipeOutput,
+    ExecProcess* process)
+{
+    int start = lua_gettop(L);
+
+    memset(process, 0, sizeof(ExecProcess));
+
+    const char* cmd = pushCommandLine(L, argv[0], argv, argc);
+
+    if (!g_dont_print_commands)
+        Con_PrintF(L, COLOR_COMMAND, "# %s &\n", cmd);
+
+  #ifdef _WIN32
+
+    WCHAR* cmd16 = (WCHAR*)Utf8_PushConvertToUtf16(L, cmd, NULL);
+    WCHAR* dir16 = (dir ? (WCHAR*)Utf8_PushConvertToUtf16(L, dir, NULL) : NULL);
+
+    STARTUPINFOW si;
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&si, sizeof(si));
+    ZeroMemory(&pi, sizeof(pi));
+    si.cb = sizeof(si);
+
+    HANDLE hWrite = NULL;
+    if (pipeOutput) {
+        SECURITY_ATTRIBUTES sa;
+        ZeroMemory(&sa, sizeof(sa));
+        sa.nLength = sizeof(sa);
+        sa.bInheritHandle = TRUE;
+
+        HANDLE hRead;
+        if (!CreatePipe(&hRead, &hWrite, &sa, 0)) {
+            Con_PrintF(L, COLOR_ERROR, "ERROR: CreatePipe failed (code 0x%p).\n", (void*)(size_t)GetLastError());
+            lua_settop(L, start);
+            return false;
+        }
+        SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+        process->hOutput = hRead;
+
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+        si.hStdOutput = hWrite;
+        si.hStdError = hWrite;
+    }
+
+    /* suspended until it is in its job, so that processes it starts are in the job too */
+    BOOL success = CreateProcessW(NULL, cmd16, NULL, NULL, TRUE, CREATE_DEFAULT_ERROR_MODE | CREATE_SUSPENDED,
+        NULL, dir16, &si, &pi);
+    DWORD dwError = GetLastError();
+
+    if (hWrite)
+        CloseHandle(hWrite);
+
+    if (!success) {
+        Con_PrintF(L, COLOR_ERROR, "ERROR: CreateProcess failed (code 0x%p).\n", (void*)(size_t)dwError);
+        Exec_CloseProcess(process);
+        lua_settop(L, start);
+        return false;
+    }
+
+    AssignProcessToJobObject(g_hChildJob, pi.hProcess);
+
+    /* nested jobs need Windows 8, older systems can only terminate the process itself */
+    process->hJob = CreateJobObject(NULL, NULL);
+    if (process->hJob && !AssignProcessToJobObject(process->hJob, pi.hProcess)) {
+        CloseHandle(process->hJob);
+        process->hJob = NULL;
+    }
+
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+    process->hProcess = pi.hProcess;
+
+  #else
+
+    process->pidfd = -1;
+    process->outputFd = -1;
+
+    reapDetached();
+
+    char** args = (char**)lua_newuserdatauv(L, sizeof(char*) * (size_t)(argc + 1), 0);
+    for (int i = 0; i < argc; i++)
+        args[i] = (char*)argv[i];
+    args[argc] = NULL;
+
+    int fds[2] = { -1, -1 };
+    if (pipeOutput) {
+        if (pipe(fds) != 0) {
+            Con_PrintF(L, COLOR_ERROR, "ERROR: pipe() failed: %s\n", strerror(errno));
+            lua_settop(L, start);
+            return false;
+        }
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (pipeOutput) {
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+        }
+        if (dir && chdir(dir) != 0)
+            _exit(127);
+        execvp(args[0], args);
+        _exit(127);
+    }
+
+    if (pipeOutput)
+        close(fds[1]);
+
+    if (pid < 0) {
+        Con_PrintF(L, COLOR_ERROR, "ERROR: fork() failed: %s\n", strerror(errno));
+        if (pipeOutput)
+            close(fds[0]);
+        lua_settop(L, start);
+        return false;
+    }
+
+    process->pid = (int)pid;
+    process->outputFd = fds[0];
+
+  #if defined(__linux__) && defined(SYS_pidfd_open)
+    /* pidfd makes process exit pollable together with pipes; older kernels fall back to waitpid polling */
+    process->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+  #endif
+
+  #endif
+
+    lua_settop(L, start);
+    return true;
+}
+
+bool Exec_PollProcess(ExecProcess* process)
+{
+    if (process->exited)
+        return true;
+
+  #ifdef _WIN32
+    if (!process->hProcess || WaitForSingleObject(process->hProcess, 0) != WAIT_OBJECT_0)
+        return false;
+
+    DWORD dwExitCode = (DWORD)-1;
+    GetExitCodeProcess(process->hProcess, &dwExitCode);
+    process->exitCode = (int)dwExitCode;
+  #else
+    if (process->pid <= 0)
+        return false;
+
+    int status;
+    pid_t result = waitpid((pid_t)process->pid, &status, WNOHANG);
+    if (result == 0 || (result < 0 && errno == EINTR))
+        return false;
+
+    if (result < 0)
+        process->exitCode = -1;
+    else if (WIFEXITED(status))
+        process->exitCode = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+        process->exitCode = 128 + WTERMSIG(status);
+    else
+        return false;
+  #endif
+
+    /* files written by the process may have been cached as missing or with an older size */
+    StatCache_Flush();
+
+    process->exited = true;
+    return true;
+}
+
+void Exec_KillProcess(ExecProcess* process)
+{
+    if (process->exited)
+        return;
+
+  #ifdef _WIN32
+    if (process->hJob)
+        TerminateJobObject(process->hJob, (UINT)-1);
+    else if (process->hProcess)
+        TerminateProcess(process->hProcess, (UINT)-1);
+  #else
+    if (process->pid > 0)
+        kill((pid_t)process->pid, SIGKILL);
+  #endif
+}
+
+/* kills the process and waits until it is gone */
+void Exec_StopProcess(ExecProcess* process)
+{
+    if (process->exited)
+        return;
+
+    Exec_KillProcess(process);
+
+  #ifdef _WIN32
+    if (process->hProcess)
+        WaitForSingleObject(process->hProcess, INFINITE);
+  #else
+    if (process->pid > 0) {
+        while (waitpid((pid_t)process->pid, NULL, 0) < 0 && errno == EINTR)
+            continue;
+    }
+    process->pid = 0;
+  #endif
+
+    /* files written by the process may have been cached as missing or with an older size */
+    StatCache_Flush();
+
+    process->exited = true;
+    process->exitCode = -1;
+}
+
+/* a process that is still running keeps running, only the handles are released */
+void Exec_CloseProcess(ExecProcess* process)
+{
+  #ifdef _WIN32
+    if (process->hJob) {
+        CloseHandle(process->hJob);
+        process->hJob = NULL;
+    }
+    if (process->hProcess) {
+        CloseHandle(process->hProcess);
+        process->hProcess = NULL;
+    }
+    if (process->hOutput) {
+        CloseHandle(process->hOutput);
+        process->hOutput = NULL;
+    }
+  #else
+    if (process->pid > 0 && !process->exited)
+        detach((pid_t)process->pid);
+    process->pid = 0;
+    if (process->pidfd >= 0) {
+        close(process->pidfd);
+        process->pidfd = -1;
+    }
+    if (process->outputFd >= 0) {
+        close(process->outputFd);
+        process->outputFd = -1;
+    }
+  #endif
+
+    process->exited = true;
+}
+
 void Exec_TerminateBackgroundProcess(void)
 {
     EnterCriticalSection(&g_criticalSection);
@@ -10,6 +10,20 @@ typedef enum runmode_t {
     RUN_BACKGROUND,
 } runmode_t;
 
+STRUCT(ExecProcess) {
+  #ifdef _WIN32
+    void* hProcess;
+    void* hJob;                 /* the process and everything it starts, cmd.exe runs the actual command */
+    void* hOutput;
+  #else
+    int pid;
+    int pidfd;
+    int outputFd;
+  #endif
+    bool exited;
+    int exitCode;
+};
+
 extern bool g_dont_print_commands;
 
 void Exec_Init(lua_State* L);
@@ -19,6 +33,13 @@ bool Exec_Command(lua_State* L, const char* const* argv, int argc, const char* c
 bool Exec_CommandV(lua_State* L, const char* command, const char* const* argv, int argc,
     const char* chdir, runmode_t mode);
 
+bool Exec_Spawn(lua_State* L, const char* const* argv, int argc, const char* dir, bool pipeOutput,
+    ExecProcess* process);
+bool Exec_PollProcess(ExecProcess* process);
+void Exec_KillProcess(ExecProcess* process);
+void Exec_StopProcess(ExecProcess* process);
+void Exec_CloseProcess(ExecProcess* process);
+
 void Exec_TerminateBackgroundProcess(void);
 
 #endif
@@ -1,11 +1,21 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for fallocate() */
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t on 32-bit systems */
+#endif
+
 #include <common/file.h>
 #include <common/script.h>
 #include <common/utf8.h>
 #include <common/dirs.h>
 #include <common/console.h>
+#include <common/statcache.h>
+#include <common/thread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>
 #include <errno.h>
 #include <dirent.h>
@@ -17,6 +27,8 @@
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
 
 #ifdef _WIN32
@@ -25,10 +37,22 @@
  #include <winioctl.h>
  #include <shellapi.h>
  #include <io.h>
+ #include <fcntl.h>
  #ifndef __MINGW32__
   #define fileno _fileno
  #endif
- #define ftruncate _chsize
+ #define ftruncate(fd, size) _chsize_s((fd), (__int64)(size))
+ #ifdef _MSC_VER
+  typedef intptr_t ssize_t;
+  #define stat _stat64 /* 64-bit st_size */
+  #define fstat _fstat64
+ #endif
+ #ifndef S_ISDIR
+  #define S_ISDIR(mode) (((mode) & _S_IFMT) == _S_IFDIR)
+ #endif
+ #ifndef S_ISREG
+  #define S_ISREG(mode) (((mode) & _S_IFMT) == _S_IFREG)
+ #endif
  #ifndef FSCTL_SET_SPARSE
   #define FSCTL_SET_SPARSE 0x000900C4
  #endif
@@ -49,21 +73,41 @@
 
 bool File_Exists(lua_State* L, const char* path)
 {
+    StatInfo info;
+    uint64_t generation = StatCache_GetGeneration();
+    if (StatCache_TryGet(path, &info))
+        return info.exists;
+
+    memset(&info, 0, sizeof(info));
+
   #if defined(_WIN32) && !defined(USE_POSIX_IO)
 
     const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
-    bool result = GetFileAttributesW(wpath) != INVALID_FILE_ATTRIBUTES;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesExW(wpath, GetFileExInfoStandard, &data)) {
+        info.exists = true;
+        info.hasDetails = true;
+        info.isDir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        info.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    }
     lua_pop(L, 1);
-    return result;
 
   #else
 
     DONT_WARN_UNUSED(L);
 
     struct stat st;
-    return stat(path, &st) == 0;
+    if (stat(path, &st) == 0) {
+        info.exists = true;
+        info.hasDetails = true;
+        info.isDir = S_ISDIR(st.st_mode);
+        info.size = (uint64_t)st.st_size;
+    }
 
   #endif
+
+    StatCache_Put(path, &info, generation);
+    return info.exists;
 }
 
 bool File_TryCreateDirectory(lua_State* L, const char* path)
@@ -81,15 +125,17 @@ bool File_TryCreateDirectory(lua_State* L, const char* path)
         lua_pop(L, 1);
     }
     lua_pop(L, 1);
-    return result;
 
   #else
 
     DONT_WARN_UNUSED(L);
 
-    return mkdir(path) == 0;
+    bool result = (mkdir(path) == 0);
 
   #endif
+
+    StatCache_Invalidate(path);
+    return result;
 }
 
 void File_PushCurrentDirectory(lua_State* L)
@@ -132,6 +178,9 @@ void File_PushCurrentDirectory(lua_State* L)
 
 void File_SetCurrentDirectory(lua_State* L, const char* path)
 {
+    /* relative paths in the stat cache would refer to other files now */
+    StatCache_Flush();
+
   #if defined(_WIN32) && !defined(USE_POSIX_IO)
 
     const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
@@ -149,6 +198,8 @@ void File_SetCurrentDirectory(lua_State* L, const char* path)
 
 bool File_TryDelete(lua_State* L, const char* path)
 {
+    StatCache_Invalidate(path);
+
   #if defined(_WIN32) && !defined(USE_POSIX_IO)
 
     const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
@@ -176,8 +227,61 @@ bool File_TryDelete(lua_State* L, const char* path)
   #endif
 }
 
+void File_Rename(lua_State* L, const char* oldPath, const char* newPath)
+{
+    StatCache_Invalidate(oldPath);
+    StatCache_Invalidate(newPath);
+
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
+
+    const WCHAR* woldpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, oldPath, NULL);
+    const WCHAR* wnewpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, newPath, NULL);
+    if (!MoveFileExW(woldpath, wnewpath, MOVEFILE_REPLACE_EXISTING)) {
+        luaL_error(L, "unable to rename file \"%s\" to \"%s\" (code %p).",
+            oldPath, newPath, (void*)(size_t)GetLastError());
+    }
+    lua_pop(L, 2);
+
+  #else
+
+    DONT_WARN_UNUSED(L);
+
+    if (rename(oldPath, newPath) != 0)
+        luaL_error(L, "unable to rename file \"%s\" to \"%s\": %s", oldPath, newPath, strerror(errno));
+
+  #endif
+}
+
+/* temporary name next to the file, unique within the process and between processes running at the same time */
+bool File_MakeTempName(char* buf, size_t bufSize, const char* path)
+{
+    static volatile long counter;
+
+  #ifdef _WIN32
+    unsigned long pid = (unsigned long)GetCurrentProcessId();
+  #else
+    unsigned long pid = (unsigned long)getpid();
+  #endif
+
+    int len = snprintf(buf, bufSize, "%s.%lu-%ld.tmp", path, pid, Atomic_Increment(&counter));
+    return len > 0 && (size_t)len < bufSize;
+}
+
 void File_QueryInfo(lua_State* L, const char* path, bool* outIsDir, uint64_t* outSize)
 {
+    StatInfo info;
+    uint64_t generation = StatCache_GetGeneration();
+    if (StatCache_TryGet(path, &info) && info.hasDetails) {
+        if (outIsDir)
+            *outIsDir = info.isDir;
+        if (outSize)
+            *outSize = info.size;
+        return;
+    }
+
+    info.exists = true;
+    info.hasDetails = true;
+
   #ifdef _WIN32
 
     const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
@@ -188,10 +292,8 @@ void File_QueryInfo(lua_State* L, const char* path, bool* outIsDir, uint64_t* ou
 
     lua_pop(L, 1);
 
-    if (outIsDir)
-        *outIsDir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
-    if (outSize)
-        *outSize = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    info.isDir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    info.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
 
   #else
 
@@ -199,10 +301,64 @@ void File_QueryInfo(lua_State* L, const char* path, bool* outIsDir, uint64_t* ou
     if (stat(path, &st) < 0)
         luaL_error(L, "can't stat \"%s\": %s", path, strerror(errno));
 
+    info.isDir = S_ISDIR(st.st_mode);
+    info.size = (uint64_t)st.st_size;
+
+  #endif
+
+    StatCache_Put(path, &info, generation);
+
     if (outIsDir)
-        *outIsDir = S_ISDIR(st.st_mode);
+        *outIsDir = info.isDir;
     if (outSize)
-        *outSize = st.st_size;
+        *outSize = info.size;
+}
+
+bool File_TryStat(lua_State* L, const char* path, FileStat* outStat)
+{
+  #ifdef _WIN32
+
+    const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
+    HANDLE handle = CreateFileW(wpath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    lua_pop(L, 1);
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL result = GetFileInformationByHandle(handle, &info);
+    CloseHandle(handle);
+    if (!result)
+        return false;
+
+    outStat->device = info.dwVolumeSerialNumber;
+    outStat->inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    outStat->size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    outStat->mtime = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    outStat->isDir = (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+    return true;
+
+  #else
+
+    DONT_WARN_UNUSED(L);
+
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return false;
+
+    outStat->device = (uint64_t)st.st_dev;
+    outStat->inode = (uint64_t)st.st_ino;
+    outStat->size = (uint64_t)st.st_size;
+   #ifdef __linux__
+    outStat->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+   #else
+    outStat->mtime = (uint64_t)st.st_mtime;
+   #endif
+    outStat->isDir = S_ISDIR(st.st_mode);
+
+    return true;
 
   #endif
 }
@@ -213,6 +369,7 @@ struct Dir
 {
     DIR* handle;
     lua_State* L;
+    uint64_t listingGeneration;
     char name[1]; /* should be the last field */
 };
 
@@ -233,6 +390,7 @@ Dir* File_PushOpenDir(lua_State* L, const char* path)
 
     dir->handle = NULL;
     dir->L = L;
+    dir->listingGeneration = StatCache_GetGeneration();
 
     if (luaL_newmetatable(L, DIR_MT)) {
         lua_pushcfunction(L, lua_closedir);
@@ -263,8 +421,11 @@ const char* File_ReadDir(Dir* dir)
     if (!e) {
         if (errno)
             luaL_error(dir->L, "can't read dir \"%s\": %s", dir->name, strerror(errno));
+        StatCache_EndListing(dir->name, dir->listingGeneration);
         return NULL;
     }
+
+    StatCache_AddListed(dir->name, e->d_name, dir->listingGeneration);
     return e->d_name;
 }
 
@@ -275,15 +436,43 @@ struct File
   #if defined(_WIN32) && !defined(USE_POSIX_IO)
     HANDLE handle;
   #else
-    FILE* handle;
+    int fd;
+    uint64_t position;
+    uint64_t sparseEnd;
+    bool cantPunchHoles;
   #endif
     lua_State* L;
     bool isSparse;
+    bool isWritable;
     char name[1]; /* should be the last field */
 };
 
 #define FILE_MT "File*"
 
+#if !defined(_WIN32) || defined(USE_POSIX_IO)
+
+#ifdef _WIN32
+ #define O_CLOEXEC 0
+ static ssize_t pread(int fd, void* buf, size_t size, uint64_t offset)
+ {
+     if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+         return -1;
+     return _read(fd, buf, (unsigned)size);
+ }
+ static ssize_t pwrite(int fd, const void* buf, size_t size, uint64_t offset)
+ {
+     if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+         return -1;
+     return _write(fd, buf, (unsigned)size);
+ }
+#else
+ #define O_BINARY 0
+#endif
+
+#define MAX_IO_CHUNK (1u << 30) /* single read() or write() may transfer less than requested above 2 GB */
+
+#endif
+
 static int lua_closefile(lua_State* L)
 {
     File_Close((File*)lua_touserdata(L, 1));
@@ -297,9 +486,17 @@ File* File_PushOpen(lua_State* L, const char* path, openmode_t mode)
     memcpy(file->name, path, nameLen);
     int n = lua_gettop(L);
 
-    file->handle = NULL;
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
+    file->handle = INVALID_HANDLE_VALUE;
+  #else
+    file->fd = -1;
+    file->position = 0;
+    file->sparseEnd = 0;
+    file->cantPunchHoles = false;
+  #endif
     file->L = L;
     file->isSparse = false;
+    file->isWritable = (mode != FILE_OPEN_SEQUENTIAL_READ);
 
     if (luaL_newmetatable(L, FILE_MT)) {
         lua_pushcfunction(L, lua_closefile);
@@ -325,13 +522,14 @@ File* File_PushOpen(lua_State* L, const char* path, openmode_t mode)
             dwFlags = 0;
             action = "open";
             break;
-        case FILE_CREATE_OVERWRITE: {
+        case FILE_CREATE_OVERWRITE:
+        case FILE_CREATE_NEW: {
             char buf[DIR_MAX];
             strcpy(buf, path);
             if (Dir_RemoveLastPath(buf))
                 File_TryCreateDirectory(L, buf);
             dwDesiredAccess = GENERIC_WRITE;
-            dwCreationDisposition = CREATE_ALWAYS;
+            dwCreationDisposition = (mode == FILE_CREATE_NEW ? CREATE_NEW : CREATE_ALWAYS);
             dwFlags = 0;
             action = "create";
             break;
@@ -345,24 +543,35 @@ File* File_PushOpen(lua_State* L, const char* path, openmode_t mode)
     const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
 
     file->handle = CreateFileW(wpath, dwDesiredAccess, FILE_SHARE_READ, NULL, dwCreationDisposition, dwFlags, NULL);
-    if (file->handle == INVALID_HANDLE_VALUE)
-        luaL_error(L, "unable to %s file \"%s\" (code %p)", action, file->name, (void*)(size_t)GetLastError());
+    if (file->handle == INVALID_HANDLE_VALUE) {
+        DWORD dwError = GetLastError();
+        if (mode == FILE_CREATE_NEW && (dwError == ERROR_FILE_EXISTS || dwError == ERROR_ALREADY_EXISTS)) {
+            lua_settop(L, n - 1);
+            return NULL;
+        }
+        luaL_error(L, "unable to %s file \"%s\" (code %p)", action, file->name, (void*)(size_t)dwError);
+    }
 
   #else
 
-    const char* action, *modstr;
+    const char* action;
+    int flags;
 
     switch (mode) {
         case FILE_OPEN_SEQUENTIAL_READ:
-            modstr = "rb";
+            flags = O_RDONLY;
             action = "open";
             break;
         case FILE_OPEN_MODIFY:
-            modstr = "r+b";
+            flags = O_RDWR;
             action = "open";
             break;
         case FILE_CREATE_OVERWRITE:
-            modstr = "wb";
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            action = "create";
+            break;
+        case FILE_CREATE_NEW:
+            flags = O_WRONLY | O_CREAT | O_EXCL;
             action = "create";
             break;
         default:
@@ -371,69 +580,134 @@ File* File_PushOpen(lua_State* L, const char* path, openmode_t mode)
             return NULL;
     }
 
-    file->handle = fopen(path, modstr);
-    if (!file->handle)
+    file->fd = open(path, flags | O_BINARY | O_CLOEXEC, 0666);
+    if (file->fd < 0) {
+        if (mode == FILE_CREATE_NEW && errno == EEXIST) {
+            lua_settop(L, n - 1);
+            return NULL;
+        }
         luaL_error(L, "unable to %s file \"%s\": %s", action, file->name, strerror(errno));
+    }
+
+   #ifdef POSIX_FADV_SEQUENTIAL
+    if (mode == FILE_OPEN_SEQUENTIAL_READ)
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+   #endif
 
   #endif
 
+    if (file->isWritable)
+        StatCache_Invalidate(path);
+
     lua_settop(L, n);
     return file;
 }
 
-void File_Close(File* file)
+/* zeros at the end of a sparse file were skipped, file has to be extended to its full size */
+static void extendSparseFile(File* file)
 {
+    if (!file->isSparse)
+        return;
+
   #if defined(_WIN32) && !defined(USE_POSIX_IO)
 
     HANDLE handle = file->handle;
-    if (handle != INVALID_HANDLE_VALUE) {
 
-        if (file->isSparse) {
-            DWORD currentOffset = SetFilePointer(handle, 0, NULL, FILE_CURRENT);
-            if (currentOffset == INVALID_SET_FILE_POINTER) {
-                Con_PrintF(file->L, COLOR_WARNING, "WARNING: SetFilePointer() failed in file \"%s\" (code %p).\n",
-                    file->name, (void*)(size_t)GetLastError());
-                goto err;
-            }
+    LARGE_INTEGER zero, currentOffset, fileSize;
+    zero.QuadPart = 0;
+    if (!SetFilePointerEx(handle, zero, &currentOffset, FILE_CURRENT)) {
+        Con_PrintF(file->L, COLOR_WARNING, "WARNING: SetFilePointer() failed in file \"%s\" (code %p).\n",
+            file->name, (void*)(size_t)GetLastError());
+        return;
+    }
 
-            DWORD hiPart = 0;
-            DWORD loPart = GetFileSize(file->handle, &hiPart);
-            if (loPart == INVALID_FILE_SIZE) {
-                DWORD dwError = GetLastError();
-                if (dwError != NO_ERROR) {
-                    Con_PrintF(file->L, COLOR_WARNING, "WARNING: GetFileSize() failed in file \"%s\" (code %p).\n",
-                        file->name, (void*)(size_t)dwError);
-                }
-                goto err;
-            }
+    if (!GetFileSizeEx(handle, &fileSize)) {
+        Con_PrintF(file->L, COLOR_WARNING, "WARNING: GetFileSize() failed in file \"%s\" (code %p).\n",
+            file->name, (void*)(size_t)GetLastError());
+        return;
+    }
 
-            if (currentOffset > loPart && hiPart == 0) {
-                if (!SetEndOfFile(handle)) {
-                    Con_PrintF(file->L, COLOR_WARNING, "WARNING: SetEndOfFile() failed in file \"%s\" (code %p).\n",
-                        file->name, (void*)(size_t)GetLastError());
-                    goto err;
-                }
-            }
+    if (currentOffset.QuadPart > fileSize.QuadPart) {
+        if (!SetEndOfFile(handle)) {
+            Con_PrintF(file->L, COLOR_WARNING, "WARNING: SetEndOfFile() failed in file \"%s\" (code %p).\n",
+                file->name, (void*)(size_t)GetLastError());
         }
+    }
+
+  #else
+
+    if (file->sparseEnd == 0)
+        return;
+
+    struct stat st;
+    if (fstat(file->fd, &st) != 0) {
+        Con_PrintF(file->L, COLOR_WARNING, "WARNING: unable to determine size of file \"%s\": %s\n",
+            file->name, strerror(errno));
+    } else if ((uint64_t)st.st_size < file->sparseEnd && ftruncate(file->fd, (int64_t)file->sparseEnd) != 0) {
+        Con_PrintF(file->L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed: %s\n",
+            file->name, strerror(errno));
+    }
 
-      err:
+    file->sparseEnd = 0;
+
+  #endif
+}
+
+void File_Close(File* file)
+{
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
+
+    HANDLE handle = file->handle;
+    if (handle != INVALID_HANDLE_VALUE) {
+        extendSparseFile(file);
         CloseHandle(handle);
         file->handle = INVALID_HANDLE_VALUE;
+        if (file->isWritable)
+            StatCache_Invalidate(file->name);
     }
 
   #else
 
-    FILE* handle = file->handle;
-    if (handle) {
-        fclose(handle);
-        file->handle = NULL;
+    int fd = file->fd;
+    if (fd >= 0) {
+        extendSparseFile(file);
+        close(fd);
+        file->fd = -1;
+        if (file->isWritable)
+            StatCache_Invalidate(file->name);
     }
 
   #endif
 }
 
+void File_Sync(File* file)
+{
+    extendSparseFile(file);
+
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
+
+    if (!FlushFileBuffers(file->handle)) {
+        luaL_error(file->L, "unable to %s file \"%s\" (code %p)",
+            "flush", file->name, (void*)(size_t)GetLastError());
+    }
+
+  #elif defined(_WIN32)
+
+    if (_commit(file->fd) != 0)
+        luaL_error(file->L, "unable to %s file \"%s\": %s", "flush", file->name, strerror(errno));
+
+  #else
+
+    if (fsync(file->fd) != 0)
+        luaL_error(file->L, "unable to %s file \"%s\": %s", "flush", file->name, strerror(errno));
+
+  #endif
+}
+
 void File_MakeSparse(File* file)
 {
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
+
     DWORD tmp;
     if (!DeviceIoControl(file->handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &tmp, NULL)) {
         Con_PrintF(file->L, COLOR_WARNING,
@@ -443,149 +717,131 @@ void File_MakeSparse(File* file)
     }
 
     file->isSparse = true;
+
+  #elif defined(_WIN32)
+
+    DONT_WARN_UNUSED(file); /* C runtime has no way to create holes in a file */
+
+  #else
+
+    /* nothing to set up: holes are created by skipping over zeros and punching out old data */
+    file->isSparse = true;
+
+  #endif
 }
 
-size_t File_GetSize(File* file)
+uint64_t File_GetSize(File* file)
 {
     lua_State* L = file->L;
 
   #if defined(_WIN32) && !defined(USE_POSIX_IO)
 
-    SetLastError(NO_ERROR);
-
-    DWORD hiPart = 0;
-    DWORD loPart = GetFileSize(file->handle, &hiPart);
-    if (loPart == INVALID_FILE_SIZE) {
-        DWORD dwError = GetLastError();
-        if (dwError != NO_ERROR) {
-            luaL_error(L, "unable to %s file \"%s\" (code %p)",
-                "determine size of", file->name, (void*)(size_t)dwError);
-        }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file->handle, &size)) {
+        luaL_error(L, "unable to %s file \"%s\" (code %p)",
+            "determine size of", file->name, (void*)(size_t)GetLastError());
     }
 
-    if (hiPart != 0 || loPart > MAX_FILE_SIZE)
-        luaL_error(L, "file \"%s\" is too large.", file->name);
-
-    return (size_t)loPart;
+    return (uint64_t)size.QuadPart;
 
   #else
 
-    FILE* handle = file->handle;
-
-    fseek(handle, 0, SEEK_END);
-    long size = ftell(handle);
-    fseek(handle, 0, SEEK_SET);
-
-    if (ferror(handle) || size < 0) {
+    struct stat st;
+    if (fstat(file->fd, &st) != 0) {
         luaL_error(L, "unable to %s file \"%s\": %s",
             "determine size of", file->name, strerror(errno));
     }
 
-    if (size > MAX_FILE_SIZE)
-        luaL_error(L, "file \"%s\" is too large.", file->name);
-
-    return (size_t)size;
+    return (uint64_t)st.st_size;
 
   #endif
 }
 
-bool File_TrySetSize(File* file, size_t newSize)
+static size_t getSizeInMemory(File* file)
+{
+    uint64_t size = File_GetSize(file);
+    if (size > (uint64_t)(SIZE_MAX >> 1))
+        luaL_error(file->L, "file \"%s\" is too large.", file->name);
+    return (size_t)size;
+}
+
+bool File_TrySetSize(File* file, uint64_t newSize)
 {
     lua_State* L = file->L;
 
-  #ifdef _WIN32
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
 
     HANDLE handle = file->handle;
 
-    DWORD result = SetFilePointer(handle, (LONG)newSize, NULL, FILE_BEGIN);
-    if (result == INVALID_SET_FILE_POINTER) {
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)newSize;
+    if (!SetFilePointerEx(handle, offset, NULL, FILE_BEGIN)) {
         Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed (code %p).\n",
             file->name, (void*)(size_t)GetLastError());
         return false;
     }
 
-    if ((size_t)result != newSize) {
-        Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed.\n", file->name);
-        return false;
-    }
-
     if (!SetEndOfFile(handle)) {
         Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed (code %p).\n",
             file->name, (void*)(size_t)GetLastError());
         return false;
     }
 
-    SetLastError(NO_ERROR);
-
-    DWORD hiPart = 0;
-    DWORD loPart = GetFileSize(file->handle, &hiPart);
-    if (loPart == INVALID_FILE_SIZE) {
-        DWORD dwError = GetLastError();
-        if (dwError != NO_ERROR) {
-            Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed (code %p).\n",
-                file->name, (void*)(size_t)dwError);
-            return false;
-        }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(handle, &fileSize)) {
+        Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed (code %p).\n",
+            file->name, (void*)(size_t)GetLastError());
+        return false;
     }
 
-    if (hiPart != 0 || (size_t)loPart != newSize) {
+    if ((uint64_t)fileSize.QuadPart != newSize) {
         Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed.\n", file->name);
         return false;
     }
 
+    offset.QuadPart = 0;
+    SetFilePointerEx(handle, offset, NULL, FILE_BEGIN);
+
     return true;
 
   #else
 
-    FILE* handle = file->handle;
-
-    int fd = fileno(handle);
-    if (fd < 0 || ftruncate(fd, newSize) != 0) {
+    struct stat st;
+    if (ftruncate(file->fd, (int64_t)newSize) != 0 || fstat(file->fd, &st) != 0) {
         Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed: %s\n",
             file->name, strerror(errno));
         return false;
     }
 
-    fseek(handle, 0, SEEK_END);
-    long fileSize = ftell(handle);
-    fseek(handle, 0, SEEK_SET);
-    if (ferror(handle) || (size_t)fileSize != newSize) {
-        Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed: %s\n",
-            file->name, strerror(errno));
+    if ((uint64_t)st.st_size != newSize) {
+        Con_PrintF(L, COLOR_WARNING, "WARNING: truncate of file \"%s\" failed.\n", file->name);
         return false;
     }
 
+    file->position = 0;
+    if (file->sparseEnd > newSize)
+        file->sparseEnd = newSize;
+
     return true;
 
   #endif
 }
 
-void File_SetPosition(File* file, size_t offset)
+void File_SetPosition(File* file, uint64_t offset)
 {
-    lua_State* L = file->L;
-
   #if defined(_WIN32) && !defined(USE_POSIX_IO)
 
-    DWORD result = SetFilePointer(file->handle, (LONG)offset, NULL, FILE_BEGIN);
-    if (result == INVALID_SET_FILE_POINTER) {
-        luaL_error(L, "unable to %s file \"%s\" (code %p)",
+    LARGE_INTEGER li;
+    li.QuadPart = (LONGLONG)offset;
+    if (!SetFilePointerEx(file->handle, li, NULL, FILE_BEGIN)) {
+        luaL_error(file->L, "unable to %s file \"%s\" (code %p)",
             "set position in", file->name, (void*)(size_t)GetLastError());
     }
 
-    if ((size_t)result != offset) {
-        luaL_error(L, "invalid seek in file \"%s\": %s",
-            file->name, strerror(errno));
-    }
-
   #else
 
-    FILE* handle = file->handle;
-
-    fseek(handle, offset, SEEK_SET);
-    if (ferror(handle)) {
-        luaL_error(L, "unable to %s file \"%s\": %s",
-            "set position in", file->name, strerror(errno));
-    }
+    /* reads and writes are positioned, nothing to do until then */
+    file->position = offset;
 
   #endif
 }
@@ -600,8 +856,9 @@ void File_Read(File* file, void* buf, size_t size)
     HANDLE handle = file->handle;
 
     while (size != 0) {
+        DWORD dwBytesToRead = (size > 0x40000000 ? 0x40000000 : (DWORD)size);
         DWORD dwBytesRead;
-        if (!ReadFile(handle, ptr, (DWORD)size, &dwBytesRead, NULL)) {
+        if (!ReadFile(handle, ptr, dwBytesToRead, &dwBytesRead, NULL)) {
             luaL_error(L, "unable to %s file \"%s\" (code %p)",
                 "read", file->name, (void*)(size_t)GetLastError());
         }
@@ -615,11 +872,12 @@ void File_Read(File* file, void* buf, size_t size)
 
   #else
 
-    FILE* handle = file->handle;
-
     while (size != 0) {
-        size_t bytesRead = fread(ptr, 1, size, handle);
-        if (ferror(handle)) {
+        size_t bytesToRead = (size > MAX_IO_CHUNK ? MAX_IO_CHUNK : size);
+        ssize_t bytesRead = pread(file->fd, ptr, bytesToRead, file->position);
+        if (bytesRead < 0) {
+            if (errno == EINTR)
+                continue;
             luaL_error(L, "unable to %s file \"%s\": %s",
                 "read", file->name, strerror(errno));
         }
@@ -628,20 +886,70 @@ void File_Read(File* file, void* buf, size_t size)
             luaL_error(L, "unexpected end of file \"%s\".", file->name);
 
         ptr += bytesRead;
-        size -= bytesRead;
+        size -= (size_t)bytesRead;
+        file->position += (uint64_t)bytesRead;
     }
 
   #endif
 }
 
-#if defined(_WIN32) && !defined(USE_POSIX_IO)
+void File_ReadAt(File* file, uint64_t offset, void* buf, size_t size)
+{
+    File_SetPosition(file, offset);
+    File_Read(file, buf, size);
+}
+
 #define SPARSE_THRESHOLD 1024
-static LONG countZeros(const char* start, const char* end)
+
+static size_t countZeros(const char* start, const char* end)
 {
     const char* p = start;
-    while (*p == 0 && p != end)
+    while ((size_t)(end - p) >= sizeof(size_t)) {
+        size_t word;
+        memcpy(&word, p, sizeof(word));
+        if (word != 0)
+            break;
+        p += sizeof(size_t);
+    }
+    while (p != end && *p == 0)
         ++p;
-    return (LONG)(p - start);
+    return (size_t)(p - start);
+}
+
+#if !defined(_WIN32)
+static bool trySkipZeros(File* file, size_t count)
+{
+    struct stat st;
+    if (fstat(file->fd, &st) != 0) {
+        Con_PrintF(file->L, COLOR_WARNING, "WARNING: unable to determine size of file \"%s\": %s\n",
+            file->name, strerror(errno));
+        return false;
+    }
+
+    /* previous contents of the file have to be replaced with zeros */
+    if (file->position < (uint64_t)st.st_size) {
+        if (file->cantPunchHoles)
+            return false;
+
+      #ifdef FALLOC_FL_PUNCH_HOLE
+        int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        if (fallocate(file->fd, mode, (off_t)file->position, (off_t)count) != 0) {
+            Con_PrintF(file->L, COLOR_WARNING, "WARNING: unable to punch hole in file \"%s\": %s\n",
+                file->name, strerror(errno));
+            file->cantPunchHoles = true;
+            return false;
+        }
+      #else
+        file->cantPunchHoles = true;
+        return false;
+      #endif
+    }
+
+    file->position += count;
+    if (file->position > file->sparseEnd)
+        file->sparseEnd = file->position;
+
+    return true;
 }
 #endif
 
@@ -655,23 +963,24 @@ void File_Write(File* file, const void* buf, size_t size)
     HANDLE handle = file->handle;
 
     while (size != 0) {
-        DWORD dwBytesToWrite = (DWORD)size;
+        DWORD dwBytesToWrite = (size > 0x40000000 ? 0x40000000 : (DWORD)size);
         DWORD dwBytesWritten;
 
         if (file->isSparse) {
-            const char* end = ptr + size;
-            LONG zeroCount = countZeros(ptr, end);
+            const char* end = ptr + dwBytesToWrite;
+            LONGLONG zeroCount = (LONGLONG)countZeros(ptr, end);
             if (zeroCount >= SPARSE_THRESHOLD || (size_t)zeroCount == dwBytesToWrite) {
-                DWORD currentOffset = SetFilePointer(handle, 0, NULL, FILE_CURRENT);
-                if (currentOffset == INVALID_SET_FILE_POINTER) {
+                LARGE_INTEGER zero, currentOffset;
+                zero.QuadPart = 0;
+                if (!SetFilePointerEx(handle, zero, &currentOffset, FILE_CURRENT)) {
                     Con_PrintF(L, COLOR_WARNING, "WARNING: SetFilePointer() failed in file \"%s\" (code %p).\n",
                         file->name, (void*)(size_t)GetLastError());
                     goto fullwrite;
                 }
 
                 FILE_ZERO_DATA_INFORMATION_ zi;
-                zi.FileOffset.QuadPart = currentOffset;
-                zi.BeyondFinalZero.QuadPart = currentOffset + zeroCount;
+                zi.FileOffset.QuadPart = currentOffset.QuadPart;
+                zi.BeyondFinalZero.QuadPart = currentOffset.QuadPart + zeroCount;
                 DWORD tmp = 0;
                 if (!DeviceIoControl(handle, FSCTL_SET_ZERO_DATA, &zi, sizeof(zi), NULL, 0, &tmp, NULL)) {
                     Con_PrintF(L, COLOR_WARNING,
@@ -680,30 +989,27 @@ void File_Write(File* file, const void* buf, size_t size)
                     goto fullwrite;
                 }
 
-                DWORD result = SetFilePointer(handle, currentOffset + zeroCount, NULL, FILE_BEGIN);
-                if (result == INVALID_SET_FILE_POINTER) {
+                if (!SetFilePointerEx(handle, zi.BeyondFinalZero, NULL, FILE_BEGIN)) {
                     Con_PrintF(L, COLOR_WARNING, "WARNING: SetFilePointer() failed in file \"%s\" (code %p).\n",
                         file->name, (void*)(size_t)GetLastError());
                     goto fullwrite;
                 }
 
                 ptr += zeroCount;
-                size -= zeroCount;
-
-                if (ptr == end)
-                    break;
+                size -= (size_t)zeroCount;
+                continue;
             }
 
             const char* p = ptr;
             for (;;) {
-                while (*p != 0 && p != end)
+                while (p != end && *p != 0)
                     ++p;
 
                 if (p == end)
                     break;
 
-                LONG zeroCount = countZeros(p, end);
-                if (zeroCount >= SPARSE_THRESHOLD || (size_t)zeroCount == dwBytesToWrite)
+                size_t zeroCount = countZeros(p, end);
+                if (zeroCount >= SPARSE_THRESHOLD || p + zeroCount == end)
                     break;
 
                 p += zeroCount;
@@ -727,11 +1033,44 @@ void File_Write(File* file, const void* buf, size_t size)
 
   #else
 
-    FILE* handle = file->handle;
-
     while (size != 0) {
-        size_t bytesWritten = fwrite(ptr, 1, size, handle);
-        if (ferror(handle)) {
+        size_t bytesToWrite = (size > MAX_IO_CHUNK ? MAX_IO_CHUNK : size);
+
+      #if !defined(_WIN32)
+        if (file->isSparse) {
+            const char* end = ptr + bytesToWrite;
+            size_t zeroCount = countZeros(ptr, end);
+            if ((zeroCount >= SPARSE_THRESHOLD || zeroCount == bytesToWrite) && trySkipZeros(file, zeroCount)) {
+                ptr += zeroCount;
+                size -= zeroCount;
+                continue;
+            }
+
+            /* write up to the next run of zeros long enough to be skipped */
+            const char* p = ptr + zeroCount;
+            for (;;) {
+                while (p != end && *p != 0)
+                    ++p;
+
+                if (p == end)
+                    break;
+
+                size_t count = countZeros(p, end);
+                if (count >= SPARSE_THRESHOLD || p + count == end)
+                    break;
+
+                p += count;
+            }
+
+            if (p != ptr)
+                bytesToWrite = (size_t)(p - ptr);
+        }
+      #endif
+
+        ssize_t bytesWritten = pwrite(file->fd, ptr, bytesToWrite, file->position);
+        if (bytesWritten < 0) {
+            if (errno == EINTR)
+                continue;
             luaL_error(L, "unable to %s file \"%s\": %s",
                 "write", file->name, strerror(errno));
         }
@@ -740,38 +1079,143 @@ void File_Write(File* file, const void* buf, size_t size)
             luaL_error(L, "incomplete write in file \"%s\".", file->name);
 
         ptr += bytesWritten;
-        size -= bytesWritten;
+        size -= (size_t)bytesWritten;
+        file->position += (uint64_t)bytesWritten;
     }
 
   #endif
 }
 
+void File_WriteAt(File* file, uint64_t offset, const void* buf, size_t size)
+{
+    File_SetPosition(file, offset);
+    File_Write(file, buf, size);
+}
+
 /********************************************************************************************************************/
 
-char* File_PushContents(lua_State* L, const char* path, size_t* outSize)
+Buffer* File_PushBuffer(lua_State* L, const char* path)
 {
     File* file = File_PushOpen(L, path, FILE_OPEN_SEQUENTIAL_READ);
 
-    size_t fileSize = File_GetSize(file);
-    char* buf = (char*)lua_newuserdatauv(L, fileSize + 1, 0);
-    buf[fileSize] = 0;
+    size_t fileSize = getSizeInMemory(file);
+    Buffer* buffer = Buffer_PushNew(L, fileSize);
 
-    File_Read(file, buf, fileSize);
+    File_Read(file, buffer->data, fileSize);
 
     File_Close(file);
     lua_remove(L, -2);
 
+    return buffer;
+}
+
+Buffer* File_PushMapped(lua_State* L, const char* path, accesshint_t hint)
+{
+  #ifdef _WIN32
+
+    /* there is no equivalent of madvise() for mapped views, the hint is not used */
+    DONT_WARN_UNUSED(hint);
+
+    /* others may still update the file in place while it is mapped */
+    const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
+    HANDLE hFile = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, 0, NULL);
+    lua_pop(L, 1);
+    if (hFile == INVALID_HANDLE_VALUE)
+        luaL_error(L, "unable to open file \"%s\" (code %p)", path, (void*)(size_t)GetLastError());
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size)) {
+        DWORD dwError = GetLastError();
+        CloseHandle(hFile);
+        luaL_error(L, "unable to get size of file \"%s\" (code %p)", path, (void*)(size_t)dwError);
+    }
+
+    if ((uint64_t)size.QuadPart > (uint64_t)(SIZE_MAX >> 1)) {
+        CloseHandle(hFile);
+        luaL_error(L, "file \"%s\" is too large.", path);
+    }
+
+    if (size.QuadPart == 0) {
+        CloseHandle(hFile);
+        return Buffer_PushNew(L, 0);
+    }
+
+    HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    DWORD dwError = GetLastError();
+    CloseHandle(hFile);
+    if (!hMapping)
+        luaL_error(L, "unable to map file \"%s\" (code %p)", path, (void*)(size_t)dwError);
+
+    /* the view keeps the mapping alive */
+    void* view = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    dwError = GetLastError();
+    CloseHandle(hMapping);
+    if (!view)
+        luaL_error(L, "unable to map file \"%s\" (code %p)", path, (void*)(size_t)dwError);
+
+    return Buffer_PushMapped(L, view, (size_t)size.QuadPart);
+
+  #else
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC); /* FIXME: utf-8 */
+    if (fd < 0)
+        luaL_error(L, "unable to open file \"%s\": %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int error = errno;
+        close(fd);
+        luaL_error(L, "unable to get size of file \"%s\": %s", path, strerror(error));
+    }
+
+    if ((uint64_t)st.st_size > (uint64_t)(SIZE_MAX >> 1)) {
+        close(fd);
+        luaL_error(L, "file \"%s\" is too large.", path);
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return Buffer_PushNew(L, 0);
+    }
+
+    /* the mapping stays valid after the descriptor is closed */
+    void* view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    close(fd);
+    if (view == MAP_FAILED)
+        luaL_error(L, "unable to map file \"%s\": %s", path, strerror(error));
+
+  #ifdef MADV_SEQUENTIAL
+    switch (hint) {
+        case FILE_ACCESS_NORMAL: break;
+        case FILE_ACCESS_SEQUENTIAL: madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL); break;
+        case FILE_ACCESS_RANDOM: madvise(view, (size_t)st.st_size, MADV_RANDOM); break;
+    }
+  #else
+    DONT_WARN_UNUSED(hint);
+  #endif
+
+    return Buffer_PushMapped(L, view, (size_t)st.st_size);
+
+  #endif
+}
+
+char* File_PushContents(lua_State* L, const char* path, size_t* outSize)
+{
+    Buffer* buffer = File_PushBuffer(L, path);
+
     if (outSize)
-        *outSize = fileSize;
+        *outSize = buffer->size;
 
-    return buf;
+    return buffer->data;
 }
 
 const char* File_PushContentsAsString(lua_State* L, const char* path)
 {
     File* file = File_PushOpen(L, path, FILE_OPEN_SEQUENTIAL_READ);
 
-    size_t fileSize = File_GetSize(file);
+    size_t fileSize = getSizeInMemory(file);
     if (fileSize <= LUAI_MAXSHORTLEN) {
         char buf[LUAI_MAXSHORTLEN];
         File_Read(file, buf, fileSize);
@@ -790,23 +1234,327 @@ const char* File_PushContentsAsString(lua_State* L, const char* path)
     return lua_tostring(L, -1);
 }
 
-void File_Overwrite(lua_State* L, const char* path, const void* data, size_t size)
+/*
+ * Overwritten files are replaced atomically: new contents are written to a temporary file in the same directory,
+ * flushed to disk and then renamed over the target. Within a sync batch flushing is deferred instead: written
+ * directories are recorded and the file systems they are on are synced once when the batch ends.
+ */
+
+static char SYNC_BATCH;
+
+static void syncDirectory(lua_State* L, const char* dir)
 {
-    File* file = File_PushOpen(L, path, FILE_CREATE_OVERWRITE);
-    File_Write(file, data, size);
-    File_Close(file);
+  #ifdef _WIN32
+
+    /* renames are journaled by NTFS, directories can't be flushed separately */
+    DONT_WARN_UNUSED(L);
+    DONT_WARN_UNUSED(dir);
+
+  #else
+
+    int fd = open(dir, O_RDONLY | O_CLOEXEC); /* FIXME: utf-8 */
+    if (fd < 0 || fsync(fd) != 0) {
+        Con_PrintF(L, COLOR_WARNING, "WARNING: unable to flush directory \"%s\": %s\n", dir, strerror(errno));
+    }
+    if (fd >= 0)
+        close(fd);
+
+  #endif
+}
+
+static const char* pushDirectoryOf(lua_State* L, const char* path)
+{
+    char buf[DIR_MAX];
+    size_t len = strlen(path);
+    if (len >= sizeof(buf))
+        luaL_error(L, "path is too long: %s", path);
+
+    memcpy(buf, path, len + 1);
+    if (!Dir_RemoveLastPath(buf))
+        strcpy(buf, ".");
+
+    lua_pushstring(L, buf);
+    return lua_tostring(L, -1);
+}
+
+bool File_TryDeferSync(lua_State* L, const char* path)
+{
+  #ifdef _WIN32
+
+    /* batch can't be flushed on Windows (see File_FlushSyncBatch), so files are flushed one by one */
+    DONT_WARN_UNUSED(L);
+    DONT_WARN_UNUSED(path);
+    return false;
+
+  #else
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &SYNC_BATCH) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return false;
+    }
+
+    lua_getfield(L, -1, "dirs");
+    pushDirectoryOf(L, path);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+
+    return true;
+
+  #endif
+}
+
+void File_BeginSyncBatch(lua_State* L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &SYNC_BATCH) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_setfield(L, -2, "dirs");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &SYNC_BATCH);
+    }
+
+    lua_getfield(L, -1, "depth");
+    lua_Integer depth = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushinteger(L, depth + 1);
+    lua_setfield(L, -2, "depth");
     lua_pop(L, 1);
 }
 
-void File_OverwriteSparse(lua_State* L, const char* path, const void* data, size_t size)
+void File_EndSyncBatch(lua_State* L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &SYNC_BATCH) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_getfield(L, -1, "depth");
+    lua_Integer depth = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    if (depth > 1) {
+        lua_pushinteger(L, depth - 1);
+        lua_setfield(L, -2, "depth");
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_pop(L, 1);
+    File_FlushSyncBatch(L);
+}
+
+int File_FlushSyncBatch(lua_State* L)
+{
+    int n = lua_gettop(L);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &SYNC_BATCH) != LUA_TTABLE) {
+        lua_settop(L, n);
+        return 0;
+    }
+
+    /* batch is closed first, so that it is not synced twice if something below fails */
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &SYNC_BATCH);
+    lua_getfield(L, -1, "dirs");
+    int dirsIdx = lua_gettop(L);
+
+  #if defined(__linux__)
+
+    /* one syncfs() per file system */
+    lua_newtable(L);
+    int devicesIdx = lua_gettop(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, dirsIdx)) {
+        lua_pop(L, 1);
+        const char* dir = lua_tostring(L, -1);
+
+        struct stat st;
+        if (stat(dir, &st) != 0)
+            continue;
+
+        lua_pushinteger(L, (lua_Integer)st.st_dev);
+        if (lua_rawget(L, devicesIdx) != LUA_TNIL) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pop(L, 1);
+
+        lua_pushinteger(L, (lua_Integer)st.st_dev);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, devicesIdx);
+
+        int fd = open(dir, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || syncfs(fd) != 0)
+            Con_PrintF(L, COLOR_WARNING, "WARNING: unable to sync file system of \"%s\": %s\n", dir, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+    }
+
+  #elif !defined(_WIN32)
+
+    lua_pushnil(L);
+    if (lua_next(L, dirsIdx))
+        sync();
+
+  #else
+
+    /* FIXME: Windows has no way to flush a volume without administrator rights */
+
+  #endif
+
+    lua_settop(L, n);
+    return 0;
+}
+
+#define MAX_TEMP_NAME_ATTEMPTS 100
+
+STRUCT(OverwriteParams) {
+    File* file;
+    const char* path;
+    const void* data;
+    size_t size;
+    int mode;                   /* permissions of the replaced file, or -1 */
+    bool sparse;
+    bool deferSync;
+};
+
+/* symbolic links and special files are written through in place, replacing them would change what they are */
+static bool canReplace(lua_State* L, const char* path, int* outMode)
+{
+    *outMode = -1;
+
+  #if defined(_WIN32) && !defined(USE_POSIX_IO)
+
+    const WCHAR* wpath = (const WCHAR*)Utf8_PushConvertToUtf16(L, path, NULL);
+    DWORD dwAttributes = GetFileAttributesW(wpath);
+    lua_pop(L, 1);
+    return dwAttributes == INVALID_FILE_ATTRIBUTES || (dwAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0;
+
+  #elif defined(_WIN32)
+
+    DONT_WARN_UNUSED(L);
+    DONT_WARN_UNUSED(path);
+    return true;
+
+  #else
+
+    DONT_WARN_UNUSED(L);
+
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return true;
+    if (!S_ISREG(st.st_mode))
+        return false;
+
+    *outMode = (int)(st.st_mode & 07777);
+    return true;
+
+  #endif
+}
+
+static void overwriteInPlace(lua_State* L, const char* path, const void* data, size_t size, bool sparse,
+    bool deferSync)
 {
     File* file = File_PushOpen(L, path, FILE_CREATE_OVERWRITE);
-    File_MakeSparse(file);
+    if (sparse)
+        File_MakeSparse(file);
     File_Write(file, data, size);
+    if (!deferSync)
+        File_Sync(file);
     File_Close(file);
     lua_pop(L, 1);
 }
 
+/* stale temporary files left by a crashed process with the same pid are skipped */
+static File* pushCreateTemp(lua_State* L, const char* path)
+{
+    for (int i = 0; i < MAX_TEMP_NAME_ATTEMPTS; i++) {
+        char tmpPath[DIR_MAX];
+        if (!File_MakeTempName(tmpPath, sizeof(tmpPath), path))
+            luaL_error(L, "path is too long: %s", path);
+
+        File* file = File_PushOpen(L, tmpPath, FILE_CREATE_NEW);
+        if (file)
+            return file;
+    }
+
+    luaL_error(L, "unable to create temporary file for \"%s\".", path);
+    return NULL;
+}
+
+static int writeAndReplace(lua_State* L)
+{
+    OverwriteParams* p = (OverwriteParams*)lua_touserdata(L, 1);
+
+    if (p->sparse)
+        File_MakeSparse(p->file);
+    File_Write(p->file, p->data, p->size);
+    if (!p->deferSync)
+        File_Sync(p->file);
+
+  #ifndef _WIN32
+    /* the replacement keeps the permissions of the file it replaces, e.g. executable scripts stay executable */
+    if (p->mode >= 0 && fchmod(p->file->fd, (mode_t)p->mode) != 0)
+        luaL_error(L, "unable to set permissions of file \"%s\": %s", p->file->name, strerror(errno));
+  #endif
+
+    File_Close(p->file);
+
+    File_Rename(L, p->file->name, p->path);
+
+    return 0;
+}
+
+static void overwrite(lua_State* L, const char* path, const void* data, size_t size, bool sparse)
+{
+    OverwriteParams p;
+    p.path = path;
+    p.data = data;
+    p.size = size;
+    p.sparse = sparse;
+    p.deferSync = File_TryDeferSync(L, path);
+
+    if (!canReplace(L, path, &p.mode)) {
+        overwriteInPlace(L, path, data, size, sparse, p.deferSync);
+        return;
+    }
+
+    p.file = pushCreateTemp(L, path);
+
+    lua_pushcfunction(L, writeAndReplace);
+    lua_pushlightuserdata(L, &p);
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        /* the file may be left incomplete, it is not extended to its full size */
+        p.file->isSparse = false;
+        File_Close(p.file);
+        File_TryDelete(L, p.file->name);
+        lua_error(L);
+    }
+
+    lua_pop(L, 1);
+
+    if (!p.deferSync) {
+        syncDirectory(L, pushDirectoryOf(L, path));
+        lua_pop(L, 1);
+    }
+}
+
+void File_Overwrite(lua_State* L, const char* path, const void* data, size_t size)
+{
+    overwrite(L, path, data, size, false);
+}
+
+void File_OverwriteSparse(lua_State* L, const char* path, const void* data, size_t size)
+{
+    overwrite(L, path, data, size, true);
+}
+
+#define COMPARE_CHUNK_SIZE 16384
+
 static int lua_isfileidentical(lua_State* L)
 {
     const char* path = lua_tostring(L, 1);
@@ -815,23 +1563,39 @@ static int lua_isfileidentical(lua_State* L)
 
     File* file = File_PushOpen(L, path, FILE_OPEN_SEQUENTIAL_READ);
 
-    size_t oldSize = File_GetSize(file);
-    if (newSize != oldSize) {
+    if (File_GetSize(file) != (uint64_t)newSize) {
         File_Close(file);
         return 0;
     }
 
-    char* oldData = (char*)lua_newuserdatauv(L, oldSize, 0);
-    File_Read(file, oldData, oldSize);
+    /* compare in chunks, so that memory use doesn't depend on file size and reading stops at first mismatch */
+    char chunk[COMPARE_CHUNK_SIZE];
+    size_t offset = 0;
+    while (offset < newSize) {
+        size_t chunkSize = newSize - offset;
+        if (chunkSize > COMPARE_CHUNK_SIZE)
+            chunkSize = COMPARE_CHUNK_SIZE;
+
+        File_Read(file, chunk, chunkSize);
+        if (memcmp(chunk, newData + offset, chunkSize) != 0) {
+            File_Close(file);
+            return 0;
+        }
+
+        offset += chunkSize;
+    }
+
     File_Close(file);
 
-    lua_pushboolean(L, memcmp(oldData, newData, newSize) == 0);
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 bool File_MaybeOverwrite(lua_State* L, const char* path, const void* newData, size_t newSize)
 {
-    if (File_Exists(L, path)) {
+    /* files of different size are not opened at all */
+    FileStat st;
+    if (File_TryStat(L, path, &st) && !st.isDir && st.size == (uint64_t)newSize) {
         lua_pushcfunction(L, lua_isfileidentical);
         lua_pushstring(L, path);
         lua_pushlightuserdata(L, (void*)newData);
@@ -2,17 +2,31 @@
 #define COMMON_FILE_H
 
 #include <common/common.h>
+#include <common/buffer.h>
 
 typedef enum openmode_t {
     FILE_OPEN_SEQUENTIAL_READ,
     FILE_OPEN_MODIFY,
     FILE_CREATE_OVERWRITE,
+    FILE_CREATE_NEW,            /* File_PushOpen returns NULL (and pushes nothing) if the file already exists */
 } openmode_t;
 
+typedef enum accesshint_t {
+    FILE_ACCESS_NORMAL,
+    FILE_ACCESS_SEQUENTIAL,
+    FILE_ACCESS_RANDOM,
+} accesshint_t;
+
 STRUCT(File);
 STRUCT(Dir);
 
-#define MAX_FILE_SIZE (0x5fffffff)
+STRUCT(FileStat) {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime;
+    bool isDir;
+};
 
 bool File_Exists(lua_State* L, const char* path);
 
@@ -22,8 +36,11 @@ void File_PushCurrentDirectory(lua_State* L);
 void File_SetCurrentDirectory(lua_State* L, const char* path);
 
 bool File_TryDelete(lua_State* L, const char* path);
+void File_Rename(lua_State* L, const char* oldPath, const char* newPath);
+bool File_MakeTempName(char* buf, size_t bufSize, const char* path);
 
 void File_QueryInfo(lua_State* L, const char* path, bool* outIsDir, uint64_t* outSize);
+bool File_TryStat(lua_State* L, const char* path, FileStat* outStat);
 
 Dir* File_PushOpenDir(lua_State* L, const char* path);
 const char* File_ReadDir(Dir* dir);
@@ -31,19 +48,29 @@ void File_CloseDir(Dir* dir);
 
 File* File_PushOpen(lua_State* L, const char* path, openmode_t mode);
 void File_Close(File* file);
+void File_Sync(File* file);
 void File_MakeSparse(File* file);
-size_t File_GetSize(File* file);
-bool File_TrySetSize(File* file, size_t newSize);
-void File_SetPosition(File* file, size_t offset);
+uint64_t File_GetSize(File* file);
+bool File_TrySetSize(File* file, uint64_t newSize);
+void File_SetPosition(File* file, uint64_t offset);
 void File_Read(File* file, void* buf, size_t size);
+void File_ReadAt(File* file, uint64_t offset, void* buf, size_t size);
 void File_Write(File* file, const void* buf, size_t size);
+void File_WriteAt(File* file, uint64_t offset, const void* buf, size_t size);
 
+Buffer* File_PushBuffer(lua_State* L, const char* path);
+Buffer* File_PushMapped(lua_State* L, const char* path, accesshint_t hint);
 char* File_PushContents(lua_State* L, const char* path, size_t* outSize);
 const char* File_PushContentsAsString(lua_State* L, const char* path);
 void File_Overwrite(lua_State* L, const char* path, const void* data, size_t size);
 void File_OverwriteSparse(lua_State* L, const char* path, const void* data, size_t size);
 bool File_MaybeOverwrite(lua_State* L, const char* path, const void* newData, size_t newSize);
 
+void File_BeginSyncBatch(lua_State* L);
+void File_EndSyncBatch(lua_State* L);
+int File_FlushSyncBatch(lua_State* L);
+bool File_TryDeferSync(lua_State* L, const char* path);
+
 void File_ShellOpen(lua_State* L, const char* path);
 
 #endif
@@ -0,0 +1,199 @@
+#include <common/hash.h>
+#include <common/file.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PRIME64_1 0x9e3779b185ebca87ull
+#define PRIME64_2 0xc2b2ae3d27d4eb4full
+#define PRIME64_3 0x165667b19e3779f9ull
+#define PRIME64_4 0x85ebca77c2b2ae63ull
+#define PRIME64_5 0x27d4eb2f165667c5ull
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char* p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+        | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t read32(const unsigned char* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t value)
+{
+    acc ^= round64(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+void Hash_Init(Hash* hash)
+{
+    hash->v[0] = PRIME64_1 + PRIME64_2;
+    hash->v[1] = PRIME64_2;
+    hash->v[2] = 0;
+    hash->v[3] = (uint64_t)0 - PRIME64_1;
+    hash->totalLength = 0;
+    hash->bufferSize = 0;
+}
+
+void Hash_Update(Hash* hash, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+
+    hash->totalLength += size;
+
+    if (hash->bufferSize + size < 32) {
+        memcpy(hash->buffer + hash->bufferSize, p, size);
+        hash->bufferSize += size;
+        return;
+    }
+
+    uint64_t v0 = hash->v[0], v1 = hash->v[1], v2 = hash->v[2], v3 = hash->v[3];
+
+    if (hash->bufferSize > 0) {
+        size_t fill = 32 - hash->bufferSize;
+        memcpy(hash->buffer + hash->bufferSize, p, fill);
+        p += fill;
+        v0 = round64(v0, read64(hash->buffer));
+        v1 = round64(v1, read64(hash->buffer + 8));
+        v2 = round64(v2, read64(hash->buffer + 16));
+        v3 = round64(v3, read64(hash->buffer + 24));
+        hash->bufferSize = 0;
+    }
+
+    /* four independent lanes, so that the CPU could overlap the multiplications */
+    while (end - p >= 32) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+        p += 32;
+    }
+
+    hash->v[0] = v0;
+    hash->v[1] = v1;
+    hash->v[2] = v2;
+    hash->v[3] = v3;
+
+    if (p != end) {
+        memcpy(hash->buffer, p, (size_t)(end - p));
+        hash->bufferSize = (size_t)(end - p);
+    }
+}
+
+void Hash_UpdateString(Hash* hash, const char* str)
+{
+    /* include terminating zero so that ("ab", "c") and ("a", "bc") produce different hashes */
+    Hash_Update(hash, str, strlen(str) + 1);
+}
+
+void Hash_UpdateInteger(Hash* hash, uint64_t value)
+{
+    unsigned char buf[8];
+    for (int i = 0; i < 8; i++)
+        buf[i] = (unsigned char)(value >> (i * 8));
+    Hash_Update(hash, buf, sizeof(buf));
+}
+
+uint64_t Hash_Final(const Hash* hash)
+{
+    uint64_t h;
+
+    if (hash->totalLength >= 32) {
+        h = rotl(hash->v[0], 1) + rotl(hash->v[1], 7) + rotl(hash->v[2], 12) + rotl(hash->v[3], 18);
+        h = mergeRound(h, hash->v[0]);
+        h = mergeRound(h, hash->v[1]);
+        h = mergeRound(h, hash->v[2]);
+        h = mergeRound(h, hash->v[3]);
+    } else
+        h = hash->v[2] + PRIME64_5;
+
+    h += hash->totalLength;
+
+    const unsigned char* p = hash->buffer;
+    const unsigned char* end = p + hash->bufferSize;
+
+    while (end - p >= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (end - p >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p != end) {
+        h ^= (*p++) * PRIME64_5;
+        h = rotl(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/********************************************************************************************************************/
+
+uint64_t Hash_File(lua_State* L, const char* path)
+{
+    Hash hash;
+
+    /* mapped, so that the file is not copied through a read buffer */
+    Buffer* buffer = File_PushMapped(L, path, FILE_ACCESS_SEQUENTIAL);
+
+    Hash_Init(&hash);
+    Hash_Update(&hash, buffer->data, buffer->size);
+
+    Buffer_Close(buffer);
+    lua_pop(L, 1);
+
+    return Hash_Final(&hash);
+}
+
+/********************************************************************************************************************/
+
+void Hash_Format(char* buf, uint64_t value)
+{
+    sprintf(buf, "%08lx%08lx", (unsigned long)(value >> 32), (unsigned long)(value & 0xffffffff));
+}
+
+bool Hash_TryParse(const char* str, uint64_t* outValue)
+{
+    uint64_t value = 0;
+
+    for (int i = 0; i < HASH_STRING_LENGTH - 1; i++) {
+        char ch = str[i];
+        value <<= 4;
+        if (ch >= '0' && ch <= '9')
+            value |= (uint64_t)(ch - '0');
+        else if (ch >= 'a' && ch <= 'f')
+            value |= (uint64_t)(ch - 'a' + 10);
+        else if (ch >= 'A' && ch <= 'F')
+            value |= (uint64_t)(ch - 'A' + 10);
+        else
+            return false;
+    }
+
+    *outValue = value;
+    return true;
+}
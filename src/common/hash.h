@@ -0,0 +1,28 @@
+#ifndef COMMON_HASH_H
+#define COMMON_HASH_H
+
+#include <common/common.h>
+
+#define HASH_STRING_LENGTH 17
+
+/* XXH64, streaming */
+
+STRUCT(Hash) {
+    uint64_t v[4];
+    uint64_t totalLength;
+    unsigned char buffer[32];
+    size_t bufferSize;
+};
+
+void Hash_Init(Hash* hash);
+void Hash_Update(Hash* hash, const void* data, size_t size);
+void Hash_UpdateString(Hash* hash, const char* str);
+void Hash_UpdateInteger(Hash* hash, uint64_t value);
+uint64_t Hash_Final(const Hash* hash);
+
+uint64_t Hash_File(lua_State* L, const char* path);
+
+void Hash_Format(char* buf, uint64_t value);
+bool Hash_TryParse(const char* str, uint64_t* outValue);
+
+#endif
@@ -0,0 +1,191 @@
+#include <common/hashcache.h>
+#include <common/dirs.h>
+#include <common/file.h>
+#include <common/hash.h>
+#include <string.h>
+
+/*
+ * Content hashes of files are cached in file ".pour-hashes" in the directory where the cache was first used.
+ * It is a text file with lines:
+ *
+ *   <device> <inode> <size> <mtime> <content hash> <absolute path>
+ *
+ * Cached hash is used as long as device, inode, size and modification time of the file did not change, so
+ * unchanged files are not read again on subsequent runs. The file is written by HashCache_Flush.
+ */
+
+#define HASHES_FILE ".pour-hashes"
+#define HASHES_HEADER "# pour hash cache, do not edit\n"
+
+#define STAMP_LENGTH (4 * HASH_STRING_LENGTH - 1)
+#define HASH_RECORD_LENGTH (STAMP_LENGTH + HASH_STRING_LENGTH)
+
+static char HASH_CACHE;
+
+/********************************************************************************************************************/
+
+static void loadCache(lua_State* L, int hashesIdx, const char* path)
+{
+    int n = lua_gettop(L);
+
+    if (!File_Exists(L, path))
+        return;
+
+    const char* p = File_PushContentsAsString(L, path);
+    if (strncmp(p, HASHES_HEADER, sizeof(HASHES_HEADER) - 1) != 0) {
+        lua_settop(L, n);
+        return;
+    }
+
+    while (*p) {
+        const char* end = strchr(p, '\n');
+        if (!end)
+            end = p + strlen(p);
+
+        size_t len = (size_t)(end - p);
+        if (len > 0 && p[len - 1] == '\r')
+            --len;
+
+        if (p[0] != '#' && len > HASH_RECORD_LENGTH + 1) {
+            lua_pushlstring(L, p + HASH_RECORD_LENGTH + 1, len - HASH_RECORD_LENGTH - 1);
+            lua_pushlstring(L, p, HASH_RECORD_LENGTH);
+            lua_rawset(L, hashesIdx);
+        }
+
+        p = (*end ? end + 1 : end);
+    }
+
+    lua_settop(L, n);
+}
+
+static int pushCache(lua_State* L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &HASH_CACHE) == LUA_TTABLE)
+        return lua_gettop(L);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    int cacheIdx = lua_gettop(L);
+
+    File_PushCurrentDirectory(L);
+    lua_pushliteral(L, DIR_SEPARATOR HASHES_FILE);
+    lua_concat(L, 2);
+    lua_setfield(L, cacheIdx, "path");
+
+    lua_newtable(L);
+    lua_getfield(L, cacheIdx, "path");
+    loadCache(L, cacheIdx + 1, lua_tostring(L, -1));
+    lua_pop(L, 1);
+    lua_setfield(L, cacheIdx, "hashes");
+
+    lua_pushvalue(L, cacheIdx);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &HASH_CACHE);
+
+    return cacheIdx;
+}
+
+/********************************************************************************************************************/
+
+bool HashCache_TryHashFile(lua_State* L, const char* path, uint64_t* outHash)
+{
+    int n = lua_gettop(L);
+
+    FileStat st;
+    if (!File_TryStat(L, path, &st) || st.isDir)
+        return false;
+
+    char record[HASH_RECORD_LENGTH + 1];
+    Hash_Format(record, st.device);
+    record[HASH_STRING_LENGTH - 1] = ' ';
+    Hash_Format(record + 1 * HASH_STRING_LENGTH, st.inode);
+    record[2 * HASH_STRING_LENGTH - 1] = ' ';
+    Hash_Format(record + 2 * HASH_STRING_LENGTH, st.size);
+    record[3 * HASH_STRING_LENGTH - 1] = ' ';
+    Hash_Format(record + 3 * HASH_STRING_LENGTH, st.mtime);
+
+    int cacheIdx = pushCache(L);
+    lua_getfield(L, cacheIdx, "hashes");
+    int hashesIdx = lua_gettop(L);
+
+    Dir_PushAbsolutePath(L, path);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, hashesIdx);
+
+    size_t oldLen;
+    const char* old = lua_tolstring(L, -1, &oldLen);
+    if (old && oldLen == HASH_RECORD_LENGTH && !memcmp(old, record, STAMP_LENGTH)
+            && Hash_TryParse(old + STAMP_LENGTH + 1, outHash)) {
+        lua_settop(L, n);
+        return true;
+    }
+    lua_pop(L, 1);
+
+    *outHash = Hash_File(L, path);
+
+    record[STAMP_LENGTH] = ' ';
+    Hash_Format(record + STAMP_LENGTH + 1, *outHash);
+    lua_pushlstring(L, record, HASH_RECORD_LENGTH);
+    lua_rawset(L, hashesIdx);
+
+    lua_pushboolean(L, 1);
+    lua_setfield(L, cacheIdx, "dirty");
+
+    lua_settop(L, n);
+    return true;
+}
+
+int HashCache_Flush(lua_State* L)
+{
+    int n = lua_gettop(L);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &HASH_CACHE) != LUA_TTABLE) {
+        lua_settop(L, n);
+        return 0;
+    }
+    int cacheIdx = lua_gettop(L);
+
+    lua_getfield(L, cacheIdx, "dirty");
+    bool dirty = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (!dirty) {
+        lua_settop(L, n);
+        return 0;
+    }
+
+    lua_getfield(L, cacheIdx, "path");
+    const char* path = lua_tostring(L, -1);
+
+    lua_newtable(L);
+    int linesIdx = lua_gettop(L);
+    int lineCount = 0;
+
+    lua_getfield(L, cacheIdx, "hashes");
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pushliteral(L, " ");
+        lua_pushvalue(L, -3);
+        lua_pushliteral(L, "\n");
+        lua_concat(L, 4);
+        lua_rawseti(L, linesIdx, ++lineCount);
+    }
+    lua_pop(L, 1);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, HASHES_HEADER);
+    for (int i = 1; i <= lineCount; i++) {
+        lua_rawgeti(L, linesIdx, i);
+        luaL_addvalue(&b);
+    }
+    luaL_pushresult(&b);
+
+    size_t dataLen;
+    const char* data = lua_tolstring(L, -1, &dataLen);
+    File_MaybeOverwrite(L, path, data, dataLen);
+
+    lua_pushboolean(L, 0);
+    lua_setfield(L, cacheIdx, "dirty");
+
+    lua_settop(L, n);
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef COMMON_HASHCACHE_H
+#define COMMON_HASHCACHE_H
+
+#include <common/common.h>
+
+bool HashCache_TryHashFile(lua_State* L, const char* path, uint64_t* outHash);
+int HashCache_Flush(lua_State* L);
+
+#endif
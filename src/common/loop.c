@@ -0,0 +1,688 @@
+#include <common/loop.h>
+#include <common/exec.h>
+#include <common/script.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+#else
+ #include <errno.h>
+ #include <poll.h>
+ #include <time.h>
+ #include <unistd.h>
+#endif
+
+#define PROCESS_MT "Process*"
+#define TASK_MT "Task*"
+#define LOOP_MT "Loop*"
+
+#define READ_CHUNK_SIZE 65536
+
+/* events which could not be waited for directly are polled with this interval (in milliseconds) */
+#define POLL_INTERVAL 10
+
+typedef enum waitfor_t {
+    WAIT_PROCESS = 0,
+    WAIT_OUTPUT,
+    WAIT_TIMER,
+    WAIT_TASK,
+} waitfor_t;
+
+STRUCT(Process) {
+    ExecProcess process;
+    bool piped;
+};
+
+STRUCT(Task) {
+    bool done;
+    bool failed;
+};
+
+STRUCT(Waiter) {
+    waitfor_t type;
+    void* object;               /* ExecProcess* or Task* */
+    lua_Integer deadline;
+    int taskRef;                /* LUA_NOREF if waiting outside of a task */
+    bool ready;
+};
+
+STRUCT(Loop) {
+    Waiter* waiters;
+    size_t count;
+    size_t capacity;
+    bool blocked;
+};
+
+static char LOOP;
+static char TASKS;              /* coroutine => task, weak keys */
+static char FAILED;             /* failed tasks nobody has waited for */
+static char PROCESSES;          /* processes spawned by tasks, weak keys */
+
+static void resumeTask(lua_State* L, Loop* loop, int taskIdx, int nargs);
+
+/********************************************************************************************************************/
+
+static lua_Integer now(void)
+{
+  #ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (lua_Integer)(counter.QuadPart / (frequency.QuadPart / 1000));
+  #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lua_Integer)ts.tv_sec * 1000 + (lua_Integer)(ts.tv_nsec / 1000000);
+  #endif
+}
+
+static int minTimeout(int timeout, lua_Integer value)
+{
+    if (value < 0)
+        value = 0;
+    if (timeout >= 0 && value >= timeout)
+        return timeout;
+    return (value > 0x7fffffff ? 0x7fffffff : (int)value);
+}
+
+static int loop_gc(lua_State* L)
+{
+    Loop* loop = (Loop*)luaL_checkudata(L, 1, LOOP_MT);
+    free(loop->waiters);
+    loop->waiters = NULL;
+    loop->count = 0;
+    loop->capacity = 0;
+    return 0;
+}
+
+static Loop* getLoop(lua_State* L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &LOOP) == LUA_TUSERDATA) {
+        Loop* loop = (Loop*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return loop;
+    }
+    lua_pop(L, 1);
+
+    Loop* loop = (Loop*)lua_newuserdatauv(L, sizeof(Loop), 0);
+    memset(loop, 0, sizeof(Loop));
+    if (luaL_newmetatable(L, LOOP_MT)) {
+        lua_pushcfunction(L, loop_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &LOOP);
+
+    return loop;
+}
+
+static void pushRegistryTable(lua_State* L, const void* key, const char* mode)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE)
+        return;
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    if (mode) {
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, mode);
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+    }
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+}
+
+/********************************************************************************************************************/
+
+static bool isOutputReady(ExecProcess* process)
+{
+  #ifdef _WIN32
+    if (!process->hOutput)
+        return true;
+    DWORD dwAvailable = 0;
+    if (!PeekNamedPipe(process->hOutput, NULL, 0, NULL, &dwAvailable, NULL))
+        return true;                            /* broken pipe: reader gets EOF */
+    return dwAvailable > 0;
+  #else
+    if (process->outputFd < 0)
+        return true;
+    struct pollfd pfd;
+    pfd.fd = process->outputFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+  #endif
+}
+
+static bool isReady(Waiter* waiter, lua_Integer time)
+{
+    switch (waiter->type) {
+        case WAIT_PROCESS: return Exec_PollProcess((ExecProcess*)waiter->object);
+        case WAIT_OUTPUT: return isOutputReady((ExecProcess*)waiter->object);
+        case WAIT_TIMER: return time >= waiter->deadline;
+        case WAIT_TASK: return ((Task*)waiter->object)->done;
+    }
+    return true;
+}
+
+static Waiter* getWaiter(Loop* loop, Waiter* extra, size_t index)
+{
+    return (index < loop->count ? &loop->waiters[index] : extra);
+}
+
+static void waitForEvents(lua_State* L, Loop* loop, Waiter* extra, int timeout)
+{
+    size_t count = loop->count + (extra ? 1 : 0);
+
+  #ifdef _WIN32
+
+    DONT_WARN_UNUSED(L);
+
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    DWORD handleCount = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        Waiter* waiter = getWaiter(loop, extra, i);
+        ExecProcess* process = (ExecProcess*)waiter->object;
+        if (waiter->type == WAIT_OUTPUT)
+            timeout = minTimeout(timeout, POLL_INTERVAL);      /* anonymous pipes are not waitable */
+        else if (waiter->type == WAIT_PROCESS) {
+            if (handleCount < MAXIMUM_WAIT_OBJECTS)
+                handles[handleCount++] = (HANDLE)process->hProcess;
+            else
+                timeout = minTimeout(timeout, POLL_INTERVAL);
+        }
+    }
+
+    DWORD dwTimeout = (timeout < 0 ? INFINITE : (DWORD)timeout);
+    if (handleCount > 0)
+        WaitForMultipleObjects(handleCount, handles, FALSE, dwTimeout);
+    else
+        Sleep(dwTimeout);
+
+  #else
+
+    struct pollfd* fds = (struct pollfd*)lua_newuserdatauv(L, sizeof(struct pollfd) * count, 0);
+    nfds_t fdCount = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        Waiter* waiter = getWaiter(loop, extra, i);
+        ExecProcess* process = (ExecProcess*)waiter->object;
+        int fd = -1;
+        if (waiter->type == WAIT_OUTPUT)
+            fd = process->outputFd;
+        else if (waiter->type == WAIT_PROCESS) {
+            fd = process->pidfd;
+            if (fd < 0)
+                timeout = minTimeout(timeout, POLL_INTERVAL);  /* no pidfd, waitpid() has to be polled */
+        }
+        if (fd >= 0) {
+            fds[fdCount].fd = fd;
+            fds[fdCount].events = POLLIN;
+            fds[fdCount].revents = 0;
+            ++fdCount;
+        }
+    }
+
+    if (poll(fds, fdCount, timeout) < 0 && errno != EINTR)
+        luaL_error(L, "poll() failed: %s", strerror(errno));
+
+    lua_pop(L, 1);
+
+  #endif
+}
+
+/*
+ * Waits until at least one waiter becomes ready and resumes tasks which were waiting for it.
+ * Returns false if none of the waiters could ever become ready.
+ */
+static bool step(lua_State* L, Loop* loop, Waiter* extra)
+{
+    size_t count = loop->count + (extra ? 1 : 0);
+    lua_Integer time = now();
+    bool anyReady = false;
+    bool canProgress = false;
+    int timeout = -1;
+
+    for (size_t i = 0; i < count; i++) {
+        Waiter* waiter = getWaiter(loop, extra, i);
+        waiter->ready = isReady(waiter, time);
+        if (waiter->ready)
+            anyReady = true;
+        else if (waiter->type != WAIT_TASK) {
+            canProgress = true;
+            if (waiter->type == WAIT_TIMER)
+                timeout = minTimeout(timeout, waiter->deadline - time);
+        }
+    }
+
+    if (!anyReady) {
+        if (!canProgress)
+            return false;
+
+        waitForEvents(L, loop, extra, timeout);
+
+        time = now();
+        for (size_t i = 0; i < count; i++) {
+            Waiter* waiter = getWaiter(loop, extra, i);
+            waiter->ready = isReady(waiter, time);
+        }
+    }
+
+    /* detach ready waiters first, resumed tasks will add new ones */
+    int* refs = (int*)lua_newuserdatauv(L, sizeof(int) * (loop->count + 1), 0);
+    int refCount = 0;
+    size_t remaining = 0;
+    for (size_t i = 0; i < loop->count; i++) {
+        if (loop->waiters[i].ready)
+            refs[refCount++] = loop->waiters[i].taskRef;
+        else
+            loop->waiters[remaining++] = loop->waiters[i];
+    }
+    loop->count = remaining;
+
+    for (int i = 0; i < refCount; i++) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, refs[i]);
+        luaL_unref(L, LUA_REGISTRYINDEX, refs[i]);
+        resumeTask(L, loop, lua_gettop(L), 0);
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+    return true;
+}
+
+/*
+ * Inside of a task: yields to the loop, k is called when the event happens.
+ * Outside of a task: runs the loop until the event happens.
+ */
+static void block(lua_State* L, waitfor_t type, void* object, lua_Integer deadline, lua_KContext ctx, lua_KFunction k)
+{
+    Loop* loop = getLoop(L);
+
+    Waiter waiter;
+    waiter.type = type;
+    waiter.object = object;
+    waiter.deadline = deadline;
+    waiter.taskRef = LUA_NOREF;
+    waiter.ready = false;
+
+    if (lua_isyieldable(L)) {
+        pushRegistryTable(L, &TASKS, "k");
+        lua_pushthread(L);
+        if (lua_rawget(L, -2) == LUA_TUSERDATA) {
+            if (loop->count == loop->capacity) {
+                size_t newCapacity = (loop->capacity ? loop->capacity * 2 : 16);
+                Waiter* newWaiters = (Waiter*)realloc(loop->waiters, newCapacity * sizeof(Waiter));
+                if (!newWaiters)
+                    luaL_error(L, "out of memory.");
+                loop->waiters = newWaiters;
+                loop->capacity = newCapacity;
+            }
+
+            waiter.taskRef = luaL_ref(L, LUA_REGISTRYINDEX);
+            lua_pop(L, 1);
+
+            loop->waiters[loop->count++] = waiter;
+            loop->blocked = true;
+            lua_yieldk(L, 0, ctx, k);
+            return;
+        }
+        lua_pop(L, 2);
+    }
+
+    do {
+        if (!step(L, loop, &waiter))
+            luaL_error(L, "wait would never finish.");
+    } while (!waiter.ready);
+}
+
+/********************************************************************************************************************/
+
+static Process* checkProcess(lua_State* L, int index)
+{
+    return (Process*)luaL_checkudata(L, index, PROCESS_MT);
+}
+
+static int process_wait(lua_State* L);
+static int process_wait_k(lua_State* L, int status, lua_KContext ctx)
+{
+    DONT_WARN_UNUSED(status);
+    DONT_WARN_UNUSED(ctx);
+    return process_wait(L);
+}
+
+static int process_wait(lua_State* L)
+{
+    Process* p = checkProcess(L, 1);
+    while (!Exec_PollProcess(&p->process))
+        block(L, WAIT_PROCESS, &p->process, 0, 0, process_wait_k);
+
+    lua_pushinteger(L, p->process.exitCode);
+    return 1;
+}
+
+static bool readOutput(lua_State* L, Process* p)
+{
+    if (!isOutputReady(&p->process))
+        return false;
+
+    luaL_Buffer b;
+    char* buf = luaL_buffinitsize(L, &b, READ_CHUNK_SIZE);
+
+  #ifdef _WIN32
+    DWORD dwBytesRead = 0;
+    if (!p->process.hOutput || !ReadFile(p->process.hOutput, buf, READ_CHUNK_SIZE, &dwBytesRead, NULL))
+        dwBytesRead = 0;
+    size_t bytesRead = dwBytesRead;
+  #else
+    ssize_t result = (p->process.outputFd >= 0 ? read(p->process.outputFd, buf, READ_CHUNK_SIZE) : 0);
+    if (result < 0 && (errno == EINTR || errno == EAGAIN)) {
+        lua_pop(L, 1);
+        return false;
+    }
+    size_t bytesRead = (result > 0 ? (size_t)result : 0);
+  #endif
+
+    if (bytesRead == 0) {
+        lua_pop(L, 1);
+        lua_pushnil(L);                         /* end of output */
+    } else {
+        luaL_addsize(&b, bytesRead);
+        luaL_pushresult(&b);
+    }
+
+    return true;
+}
+
+static int process_read(lua_State* L);
+static int process_read_k(lua_State* L, int status, lua_KContext ctx)
+{
+    DONT_WARN_UNUSED(status);
+    DONT_WARN_UNUSED(ctx);
+    return process_read(L);
+}
+
+static int process_read(lua_State* L)
+{
+    Process* p = checkProcess(L, 1);
+    if (!p->piped)
+        return luaL_error(L, "process output is not piped.");
+
+    lua_settop(L, 1);
+    while (!readOutput(L, p))
+        block(L, WAIT_OUTPUT, &p->process, 0, 0, process_read_k);
+
+    return 1;
+}
+
+static int process_kill(lua_State* L)
+{
+    Process* p = checkProcess(L, 1);
+    Exec_KillProcess(&p->process);
+    return 0;
+}
+
+static int process_gc(lua_State* L)
+{
+    Process* p = (Process*)luaL_checkudata(L, 1, PROCESS_MT);
+    Exec_CloseProcess(&p->process);
+    return 0;
+}
+
+static const luaL_Reg process_methods[] = {
+    { "kill", process_kill },
+    { "read", process_read },
+    { "wait", process_wait },
+    { NULL, NULL }
+};
+
+void Loop_PushProcess(lua_State* L, const char* const* argv, int argc, bool pipeOutput)
+{
+    Process* p = (Process*)lua_newuserdatauv(L, sizeof(Process), 0);
+    memset(p, 0, sizeof(Process));
+    p->process.exited = true;                   /* nothing to clean up until spawned */
+    p->piped = pipeOutput;
+
+    if (luaL_newmetatable(L, PROCESS_MT)) {
+        lua_pushcfunction(L, process_gc);
+        lua_setfield(L, -2, "__gc");
+        luaL_newlib(L, process_methods);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    if (!Exec_Spawn(L, argv, argc, NULL, pipeOutput, &p->process))
+        luaL_error(L, "command execution failed.");
+
+    if (lua_isyieldable(L)) {
+        pushRegistryTable(L, &TASKS, "k");
+        lua_pushthread(L);
+        bool inTask = (lua_rawget(L, -2) == LUA_TUSERDATA);
+        lua_pop(L, 2);
+
+        if (inTask) {
+            pushRegistryTable(L, &PROCESSES, "k");
+            lua_pushvalue(L, -2);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+    }
+}
+
+/********************************************************************************************************************/
+
+static void resumeTask(lua_State* L, Loop* loop, int taskIdx, int nargs)
+{
+    Task* task = (Task*)lua_touserdata(L, taskIdx);
+
+    lua_getiuservalue(L, taskIdx, 1);
+    lua_State* co = lua_tothread(L, -1);
+    lua_pop(L, 1);
+
+    int nres = 0;
+    loop->blocked = false;
+    int status = lua_resume(co, L, nargs, &nres);
+
+    if (status == LUA_YIELD) {
+        lua_pop(co, nres);
+        if (loop->blocked)
+            return;
+        lua_pushliteral(co, "task yielded without waiting for an event.");
+        status = LUA_ERRRUN;
+    }
+
+    task->done = true;
+
+    if (status == LUA_OK) {
+        luaL_checkstack(L, nres + 2, "too many results");
+        lua_createtable(L, nres, 1);
+        lua_xmove(co, L, nres);
+        for (int i = nres; i > 0; i--)
+            lua_rawseti(L, -1 - i, i);
+        lua_pushinteger(L, nres);
+        lua_setfield(L, -2, "n");
+    } else {
+        task->failed = true;
+        const char* msg = lua_tostring(co, -1);
+        if (!msg)
+            msg = lua_pushfstring(co, "(error object is a %s value)", luaL_typename(co, -1));
+        luaL_traceback(L, co, msg, 0);
+
+        pushRegistryTable(L, &FAILED, NULL);
+        lua_pushvalue(L, taskIdx);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+
+    lua_setiuservalue(L, taskIdx, 2);           /* results or error message */
+
+    lua_pushnil(L);
+    lua_setiuservalue(L, taskIdx, 1);           /* coroutine is no longer needed */
+}
+
+static int task_wait(lua_State* L);
+static int task_wait_k(lua_State* L, int status, lua_KContext ctx)
+{
+    DONT_WARN_UNUSED(status);
+    DONT_WARN_UNUSED(ctx);
+    return task_wait(L);
+}
+
+static int task_wait(lua_State* L)
+{
+    Task* task = (Task*)luaL_checkudata(L, 1, TASK_MT);
+    lua_settop(L, 1);
+
+    while (!task->done)
+        block(L, WAIT_TASK, task, 0, 0, task_wait_k);
+
+    if (task->failed) {
+        pushRegistryTable(L, &FAILED, NULL);
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+        lua_getiuservalue(L, 1, 2);
+        return lua_error(L);
+    }
+
+    lua_getiuservalue(L, 1, 2);
+    int resultsIdx = lua_gettop(L);
+    lua_getfield(L, resultsIdx, "n");
+    int n = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    luaL_checkstack(L, n, "too many results");
+    for (int i = 1; i <= n; i++)
+        lua_rawgeti(L, resultsIdx, i);
+
+    return n;
+}
+
+static const luaL_Reg task_methods[] = {
+    { "wait", task_wait },
+    { NULL, NULL }
+};
+
+void Loop_PushTask(lua_State* L, int nargs)
+{
+    int funcIdx = lua_gettop(L) - nargs;
+    luaL_checktype(L, funcIdx, LUA_TFUNCTION);
+
+    Loop* loop = getLoop(L);
+
+    lua_State* co = lua_newthread(L);
+    Task* task = (Task*)lua_newuserdatauv(L, sizeof(Task), 2);
+    task->done = false;
+    task->failed = false;
+
+    if (luaL_newmetatable(L, TASK_MT)) {
+        luaL_newlib(L, task_methods);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, -2);
+    lua_setiuservalue(L, -2, 1);
+
+    pushRegistryTable(L, &TASKS, "k");
+    lua_pushvalue(L, -3);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    /* stack: function, args..., coroutine, task => coroutine, task, function, args... */
+    lua_rotate(L, funcIdx, 2);
+    lua_xmove(L, co, nargs + 1);
+    lua_remove(L, funcIdx);
+
+    resumeTask(L, loop, funcIdx, nargs);
+}
+
+/********************************************************************************************************************/
+
+static int sleep_k(lua_State* L, int status, lua_KContext ctx)
+{
+    DONT_WARN_UNUSED(status);
+
+    int deadlineIdx = (int)ctx;
+    lua_Integer deadline = lua_tointeger(L, deadlineIdx);
+    while (now() < deadline)
+        block(L, WAIT_TIMER, NULL, deadline, ctx, sleep_k);
+
+    return 0;
+}
+
+void Loop_Sleep(lua_State* L, lua_Number seconds)
+{
+    lua_Integer deadline = now() + (lua_Integer)(seconds * 1000.0);
+    lua_pushinteger(L, deadline);
+    sleep_k(L, LUA_OK, (lua_KContext)lua_gettop(L));
+    lua_pop(L, 1);
+}
+
+/********************************************************************************************************************/
+
+int Loop_Run(lua_State* L)
+{
+    Loop* loop = getLoop(L);
+
+    while (loop->count > 0) {
+        if (!step(L, loop, NULL)) {
+            int count = (int)loop->count;
+            for (size_t i = 0; i < loop->count; i++)
+                luaL_unref(L, LUA_REGISTRYINDEX, loop->waiters[i].taskRef);
+            loop->count = 0;
+            return luaL_error(L, "%d async task(s) are waiting for each other.", count);
+        }
+    }
+
+    int failed = 0;
+    pushRegistryTable(L, &FAILED, NULL);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        lua_getiuservalue(L, -1, 2);
+        Script_Report(L, LUA_ERRRUN);
+        ++failed;
+    }
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &FAILED);
+
+    if (failed > 0)
+        return luaL_error(L, "%d async task(s) failed.", failed);
+
+    return 0;
+}
+
+/* abandons all tasks, e.g. when the chunk which started them failed; processes spawned by tasks are stopped */
+int Loop_Clear(lua_State* L)
+{
+    Loop* loop = getLoop(L);
+
+    for (size_t i = 0; i < loop->count; i++)
+        luaL_unref(L, LUA_REGISTRYINDEX, loop->waiters[i].taskRef);
+    loop->count = 0;
+
+    pushRegistryTable(L, &PROCESSES, "k");
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        ExecProcess* process = &((Process*)lua_touserdata(L, -1))->process;
+        Exec_StopProcess(process);
+        Exec_CloseProcess(process);
+    }
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &FAILED);
+
+    return 0;
+}
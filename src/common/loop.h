@@ -0,0 +1,19 @@
+#ifndef COMMON_LOOP_H
+#define COMMON_LOOP_H
+
+#include <common/common.h>
+
+/*
+ * Event loop for coroutines started with Loop_PushTask. A task waiting on a process, its output, a timer or
+ * another task yields to the loop; code outside of a task waiting on the same things runs the loop until the
+ * event happens, so other tasks keep going in the meantime.
+ */
+
+void Loop_PushProcess(lua_State* L, const char* const* argv, int argc, bool pipeOutput);
+void Loop_PushTask(lua_State* L, int nargs);
+void Loop_Sleep(lua_State* L, lua_Number seconds);
+
+int Loop_Run(lua_State* L);
+int Loop_Clear(lua_State* L);
+
+#endif
@@ -1,9 +1,14 @@
 #include <common/script.h>
+#include <common/alloc.h>
 #include <common/dirs.h>
 #include <common/console.h>
 #include <common/utf8.h>
 #include <common/exec.h>
 #include <common/file.h>
+#include <common/cache.h>
+#include <common/hashcache.h>
+#include <common/statcache.h>
+#include <common/loop.h>
 #include <grp/grpfile.h>
 #include <dosbox/dosbox.h>
 #include <mkdisk/mkdisk.h>
@@ -91,7 +96,7 @@ static void laction(int i)
 /*
 ** Message handler used to run all chunks
 */
-static int msghandler(lua_State* L)
+int Script_MessageHandler(lua_State* L)
 {
     const char* msg = lua_tostring(L, 1);
     if (msg == NULL) {
@@ -107,7 +112,7 @@ static int msghandler(lua_State* L)
 ** Check whether 'status' is not OK and, if so, prints the error
 ** message on the top of the stack.
 */
-static int report(lua_State* L, int status)
+int Script_Report(lua_State* L, int status)
 {
     if (status != LUA_OK) {
         const char* msg = lua_tostring(L, -1);
@@ -133,11 +138,19 @@ static int report(lua_State* L, int status)
 ** Interface to 'lua_pcall', which sets appropriate message function
 ** and C-signal handler. Used to run all chunks.
 */
+static int flushCaches(lua_State* L)
+{
+    HashCache_Flush(L);
+    Cache_Flush(L);
+    File_FlushSyncBatch(L);     /* in case the chunk failed inside of a batch */
+    return 0;
+}
+
 static int docall(lua_State* L, int narg, int nres)
 {
     int status;
     int base = lua_gettop(L) - narg;  /* function index */
-    lua_pushcfunction(L, msghandler);  /* push message handler */
+    lua_pushcfunction(L, Script_MessageHandler);  /* push message handler */
     lua_insert(L, base);  /* put it under function and args */
 
     if (g_inCall++ == 0)
@@ -145,6 +158,30 @@ static int docall(lua_State* L, int narg, int nres)
 
     status = lua_pcall(L, narg, nres, base);
 
+    /* run the event loop until all async tasks started by the chunk finish */
+    if (status == LUA_OK && g_inCall == 1) {
+        lua_pushcfunction(L, Loop_Run);
+        status = lua_pcall(L, 0, 0, base);
+    }
+
+    /* tasks left behind by a failed chunk are abandoned and their processes stopped */
+    if (status != LUA_OK && g_inCall == 1) {
+        lua_pushcfunction(L, Loop_Clear);
+        if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+            lua_pop(L, 1);
+    }
+
+    /* caches are written out even if the chunk failed */
+    if (g_inCall == 1) {
+        lua_pushcfunction(L, flushCaches);
+        if (lua_pcall(L, 0, 0, base) != LUA_OK) {
+            if (status == LUA_OK)
+                status = LUA_ERRRUN;
+            else
+                lua_pop(L, 1);  /* keep the original error */
+        }
+    }
+
     if (--g_inCall == 0)
         signal(SIGINT, SIG_DFL); /* reset C-signal handler */
 
@@ -152,6 +189,8 @@ static int docall(lua_State* L, int narg, int nres)
     return status;
 }
 
+static char ENV_METATABLE;
+
 static int pushGlobals(lua_State* L, int globalsTableIdx)
 {
     int envIndex;
@@ -162,24 +201,22 @@ static int pushGlobals(lua_State* L, int globalsTableIdx)
         envIndex = lua_gettop(L);
     }
 
-    lua_pushvalue(L, -1);
+    lua_pushvalue(L, envIndex);
     lua_setfield(L, envIndex, "_G");            /* _ENV._G = _ENV */
 
-    /* copy values from globals */
-    lua_pushglobaltable(L);
-    int globalsIndex = lua_gettop(L);
-    lua_pushnil(L);
-    while (lua_next(L, globalsIndex)) {
-        lua_pushvalue(L, -2);
-        if (lua_rawget(L, envIndex) > LUA_TNIL)
-            lua_pop(L, 1); /* override exists, keep it */
-        else {
+    /* globals are not copied: names not defined in _ENV are looked up in the global table */
+    if (lua_getmetatable(L, envIndex))
+        lua_pop(L, 1);                          /* already chained */
+    else {
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, &ENV_METATABLE) != LUA_TTABLE) {
             lua_pop(L, 1);
-            lua_pushvalue(L, -2);
-            lua_pushvalue(L, -2);
-            lua_rawset(L, envIndex);
+            lua_createtable(L, 0, 1);
+            lua_pushglobaltable(L);
+            lua_setfield(L, -2, "__index");
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, &ENV_METATABLE);
         }
-        lua_pop(L, 1);
+        lua_setmetatable(L, envIndex);
     }
 
     lua_pushvalue(L, envIndex);                 /* new _ENV */
@@ -187,6 +224,13 @@ static int pushGlobals(lua_State* L, int globalsTableIdx)
     return envIndex;
 }
 
+#ifdef POUR_BENCHMARKS
+int Script_PushGlobals(lua_State* L, int globalsTableIdx)
+{
+    return pushGlobals(L, globalsTableIdx);
+}
+#endif
+
 bool Script_DoFile(lua_State* L, const char* name, const char* chdir, int globalsTableIdx)
 {
     int n = lua_gettop(L);
@@ -197,7 +241,7 @@ bool Script_DoFile(lua_State* L, const char* name, const char* chdir, int global
     Dir_FromNativeSeparators(path);
     Dir_RemoveLastPath(path);
 
-    int status = report(L, luaL_loadfile(L, name)); /* FIXME: utf-8 */
+    int status = Script_Report(L, luaL_loadfile(L, name)); /* FIXME: utf-8 */
     if (status != LUA_OK) {
         lua_settop(L, n);
         return false;
@@ -233,7 +277,7 @@ bool Script_DoFunction(lua_State* L, const char* scriptDir, const char* chdir, i
     int status = docall(L, 0, 0);
     g_currentScriptDir = prevScriptDir;
 
-    report(L, status);
+    Script_Report(L, status);
 
     const char* oldcwd = lua_tostring(L, curdir);
     File_SetCurrentDirectory(L, oldcwd);
@@ -244,25 +288,86 @@ bool Script_DoFunction(lua_State* L, const char* scriptDir, const char* chdir, i
 
 /********************************************************************************************************************/
 
+static char FUNCTIONS;
+static char FUNCTIONS_BOUND;
+
+/* environment => reset function returned by functions.lua; weak keys, so that environments can be collected */
+static int pushBoundFunctions(lua_State* L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &FUNCTIONS_BOUND) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &FUNCTIONS_BOUND);
+    }
+    return lua_gettop(L);
+}
+
 bool Script_LoadFunctions(lua_State* L, int globalsTableIdx)
 {
-    int status = luaL_loadbuffer(L, (const char*)functions_lua, sizeof(functions_lua), "@functions.lua");
-    if (report(L, status) != 0)
-        return false;
+    int n = lua_gettop(L);
+    int boundIdx = 0;
 
-    if (globalsTableIdx != 0) {
-        int functionIdx = lua_gettop(L);
+    if (globalsTableIdx == 0)
+        lua_pushglobaltable(L);
+    else {
+        globalsTableIdx = lua_absindex(L, globalsTableIdx);
+        boundIdx = pushBoundFunctions(L);
+        lua_pushvalue(L, globalsTableIdx);
+        if (lua_rawget(L, boundIdx) == LUA_TFUNCTION) {
+            lua_call(L, 0, 0);                  /* already bound to this table, only reset per-phase values */
+            lua_settop(L, n);
+            return true;
+        }
+        lua_pop(L, 1);
         pushGlobals(L, globalsTableIdx);
-        lua_setupvalue(L, functionIdx, 1); /* set as upvalue #1 for the script */
-        lua_pushvalue(L, functionIdx);
+    }
+    int envIdx = lua_gettop(L);
+
+    /*
+     * functions.lua is parsed once per process. Its body takes target _ENV as an argument, so executing
+     * the cached chunk only creates closures bound to that environment.
+     */
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &FUNCTIONS) != LUA_TFUNCTION) {
+        lua_pop(L, 1);
+        int status = luaL_loadbuffer(L, (const char*)functions_lua, sizeof(functions_lua), "@functions.lua");
+        if (Script_Report(L, status) != 0) {
+            lua_settop(L, n);
+            return false;
+        }
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &FUNCTIONS);
     }
 
-    lua_call(L, 0, 0);
+    lua_pushvalue(L, envIdx);
+    lua_call(L, 1, 1);
+
+    if (globalsTableIdx != 0) {
+        lua_pushvalue(L, globalsTableIdx);
+        lua_insert(L, -2);
+        lua_rawset(L, boundIdx);
+    }
+
+    lua_settop(L, n);
     return true;
 }
 
 /********************************************************************************************************************/
 
+static void pushDirGlobals(lua_State* L)
+{
+    lua_pushstring(L, g_rootDir); lua_setglobal(L, "ROOT_DIR");
+    lua_pushstring(L, g_installDir); lua_setglobal(L, "INSTALL_DIR");
+    lua_pushstring(L, g_dataDir); lua_setglobal(L, "DATA_DIR");
+    lua_pushstring(L, g_cmakeModulesDir); lua_setglobal(L, "CMAKE_MODULES_DIR");
+    lua_pushstring(L, g_packagesDir); lua_setglobal(L, "PACKAGES_DIR");
+    lua_pushstring(L, g_targetsDir); lua_setglobal(L, "TARGETS_DIR");
+}
+
 STRUCT(MainParams) {
     PFNMainProc pfnMain;
     char** argv;
@@ -280,6 +385,7 @@ static int pmain(lua_State *L)
     lua_setfield(L, LUA_REGISTRYINDEX, "LUA_NOENV");
 
     Con_Init();
+    StatCache_Init();
 
   #ifdef _WIN32
     lua_pushboolean(L, 1);
@@ -307,12 +413,7 @@ static int pmain(lua_State *L)
 
     Dirs_Init(L);
 
-    lua_pushstring(L, g_rootDir); lua_setglobal(L, "ROOT_DIR");
-    lua_pushstring(L, g_installDir); lua_setglobal(L, "INSTALL_DIR");
-    lua_pushstring(L, g_dataDir); lua_setglobal(L, "DATA_DIR");
-    lua_pushstring(L, g_cmakeModulesDir); lua_setglobal(L, "CMAKE_MODULES_DIR");
-    lua_pushstring(L, g_packagesDir); lua_setglobal(L, "PACKAGES_DIR");
-    lua_pushstring(L, g_targetsDir); lua_setglobal(L, "TARGETS_DIR");
+    pushDirGlobals(L);
 
     Exec_Init(L);
 
@@ -337,9 +438,49 @@ static int pmain(lua_State *L)
     return 1;
 }
 
+/*
+** Worker states do not load mkdisk, ext2read, grp and dosbox modules, as these keep their state in globals.
+*/
+static int pworker(lua_State* L)
+{
+    lua_pushboolean(L, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "LUA_NOENV");
+
+  #ifdef _WIN32
+    lua_pushboolean(L, 1);
+    lua_setglobal(L, "HOST_WINDOWS");
+  #endif
+
+    pushDirGlobals(L);
+
+    luaL_openlibs(L);
+    Pour_InitWorkerLua(L);
+    Patch_InitLua(L);
+
+    if (!Script_LoadFunctions(L, 0))
+        return luaL_error(L, "unable to load functions.lua.");
+
+    return 0;
+}
+
+lua_State* Script_NewWorkerState(void)
+{
+    lua_State* L = Alloc_NewState();
+    if (!L)
+        return NULL;
+
+    lua_pushcfunction(L, &pworker);
+    if (Script_Report(L, lua_pcall(L, 0, 0, 0)) != LUA_OK) {
+        Alloc_CloseState(L);
+        return NULL;
+    }
+
+    return L;
+}
+
 int Script_RunVM(int argc, char** argv, PFNMainProc pfnMain)
 {
-    lua_State* L = luaL_newstate();
+    lua_State* L = Alloc_NewState();
     if (!L) {
         fprintf(stderr, "ERROR: Lua initialization failed.\n");
         return EXIT_FAILURE;
@@ -358,12 +499,12 @@ int Script_RunVM(int argc, char** argv, PFNMainProc pfnMain)
     lua_pushlightuserdata(L, &params);
     int status = lua_pcall(L, 1, 1, 0);
     int result = lua_toboolean(L, -1);
-    report(L, status);
+    Script_Report(L, status);
 
     g_exited = true;
     g_cleanExit = (result && status == LUA_OK);
 
-    lua_close(L);
+    Alloc_CloseState(L);
 
     return (g_cleanExit ? EXIT_SUCCESS : EXIT_FAILURE);
 }
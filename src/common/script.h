@@ -10,11 +10,19 @@ void Script_GetString(lua_State* L, int index, char* buf, size_t bufSize, const
 const char* Script_GetCurrentScriptDir(lua_State* L);
 
 void Script_Interrupt(void);
+int Script_MessageHandler(lua_State* L);
+int Script_Report(lua_State* L, int status);
+
 bool Script_DoFile(lua_State* L, const char* name, const char* chdir, int globalsTableIdx);
 bool Script_DoFunction(lua_State* L, const char* scriptDir, const char* chdir, int functionIdx);
 
 bool Script_LoadFunctions(lua_State* L, int globalsTableIdx);
 
+#ifdef POUR_BENCHMARKS
+int Script_PushGlobals(lua_State* L, int globalsTableIdx);   /* for src/bench */
+#endif
+
+lua_State* Script_NewWorkerState(void);
 int Script_RunVM(int argc, char** argv, PFNMainProc pfnMain);
 
 #endif
@@ -0,0 +1,286 @@
+#include <common/serialize.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG_NIL 'n'
+#define TAG_FALSE 'f'
+#define TAG_TRUE 't'
+#define TAG_INTEGER 'i'
+#define TAG_NUMBER 'd'
+#define TAG_STRING 's'
+#define TAG_TABLE 'T'
+#define TAG_TABLE_END 'e'
+#define TAG_BUFFER 'B'
+#define TAG_FUNCTION 'F'
+
+#define MAX_DATA_DEPTH 200 /* tables nested deeper are rejected, so recursion doesn't overflow the C stack */
+
+/********************************************************************************************************************/
+
+void Serialize_Init(Serialized* s)
+{
+    memset(s, 0, sizeof(Serialized));
+}
+
+void Serialize_Free(Serialized* s)
+{
+    for (size_t i = 0; i < s->bufferCount; i++)
+        Buffer_Release(s->buffers[i]);
+
+    free(s->buffers);
+    free(s->data);
+
+    memset(s, 0, sizeof(Serialized));
+}
+
+static void append(lua_State* L, Serialized* s, const void* data, size_t size)
+{
+    if (s->size + size > s->capacity) {
+        size_t newCapacity = (s->capacity ? s->capacity * 2 : 256);
+        while (newCapacity < s->size + size)
+            newCapacity *= 2;
+
+        char* newData = (char*)realloc(s->data, newCapacity);
+        if (!newData)
+            luaL_error(L, "out of memory.");
+
+        s->data = newData;
+        s->capacity = newCapacity;
+    }
+
+    memcpy(s->data + s->size, data, size);
+    s->size += size;
+}
+
+static void appendTag(lua_State* L, Serialized* s, char tag)
+{
+    append(L, s, &tag, 1);
+}
+
+static void appendBuffer(lua_State* L, Serialized* s, Buffer* buffer)
+{
+    if (s->bufferCount == s->bufferCapacity) {
+        size_t newCapacity = (s->bufferCapacity ? s->bufferCapacity * 2 : 8);
+        BufferStorage** newBuffers = (BufferStorage**)realloc(s->buffers, newCapacity * sizeof(BufferStorage*));
+        if (!newBuffers)
+            luaL_error(L, "out of memory.");
+        s->buffers = newBuffers;
+        s->bufferCapacity = newCapacity;
+    }
+
+    size_t index = s->bufferCount;
+    s->buffers[s->bufferCount++] = Buffer_Retain(buffer);
+
+    appendTag(L, s, TAG_BUFFER);
+    append(L, s, &index, sizeof(index));
+}
+
+static int writer(lua_State* L, const void* p, size_t size, void* ud)
+{
+    append(L, (Serialized*)ud, p, size);
+    return 0;
+}
+
+static void appendFunction(lua_State* L, int index, Serialized* s)
+{
+    if (lua_iscfunction(L, index))
+        luaL_error(L, "unable to serialize C function.");
+
+    for (int i = 1; ; i++) {
+        const char* name = lua_getupvalue(L, index, i);
+        if (!name)
+            break;
+        lua_pop(L, 1);
+
+        /* upvalue names are not available for stripped functions, first one is _ENV then */
+        if (strcmp(name, "_ENV") != 0 && !(i == 1 && *name == 0))
+            luaL_error(L, "unable to serialize function with upvalue '%s'.", name);
+    }
+
+    appendTag(L, s, TAG_FUNCTION);
+
+    size_t sizeOffset = s->size;
+    size_t size = 0;
+    append(L, s, &size, sizeof(size));
+
+    lua_pushvalue(L, index);
+    lua_dump(L, writer, s, 0);
+    lua_pop(L, 1);
+
+    size = s->size - sizeOffset - sizeof(size);
+    memcpy(s->data + sizeOffset, &size, sizeof(size));
+}
+
+static void appendValue(lua_State* L, int index, Serialized* s, int visitedIdx, int depth)
+{
+    index = lua_absindex(L, index);
+
+    switch (lua_type(L, index)) {
+        case LUA_TNIL:
+            appendTag(L, s, TAG_NIL);
+            return;
+
+        case LUA_TBOOLEAN:
+            appendTag(L, s, (lua_toboolean(L, index) ? TAG_TRUE : TAG_FALSE));
+            return;
+
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, index)) {
+                lua_Integer value = lua_tointeger(L, index);
+                appendTag(L, s, TAG_INTEGER);
+                append(L, s, &value, sizeof(value));
+            } else {
+                lua_Number value = lua_tonumber(L, index);
+                appendTag(L, s, TAG_NUMBER);
+                append(L, s, &value, sizeof(value));
+            }
+            return;
+
+        case LUA_TSTRING: {
+            size_t len;
+            const char* str = lua_tolstring(L, index, &len);
+            appendTag(L, s, TAG_STRING);
+            append(L, s, &len, sizeof(len));
+            append(L, s, str, len);
+            return;
+        }
+
+        case LUA_TTABLE:
+            luaL_checkstack(L, 4, "table is too deep");
+            if (depth > MAX_DATA_DEPTH)
+                luaL_error(L, "unable to serialize table nested deeper than %d levels.", MAX_DATA_DEPTH);
+            lua_pushvalue(L, index);
+            if (lua_rawget(L, visitedIdx) != LUA_TNIL)
+                luaL_error(L, "unable to serialize recursive table.");
+            lua_pop(L, 1);
+
+            lua_pushvalue(L, index);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, visitedIdx);
+
+            appendTag(L, s, TAG_TABLE);
+            lua_pushnil(L);
+            while (lua_next(L, index)) {
+                appendValue(L, -2, s, visitedIdx, depth + 1);
+                appendValue(L, -1, s, visitedIdx, depth + 1);
+                lua_pop(L, 1);
+            }
+            appendTag(L, s, TAG_TABLE_END);
+
+            lua_pushvalue(L, index);
+            lua_pushnil(L);
+            lua_rawset(L, visitedIdx);
+            return;
+
+        case LUA_TFUNCTION:
+            appendFunction(L, index, s);
+            return;
+
+        case LUA_TUSERDATA: {
+            Buffer* buffer = Buffer_Test(L, index);
+            if (buffer) {
+                appendBuffer(L, s, Buffer_Check(L, index));
+                return;
+            }
+            break;
+        }
+    }
+
+    luaL_error(L, "unable to serialize value of type %s.", luaL_typename(L, index));
+}
+
+void Serialize_Value(lua_State* L, int index, Serialized* s)
+{
+    index = lua_absindex(L, index);
+    lua_newtable(L);
+    appendValue(L, index, s, lua_gettop(L), 0);
+    lua_pop(L, 1);
+}
+
+/********************************************************************************************************************/
+
+static size_t read(lua_State* L, const Serialized* s, size_t offset, void* dst, size_t size)
+{
+    if (offset + size > s->size || offset + size < offset)
+        luaL_error(L, "corrupt serialized data.");
+    memcpy(dst, s->data + offset, size);
+    return offset + size;
+}
+
+static size_t pushValue(lua_State* L, const Serialized* s, size_t offset, int depth)
+{
+    char tag;
+    offset = read(L, s, offset, &tag, 1);
+
+    luaL_checkstack(L, 4, "serialized table is too deep");
+
+    if (s->dataOnly && (tag == TAG_FUNCTION || tag == TAG_BUFFER))
+        luaL_error(L, "unexpected code or buffer in serialized data.");
+
+    switch (tag) {
+        case TAG_NIL:
+            lua_pushnil(L);
+            return offset;
+
+        case TAG_FALSE:
+        case TAG_TRUE:
+            lua_pushboolean(L, tag == TAG_TRUE);
+            return offset;
+
+        case TAG_INTEGER: {
+            lua_Integer value;
+            offset = read(L, s, offset, &value, sizeof(value));
+            lua_pushinteger(L, value);
+            return offset;
+        }
+
+        case TAG_NUMBER: {
+            lua_Number value;
+            offset = read(L, s, offset, &value, sizeof(value));
+            lua_pushnumber(L, value);
+            return offset;
+        }
+
+        case TAG_STRING:
+        case TAG_FUNCTION: {
+            size_t len;
+            offset = read(L, s, offset, &len, sizeof(len));
+            if (offset + len > s->size || offset + len < offset)
+                luaL_error(L, "corrupt serialized data.");
+            if (tag == TAG_STRING)
+                lua_pushlstring(L, s->data + offset, len);
+            else if (luaL_loadbufferx(L, s->data + offset, len, "=(serialized)", "b") != LUA_OK)
+                lua_error(L);
+            return offset + len;
+        }
+
+        case TAG_TABLE:
+            if (depth > MAX_DATA_DEPTH)
+                luaL_error(L, "serialized table is too deep.");
+            lua_newtable(L);
+            for (;;) {
+                if (offset < s->size && s->data[offset] == TAG_TABLE_END)
+                    return offset + 1;
+                offset = pushValue(L, s, offset, depth + 1);
+                offset = pushValue(L, s, offset, depth + 1);
+                lua_rawset(L, -3);
+            }
+
+        case TAG_BUFFER: {
+            size_t index;
+            offset = read(L, s, offset, &index, sizeof(index));
+            if (index >= s->bufferCount)
+                luaL_error(L, "corrupt serialized data.");
+            Buffer_PushShared(L, s->buffers[index]);
+            return offset;
+        }
+    }
+
+    luaL_error(L, "corrupt serialized data.");
+    return offset;
+}
+
+size_t Serialize_PushValue(lua_State* L, const Serialized* s, size_t offset)
+{
+    return pushValue(L, s, offset, 0);
+}
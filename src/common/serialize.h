@@ -0,0 +1,34 @@
+#ifndef COMMON_SERIALIZE_H
+#define COMMON_SERIALIZE_H
+
+#include <common/common.h>
+#include <common/buffer.h>
+
+/*
+ * Serialized values live in memory which does not belong to any Lua state, so they could be passed between
+ * states running on different threads. Supported types are nil, booleans, numbers, strings, tables without
+ * cycles nested up to 200 levels, buffers (shared, not copied) and Lua functions which have no upvalues other
+ * than _ENV.
+ *
+ * Data read from files can't be trusted: set dataOnly before decoding it, so that functions (which are loaded
+ * from unchecked bytecode) and buffers are rejected.
+ */
+
+STRUCT(Serialized) {
+    char* data;
+    size_t size;
+    size_t capacity;
+    BufferStorage** buffers;
+    size_t bufferCount;
+    size_t bufferCapacity;
+    bool dataOnly;
+};
+
+void Serialize_Init(Serialized* s);
+void Serialize_Free(Serialized* s);
+
+void Serialize_Value(lua_State* L, int index, Serialized* s);
+
+size_t Serialize_PushValue(lua_State* L, const Serialized* s, size_t offset);
+
+#endif
@@ -0,0 +1,527 @@
+#include <common/statcache.h>
+#include <common/thread.h>
+#include <common/dirs.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+#endif
+
+/*
+ * Entries are keyed on the absolute canonical path of the file's directory followed by the file name, so that
+ * a file has one key no matter whether it is reached through a relative path, ".." segments or a symlinked
+ * directory. The canonical path of a directory is resolved once (realpath, or GetFullPathName on Windows) and
+ * remembered in an alias entry under the directory as spelled by the caller; that spelling is first normalized
+ * lexically ("." segments and repeated separators are dropped, and on Windows separators and case are unified).
+ * Aliases can only go stale if a directory is replaced, which pour never does itself; changing the current
+ * directory or running an external program drops them with everything else. If the directory can't be resolved
+ * (it does not exist), the key is the lexical path made absolute.
+ *
+ * A listing only becomes complete if nothing was invalidated while the directory was being read.
+ */
+
+#define ALIAS_PREFIX '\1'
+
+STRUCT(StatEntry) {
+    StatEntry* next;
+    uint64_t hash;
+    StatInfo info;
+    bool listed;                /* directory whose entries are all in the cache */
+    const char* canonical;      /* alias entries: canonical path of the directory, stored after the key */
+    char path[1];               /* should be the last field */
+};
+
+static Mutex* g_mutex;
+static StatEntry** g_buckets;
+static size_t g_bucketCount;
+static size_t g_entryCount;
+static uint64_t g_generation;
+
+/********************************************************************************************************************/
+
+static bool normalize(const char* path, char* buf, size_t* outLength)
+{
+    size_t len = 0;
+
+    for (const char* p = path; *p; ++p) {
+        char ch = *p;
+      #ifdef _WIN32
+        if (ch == '\\')
+            ch = '/';
+        else if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+      #endif
+
+        if (ch == '/') {
+            if (len > 1 && buf[len - 1] == '/')
+                continue;
+            if (len == 1 && buf[0] == '.') {
+                len = 0;
+                continue;
+            }
+            if (len >= 2 && buf[len - 1] == '.' && buf[len - 2] == '/') {
+                --len;
+                continue;
+            }
+        }
+
+        if (len + 1 >= DIR_MAX)
+            return false;
+        buf[len++] = ch;
+    }
+
+    if (len >= 2 && buf[len - 1] == '.' && buf[len - 2] == '/')
+        --len;
+    while (len > 1 && buf[len - 1] == '/')
+        --len;
+    if (len == 0)
+        buf[len++] = '.';
+
+    buf[len] = 0;
+    *outLength = len;
+    return true;
+}
+
+/* returns length of the parent key, or 0 if there is none */
+static size_t parentKey(const char* key, size_t len, char* buf)
+{
+    size_t dirLength = len;
+    while (dirLength > 0 && key[dirLength - 1] != '/')
+        --dirLength;
+
+    if (dirLength == 0) {
+        if (!strcmp(key, ".") || strchr(key, ':'))
+            return 0;
+        strcpy(buf, ".");
+        return 1;
+    }
+
+    if (dirLength > 1)
+        --dirLength;                    /* root directory keeps its separator */
+    if (dirLength == len)
+        return 0;
+
+    memcpy(buf, key, dirLength);
+    buf[dirLength] = 0;
+    return dirLength;
+}
+
+static uint64_t hashKey(const char* key, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static StatEntry** findSlot(const char* key, size_t len, uint64_t hash)
+{
+    if (!g_buckets)
+        return NULL;
+
+    StatEntry** slot = &g_buckets[hash & (g_bucketCount - 1)];
+    for (; *slot; slot = &(*slot)->next) {
+        if ((*slot)->hash == hash && !memcmp((*slot)->path, key, len + 1))
+            return slot;
+    }
+
+    return slot;
+}
+
+static StatEntry* find(const char* key, size_t len)
+{
+    StatEntry** slot = findSlot(key, len, hashKey(key, len));
+    return (slot ? *slot : NULL);
+}
+
+static void grow(void)
+{
+    size_t newCount = (g_bucketCount ? g_bucketCount * 2 : 1024);
+    StatEntry** newBuckets = (StatEntry**)calloc(newCount, sizeof(StatEntry*));
+    if (!newBuckets)
+        return;
+
+    for (size_t i = 0; i < g_bucketCount; i++) {
+        StatEntry* next;
+        for (StatEntry* e = g_buckets[i]; e; e = next) {
+            next = e->next;
+            StatEntry** slot = &newBuckets[e->hash & (newCount - 1)];
+            e->next = *slot;
+            *slot = e;
+        }
+    }
+
+    free(g_buckets);
+    g_buckets = newBuckets;
+    g_bucketCount = newCount;
+}
+
+/* returns NULL if out of memory, cache is then just less effective */
+static StatEntry* insert(const char* key, size_t len)
+{
+    if (g_entryCount >= g_bucketCount)
+        grow();
+
+    uint64_t hash = hashKey(key, len);
+    StatEntry** slot = findSlot(key, len, hash);
+    if (!slot)
+        return NULL;
+    if (*slot)
+        return *slot;
+
+    StatEntry* e = (StatEntry*)malloc(offsetof(StatEntry, path) + len + 1);
+    if (!e)
+        return NULL;
+
+    memset(e, 0, offsetof(StatEntry, path));
+    e->hash = hash;
+    memcpy(e->path, key, len + 1);
+
+    *slot = e;
+    ++g_entryCount;
+
+    return e;
+}
+
+static void removeEntry(const char* key, size_t len)
+{
+    StatEntry** slot = findSlot(key, len, hashKey(key, len));
+    if (slot && *slot) {
+        StatEntry* e = *slot;
+        *slot = e->next;
+        free(e);
+        --g_entryCount;
+    }
+}
+
+static bool isAbsolute(const char* key)
+{
+    return key[0] == '/' || (key[0] != 0 && key[1] == ':');
+}
+
+/* spelling of the directory keeps its trailing separator, so that "c:/" is not taken for "c:" */
+static bool resolveDirectory(const char* dir, char* buf, size_t* outLength)
+{
+  #ifdef _WIN32
+
+    WCHAR wdir[DIR_MAX], wfull[DIR_MAX];
+    char full[DIR_MAX];
+    if (!MultiByteToWideChar(CP_UTF8, 0, dir, -1, wdir, DIR_MAX))
+        return false;
+
+    DWORD dwAttributes = GetFileAttributesW(wdir);
+    if (dwAttributes == INVALID_FILE_ATTRIBUTES || !(dwAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        return false;
+
+    DWORD dwLength = GetFullPathNameW(wdir, DIR_MAX, wfull, NULL);
+    if (dwLength == 0 || dwLength >= DIR_MAX)
+        return false;
+    if (!WideCharToMultiByte(CP_UTF8, 0, wfull, -1, full, DIR_MAX, NULL, NULL))
+        return false;
+
+    return normalize(full, buf, outLength);
+
+  #else
+
+    char* full = realpath(dir, NULL);
+    if (!full)
+        return false;
+
+    size_t len = strlen(full);
+    bool fits = (len < DIR_MAX);
+    if (fits) {
+        memcpy(buf, full, len + 1);
+        *outLength = len;
+    }
+
+    free(full);
+    return fits;
+
+  #endif
+}
+
+static bool canonicalDirectory(const char* dir, size_t dirLength, char* buf, size_t* outLength)
+{
+    char aliasKey[DIR_MAX + 1];
+    aliasKey[0] = ALIAS_PREFIX;
+    memcpy(aliasKey + 1, dir, dirLength + 1);
+
+    Mutex_Lock(g_mutex);
+    StatEntry* e = find(aliasKey, dirLength + 1);
+    if (e) {
+        *outLength = strlen(e->canonical);
+        memcpy(buf, e->canonical, *outLength + 1);
+    }
+    Mutex_Unlock(g_mutex);
+
+    if (e)
+        return true;
+
+    if (!resolveDirectory(dir, buf, outLength))
+        return false;
+
+    Mutex_Lock(g_mutex);
+    if (g_entryCount >= g_bucketCount)
+        grow();
+    uint64_t hash = hashKey(aliasKey, dirLength + 1);
+    StatEntry** slot = findSlot(aliasKey, dirLength + 1, hash);
+    if (slot && !*slot) {
+        e = (StatEntry*)malloc(offsetof(StatEntry, path) + dirLength + 2 + *outLength + 1);
+        if (e) {
+            memset(e, 0, offsetof(StatEntry, path));
+            e->hash = hash;
+            memcpy(e->path, aliasKey, dirLength + 2);
+            e->canonical = e->path + dirLength + 2;
+            memcpy(e->path + dirLength + 2, buf, *outLength + 1);
+            *slot = e;
+            ++g_entryCount;
+        }
+    }
+    Mutex_Unlock(g_mutex);
+
+    return true;
+}
+
+static bool appendName(char* key, size_t* len, const char* name, size_t nameLength)
+{
+    bool needSeparator = (*len > 0 && key[*len - 1] != '/');
+    if (*len + needSeparator + nameLength + 1 > DIR_MAX)
+        return false;
+    if (needSeparator)
+        key[(*len)++] = '/';
+    memcpy(key + *len, name, nameLength + 1);
+    *len += nameLength;
+    return true;
+}
+
+static bool makeKey(const char* path, char* key, size_t* outLength)
+{
+    char raw[DIR_MAX];
+    size_t len;
+    if (!normalize(path, raw, &len))
+        return false;
+
+    size_t dirLength = len;
+    while (dirLength > 0 && raw[dirLength - 1] != '/')
+        --dirLength;
+
+    const char* name = raw + dirLength;
+    if (dirLength == 0 && strchr(name, ':')) {
+        /* drive root, its separator was dropped by normalize() */
+        char dir[DIR_MAX];
+        if (len + 2 > DIR_MAX)
+            return false;
+        memcpy(dir, raw, len);
+        dir[len] = '/';
+        dir[len + 1] = 0;
+        if (canonicalDirectory(dir, len + 1, key, outLength))
+            return true;
+    } else if (dirLength == len || !strcmp(name, ".") || !strcmp(name, "..")) {
+        /* path is a directory spelled as such, it is resolved as a whole */
+        if (canonicalDirectory(raw, len, key, outLength))
+            return true;
+    } else {
+        char dir[DIR_MAX];
+        if (dirLength == 0) {
+            dir[0] = '.';
+            dir[1] = '/';
+            dir[2] = 0;
+            dirLength = 2;
+        } else {
+            memcpy(dir, raw, dirLength);
+            dir[dirLength] = 0;
+        }
+
+        if (canonicalDirectory(dir, dirLength, key, outLength))
+            return appendName(key, outLength, name, strlen(name));
+    }
+
+    if (isAbsolute(raw) || !canonicalDirectory("./", 2, key, outLength)) {
+        memcpy(key, raw, len + 1);
+        *outLength = len;
+        return true;
+    }
+
+    return appendName(key, outLength, raw, len);
+}
+
+/********************************************************************************************************************/
+
+void StatCache_Init(void)
+{
+    /* without a mutex the cache stays disabled */
+    if (!g_mutex)
+        g_mutex = Mutex_Create();
+}
+
+uint64_t StatCache_GetGeneration(void)
+{
+    if (!g_mutex)
+        return 0;
+
+    Mutex_Lock(g_mutex);
+    uint64_t generation = g_generation;
+    Mutex_Unlock(g_mutex);
+
+    return generation;
+}
+
+bool StatCache_TryGet(const char* path, StatInfo* outInfo)
+{
+    char key[DIR_MAX];
+    size_t len;
+    if (!g_mutex || !makeKey(path, key, &len))
+        return false;
+
+    Mutex_Lock(g_mutex);
+
+    bool found = false;
+    StatEntry* e = find(key, len);
+    if (e) {
+        *outInfo = e->info;
+        found = true;
+    } else {
+        char dirKey[DIR_MAX];
+        size_t dirLength = parentKey(key, len, dirKey);
+        if (dirLength > 0) {
+            StatEntry* dir = find(dirKey, dirLength);
+            if (dir && dir->listed) {
+                memset(outInfo, 0, sizeof(StatInfo));
+                found = true;
+            }
+        }
+    }
+
+    Mutex_Unlock(g_mutex);
+
+    return found;
+}
+
+void StatCache_Put(const char* path, const StatInfo* info, uint64_t generation)
+{
+    char key[DIR_MAX];
+    size_t len;
+    if (!g_mutex || !makeKey(path, key, &len))
+        return;
+
+    Mutex_Lock(g_mutex);
+
+    /* the file may have changed after it was queried */
+    if (generation == g_generation) {
+        StatEntry* e = insert(key, len);
+        if (e) {
+            e->info = *info;
+            if (!info->exists || !info->isDir)
+                e->listed = false;
+        }
+    }
+
+    Mutex_Unlock(g_mutex);
+}
+
+void StatCache_AddListed(const char* dir, const char* name, uint64_t generation)
+{
+    char path[DIR_MAX];
+    size_t dirLength = strlen(dir);
+    size_t nameLength = strlen(name);
+    if (!g_mutex || dirLength + nameLength + 2 > sizeof(path))
+        return;
+
+    memcpy(path, dir, dirLength);
+    path[dirLength] = '/';
+    memcpy(path + dirLength + 1, name, nameLength + 1);
+
+    char key[DIR_MAX];
+    size_t len;
+    if (!makeKey(path, key, &len))
+        return;
+
+    Mutex_Lock(g_mutex);
+
+    if (generation == g_generation) {
+        StatEntry* e = insert(key, len);
+        if (e && !e->info.exists) {
+            e->info.exists = true;
+            e->info.hasDetails = false;
+        }
+    }
+
+    Mutex_Unlock(g_mutex);
+}
+
+void StatCache_EndListing(const char* dir, uint64_t generation)
+{
+    char key[DIR_MAX];
+    size_t len;
+    if (!g_mutex || !makeKey(dir, key, &len))
+        return;
+
+    Mutex_Lock(g_mutex);
+
+    if (generation == g_generation) {
+        StatEntry* e = insert(key, len);
+        if (e) {
+            if (!e->info.exists || !e->info.isDir) {
+                e->info.exists = true;
+                e->info.hasDetails = false;
+                e->info.isDir = true;
+            }
+            e->listed = true;
+        }
+    }
+
+    Mutex_Unlock(g_mutex);
+}
+
+void StatCache_Invalidate(const char* path)
+{
+    char key[DIR_MAX];
+    size_t len;
+    if (!g_mutex)
+        return;
+
+    if (!makeKey(path, key, &len)) {
+        StatCache_Flush();
+        return;
+    }
+
+    Mutex_Lock(g_mutex);
+
+    ++g_generation;
+    removeEntry(key, len);
+
+    char dirKey[DIR_MAX];
+    size_t dirLength = parentKey(key, len, dirKey);
+    if (dirLength > 0) {
+        StatEntry* dir = find(dirKey, dirLength);
+        if (dir)
+            dir->listed = false;
+    }
+
+    Mutex_Unlock(g_mutex);
+}
+
+void StatCache_Flush(void)
+{
+    if (!g_mutex)
+        return;
+
+    Mutex_Lock(g_mutex);
+
+    ++g_generation;
+    for (size_t i = 0; i < g_bucketCount; i++) {
+        StatEntry* next;
+        for (StatEntry* e = g_buckets[i]; e; e = next) {
+            next = e->next;
+            free(e);
+        }
+        g_buckets[i] = NULL;
+    }
+    g_entryCount = 0;
+
+    Mutex_Unlock(g_mutex);
+}
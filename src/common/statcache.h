@@ -0,0 +1,34 @@
+#ifndef COMMON_STATCACHE_H
+#define COMMON_STATCACHE_H
+
+#include <common/common.h>
+
+/*
+ * Process-wide cache of file existence, type and size, shared by all threads. Missing files are cached too.
+ * Complete directory listings are recorded, so a name that is not in a listed directory is known to be missing
+ * without asking the file system. Pour's own writes and deletes invalidate the affected entries; running an
+ * external program or changing the current directory drops everything.
+ */
+
+STRUCT(StatInfo) {
+    bool exists;
+    bool hasDetails;            /* isDir and size are valid */
+    bool isDir;
+    uint64_t size;
+};
+
+void StatCache_Init(void);
+
+/* results of a stat() or a listing are stored only if nothing was invalidated since GetGeneration was called */
+uint64_t StatCache_GetGeneration(void);
+
+bool StatCache_TryGet(const char* path, StatInfo* outInfo);
+void StatCache_Put(const char* path, const StatInfo* info, uint64_t generation);
+
+void StatCache_AddListed(const char* dir, const char* name, uint64_t generation);
+void StatCache_EndListing(const char* dir, uint64_t generation);
+
+void StatCache_Invalidate(const char* path);
+void StatCache_Flush(void);
+
+#endif
@@ -0,0 +1,217 @@
+#include <common/thread.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+#else
+ #include <pthread.h>
+ #include <unistd.h>
+#endif
+
+struct Thread
+{
+  #ifdef _WIN32
+    HANDLE handle;
+  #else
+    pthread_t handle;
+  #endif
+    PFNThreadProc proc;
+    void* arg;
+};
+
+struct Mutex
+{
+  #ifdef _WIN32
+    CRITICAL_SECTION cs;
+  #else
+    pthread_mutex_t mutex;
+  #endif
+};
+
+struct CondVar
+{
+  #ifdef _WIN32
+    CONDITION_VARIABLE cv;
+  #else
+    pthread_cond_t cond;
+  #endif
+};
+
+/********************************************************************************************************************/
+
+#ifdef _WIN32
+static DWORD WINAPI threadProc(LPVOID param)
+{
+    Thread* thread = (Thread*)param;
+    thread->proc(thread->arg);
+    return 0;
+}
+#else
+static void* threadProc(void* param)
+{
+    Thread* thread = (Thread*)param;
+    thread->proc(thread->arg);
+    return NULL;
+}
+#endif
+
+Thread* Thread_Start(PFNThreadProc proc, void* arg)
+{
+    Thread* thread = (Thread*)malloc(sizeof(Thread));
+    if (!thread)
+        return NULL;
+
+    thread->proc = proc;
+    thread->arg = arg;
+
+  #ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, threadProc, thread, 0, NULL);
+    if (!thread->handle) {
+        free(thread);
+        return NULL;
+    }
+  #else
+    if (pthread_create(&thread->handle, NULL, threadProc, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+  #endif
+
+    return thread;
+}
+
+void Thread_Join(Thread* thread)
+{
+  #ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+  #else
+    pthread_join(thread->handle, NULL);
+  #endif
+
+    free(thread);
+}
+
+int Thread_GetCPUCount(void)
+{
+  #ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int count = (int)si.dwNumberOfProcessors;
+  #else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  #endif
+
+    return (count > 0 ? count : 1);
+}
+
+/********************************************************************************************************************/
+
+Mutex* Mutex_Create(void)
+{
+    Mutex* mutex = (Mutex*)malloc(sizeof(Mutex));
+    if (!mutex)
+        return NULL;
+
+  #ifdef _WIN32
+    InitializeCriticalSection(&mutex->cs);
+  #else
+    pthread_mutex_init(&mutex->mutex, NULL);
+  #endif
+
+    return mutex;
+}
+
+void Mutex_Destroy(Mutex* mutex)
+{
+  #ifdef _WIN32
+    DeleteCriticalSection(&mutex->cs);
+  #else
+    pthread_mutex_destroy(&mutex->mutex);
+  #endif
+
+    free(mutex);
+}
+
+void Mutex_Lock(Mutex* mutex)
+{
+  #ifdef _WIN32
+    EnterCriticalSection(&mutex->cs);
+  #else
+    pthread_mutex_lock(&mutex->mutex);
+  #endif
+}
+
+void Mutex_Unlock(Mutex* mutex)
+{
+  #ifdef _WIN32
+    LeaveCriticalSection(&mutex->cs);
+  #else
+    pthread_mutex_unlock(&mutex->mutex);
+  #endif
+}
+
+/********************************************************************************************************************/
+
+CondVar* CondVar_Create(void)
+{
+    CondVar* cond = (CondVar*)malloc(sizeof(CondVar));
+    if (!cond)
+        return NULL;
+
+  #ifdef _WIN32
+    InitializeConditionVariable(&cond->cv);
+  #else
+    pthread_cond_init(&cond->cond, NULL);
+  #endif
+
+    return cond;
+}
+
+void CondVar_Destroy(CondVar* cond)
+{
+  #ifndef _WIN32
+    pthread_cond_destroy(&cond->cond);
+  #endif
+
+    free(cond);
+}
+
+void CondVar_Wait(CondVar* cond, Mutex* mutex)
+{
+  #ifdef _WIN32
+    SleepConditionVariableCS(&cond->cv, &mutex->cs, INFINITE);
+  #else
+    pthread_cond_wait(&cond->cond, &mutex->mutex);
+  #endif
+}
+
+void CondVar_Broadcast(CondVar* cond)
+{
+  #ifdef _WIN32
+    WakeAllConditionVariable(&cond->cv);
+  #else
+    pthread_cond_broadcast(&cond->cond);
+  #endif
+}
+
+/********************************************************************************************************************/
+
+long Atomic_Increment(volatile long* value)
+{
+  #ifdef _WIN32
+    return InterlockedIncrement(value);
+  #else
+    return __sync_add_and_fetch(value, 1);
+  #endif
+}
+
+long Atomic_Decrement(volatile long* value)
+{
+  #ifdef _WIN32
+    return InterlockedDecrement(value);
+  #else
+    return __sync_sub_and_fetch(value, 1);
+  #endif
+}
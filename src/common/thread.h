@@ -0,0 +1,30 @@
+#ifndef COMMON_THREAD_H
+#define COMMON_THREAD_H
+
+#include <common/common.h>
+
+STRUCT(Thread);
+STRUCT(Mutex);
+STRUCT(CondVar);
+
+typedef void (*PFNThreadProc)(void* arg);
+
+Thread* Thread_Start(PFNThreadProc proc, void* arg);
+void Thread_Join(Thread* thread);
+
+int Thread_GetCPUCount(void);
+
+Mutex* Mutex_Create(void);
+void Mutex_Destroy(Mutex* mutex);
+void Mutex_Lock(Mutex* mutex);
+void Mutex_Unlock(Mutex* mutex);
+
+CondVar* CondVar_Create(void);
+void CondVar_Destroy(CondVar* cond);
+void CondVar_Wait(CondVar* cond, Mutex* mutex);
+void CondVar_Broadcast(CondVar* cond);
+
+long Atomic_Increment(volatile long* value);
+long Atomic_Decrement(volatile long* value);
+
+#endif
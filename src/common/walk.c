@@ -0,0 +1,525 @@
+#include <common/walk.h>
+#include <common/utf8.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+ #ifndef _WIN32_WINNT
+  #define _WIN32_WINNT 0x601    /* FindExInfoBasic, FIND_FIRST_EX_LARGE_FETCH */
+ #endif
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+#else
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <dirent.h>
+ #include <unistd.h>
+ #include <sys/stat.h>
+#endif
+
+STRUCT(WalkLevel) {
+  #ifdef _WIN32
+    HANDLE hFind;
+    WIN32_FIND_DATAW data;
+    bool hasData;
+  #else
+    DIR* dir;
+  #endif
+    size_t prefixLength;        /* length of the relative path of this directory, including trailing '/' */
+};
+
+struct Walker
+{
+    WalkLevel* levels;
+    size_t depth;
+    size_t capacity;
+    char* path;
+    size_t pathCapacity;
+    char** patterns;
+    int includeCount;
+    int excludeCount;
+    bool withStat;
+    size_t pendingDir;          /* prefix length of the directory to enter on the next call, 0 if none */
+    char root[1]; /* should be the last field */
+};
+
+/********************************************************************************************************************/
+
+static bool matchClass(const char** pattern, char ch)
+{
+    const char* p = *pattern + 1;
+    bool negate = (*p == '!' || *p == '^');
+    if (negate)
+        ++p;
+
+    bool matched = false;
+    const char* start = p;
+    while (*p && (*p != ']' || p == start)) {
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            if (ch >= p[0] && ch <= p[2])
+                matched = true;
+            p += 3;
+        } else {
+            if (ch == *p)
+                matched = true;
+            ++p;
+        }
+    }
+
+    if (*p != ']')
+        return ch == '[';       /* unterminated class matches literally */
+
+    *pattern = p + 1;
+    return matched != negate;
+}
+
+static bool sameChar(char a, char b)
+{
+  #ifdef _WIN32
+    if (a >= 'A' && a <= 'Z')
+        a += 'a' - 'A';
+    if (b >= 'A' && b <= 'Z')
+        b += 'a' - 'A';
+  #endif
+    return a == b;
+}
+
+static bool match(const char* p, const char* s)
+{
+    for (;;) {
+        switch (*p) {
+            case 0:
+                return *s == 0;
+
+            case '*':
+                if (p[1] == '*') {
+                    p += 2;
+                    if (*p == '/') {
+                        /* "**" followed by '/' matches zero or more whole directories */
+                        ++p;
+                        if (match(p, s))
+                            return true;
+                        for (; *s; ++s) {
+                            if (*s == '/' && match(p, s + 1))
+                                return true;
+                        }
+                        return false;
+                    }
+                    for (;; ++s) {
+                        if (match(p, s))
+                            return true;
+                        if (!*s)
+                            return false;
+                    }
+                }
+                ++p;
+                for (;; ++s) {
+                    if (match(p, s))
+                        return true;
+                    if (!*s || *s == '/')
+                        return false;
+                }
+
+            case '?':
+                if (!*s || *s == '/')
+                    return false;
+                ++p;
+                ++s;
+                break;
+
+            case '[': {
+                if (!*s || *s == '/')
+                    return false;
+                const char* q = p;
+                if (!matchClass(&q, *s))
+                    return false;
+                p = (q != p ? q : p + 1);
+                ++s;
+                break;
+            }
+
+            default:
+                if (!sameChar(*p, *s))
+                    return false;
+                ++p;
+                ++s;
+                break;
+        }
+    }
+}
+
+bool Walk_Match(const char* pattern, const char* path)
+{
+    if (!strchr(pattern, '/')) {
+        const char* name = strrchr(path, '/');
+        if (name)
+            path = name + 1;
+    }
+
+    return match(pattern, path);
+}
+
+static bool matchAny(char** patterns, int count, const char* path)
+{
+    for (int i = 0; i < count; i++) {
+        if (Walk_Match(patterns[i], path))
+            return true;
+    }
+    return false;
+}
+
+/********************************************************************************************************************/
+
+static void closeLevel(WalkLevel* level)
+{
+  #ifdef _WIN32
+    if (level->hFind != INVALID_HANDLE_VALUE)
+        FindClose(level->hFind);
+    level->hFind = INVALID_HANDLE_VALUE;
+  #else
+    if (level->dir)
+        closedir(level->dir);
+    level->dir = NULL;
+  #endif
+}
+
+void Walk_Close(Walker* walker)
+{
+    while (walker->depth > 0)
+        closeLevel(&walker->levels[--walker->depth]);
+
+    free(walker->levels);
+    walker->levels = NULL;
+    walker->capacity = 0;
+
+    free(walker->path);
+    walker->path = NULL;
+    walker->pathCapacity = 0;
+
+    free(walker->patterns);
+    walker->patterns = NULL;
+}
+
+static int walker_close(lua_State* L)
+{
+    Walk_Close((Walker*)luaL_checkudata(L, 1, WALKER_MT));
+    return 0;
+}
+
+static void reservePath(lua_State* L, Walker* walker, size_t length)
+{
+    if (length < walker->pathCapacity)
+        return;
+
+    size_t newCapacity = (walker->pathCapacity ? walker->pathCapacity : 256);
+    while (newCapacity <= length)
+        newCapacity *= 2;
+
+    char* newPath = (char*)realloc(walker->path, newCapacity);
+    if (!newPath)
+        luaL_error(L, "out of memory.");
+
+    walker->path = newPath;
+    walker->pathCapacity = newCapacity;
+}
+
+static WalkLevel* pushLevel(lua_State* L, Walker* walker, size_t prefixLength)
+{
+    if (walker->depth == walker->capacity) {
+        size_t newCapacity = (walker->capacity ? walker->capacity * 2 : 16);
+        WalkLevel* newLevels = (WalkLevel*)realloc(walker->levels, newCapacity * sizeof(WalkLevel));
+        if (!newLevels)
+            luaL_error(L, "out of memory.");
+        walker->levels = newLevels;
+        walker->capacity = newCapacity;
+    }
+
+    WalkLevel* level = &walker->levels[walker->depth];
+  #ifdef _WIN32
+    level->hFind = INVALID_HANDLE_VALUE;
+    level->hasData = false;
+  #else
+    level->dir = NULL;
+  #endif
+    level->prefixLength = prefixLength;
+
+    return level;
+}
+
+/*
+ * Enters directory whose relative path is walker->path[0 .. prefixLength - 1), terminated with zero which is
+ * replaced with '/' here. Zero prefix length opens the root.
+ */
+static void openLevel(lua_State* L, Walker* walker, size_t prefixLength)
+{
+    size_t parentPrefixLength = (walker->depth > 0 ? walker->levels[walker->depth - 1].prefixLength : 0);
+    WalkLevel* level = pushLevel(L, walker, prefixLength);
+
+  #ifdef _WIN32
+
+    DONT_WARN_UNUSED(parentPrefixLength);
+
+    if (prefixLength > 0)
+        walker->path[prefixLength - 1] = '/';
+
+    const char* pattern = lua_pushfstring(L, "%s/%s*", walker->root, lua_pushlstring(L, walker->path, prefixLength));
+    const WCHAR* wpattern = (const WCHAR*)Utf8_PushConvertToUtf16(L, pattern, NULL);
+
+    level->hFind = FindFirstFileExW(wpattern, FindExInfoBasic, &level->data,
+        FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (level->hFind == INVALID_HANDLE_VALUE) {
+        DWORD dwError = GetLastError();
+        if (dwError != ERROR_FILE_NOT_FOUND)
+            luaL_error(L, "can't open dir \"%s\" (code %p)", pattern, (void*)(size_t)dwError);
+    }
+    level->hasData = (level->hFind != INVALID_HANDLE_VALUE);
+
+    lua_pop(L, 3);
+
+  #else
+
+    if (prefixLength == 0)
+        level->dir = opendir(walker->root); /* FIXME: utf-8 */
+    else {
+        /* open relative to the parent, so that the kernel does not have to resolve the whole path again */
+        const char* name = walker->path + parentPrefixLength;
+        int fd = openat(dirfd(walker->levels[walker->depth - 1].dir), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            level->dir = fdopendir(fd);
+            if (!level->dir)
+                close(fd);
+        }
+        walker->path[prefixLength - 1] = '/';
+    }
+
+    if (!level->dir) {
+        int error = errno;
+        if (prefixLength == 0)
+            luaL_error(L, "can't open dir \"%s\": %s", walker->root, strerror(error));
+        luaL_error(L, "can't open dir \"%s/%s\": %s",
+            walker->root, lua_pushlstring(L, walker->path, prefixLength - 1), strerror(error));
+    }
+
+  #endif
+
+    ++walker->depth;
+}
+
+Walker* Walk_PushOpen(lua_State* L, const char* root, int includeIdx, int excludeIdx, bool withStat)
+{
+    includeIdx = (includeIdx ? lua_absindex(L, includeIdx) : 0);
+    excludeIdx = (excludeIdx ? lua_absindex(L, excludeIdx) : 0);
+
+    size_t rootLen = strlen(root);
+    while (rootLen > 1 && (root[rootLen - 1] == '/' || root[rootLen - 1] == '\\'))
+        --rootLen;
+
+    Walker* walker = (Walker*)lua_newuserdatauv(L, offsetof(Walker, root) + rootLen + 1, 0);
+    memset(walker, 0, sizeof(Walker));
+    memcpy(walker->root, root, rootLen);
+    walker->root[rootLen] = 0;
+    walker->withStat = withStat;
+
+    if (luaL_newmetatable(L, WALKER_MT)) {
+        lua_pushcfunction(L, walker_close);
+        lua_setfield(L, -2, "__gc");
+        lua_pushcfunction(L, walker_close);
+        lua_setfield(L, -2, "__close");
+    }
+    lua_setmetatable(L, -2);
+
+    /* patterns are copied, so that walking does not need to access Lua values */
+    size_t bytes = 0;
+    int counts[2] = { 0, 0 };
+    int indices[2] = { includeIdx, excludeIdx };
+    for (int k = 0; k < 2; k++) {
+        int idx = indices[k];
+        if (!idx || lua_isnil(L, idx))
+            continue;
+        if (lua_type(L, idx) == LUA_TSTRING) {
+            bytes += lua_rawlen(L, idx) + 1;
+            counts[k] = 1;
+            continue;
+        }
+        luaL_checktype(L, idx, LUA_TTABLE);
+        counts[k] = (int)lua_rawlen(L, idx);
+        for (int i = 1; i <= counts[k]; i++) {
+            lua_rawgeti(L, idx, i);
+            if (lua_type(L, -1) != LUA_TSTRING)
+                luaL_error(L, "pattern expected, got %s.", luaL_typename(L, -1));
+            bytes += lua_rawlen(L, -1) + 1;
+            lua_pop(L, 1);
+        }
+    }
+
+    int total = counts[0] + counts[1];
+    walker->patterns = (char**)malloc(sizeof(char*) * (size_t)total + bytes + 1);
+    if (!walker->patterns)
+        luaL_error(L, "out of memory.");
+    walker->includeCount = counts[0];
+    walker->excludeCount = counts[1];
+
+    char* dst = (char*)(walker->patterns + total);
+    int n = 0;
+    for (int k = 0; k < 2; k++) {
+        for (int i = 1; i <= counts[k]; i++) {
+            if (lua_type(L, indices[k]) == LUA_TSTRING)
+                lua_pushvalue(L, indices[k]);
+            else
+                lua_rawgeti(L, indices[k], i);
+            size_t len;
+            const char* str = lua_tolstring(L, -1, &len);
+            memcpy(dst, str, len + 1);
+            walker->patterns[n++] = dst;
+            dst += len + 1;
+            lua_pop(L, 1);
+        }
+    }
+
+    reservePath(L, walker, 0);
+    walker->path[0] = 0;
+    openLevel(L, walker, 0);
+
+    return walker;
+}
+
+/********************************************************************************************************************/
+
+bool Walk_Next(lua_State* L, Walker* walker, WalkEntry* outEntry)
+{
+    if (walker->pendingDir) {
+        size_t prefixLength = walker->pendingDir;
+        walker->pendingDir = 0;
+        openLevel(L, walker, prefixLength);
+    }
+
+    while (walker->depth > 0) {
+        WalkLevel* level = &walker->levels[walker->depth - 1];
+        size_t prefixLength = level->prefixLength;
+
+      #ifdef _WIN32
+
+        if (!level->hasData) {
+            closeLevel(level);
+            --walker->depth;
+            continue;
+        }
+
+        WIN32_FIND_DATAW data = level->data;
+        level->hasData = FindNextFileW(level->hFind, &level->data);
+
+        const WCHAR* wname = data.cFileName;
+        if (wname[0] == '.' && (wname[1] == 0 || (wname[1] == '.' && wname[2] == 0)))
+            continue;
+
+        const char* name = Utf8_PushConvertFromUtf16(L, wname);
+        size_t nameLength = strlen(name);
+        reservePath(L, walker, prefixLength + nameLength + 1);
+        memcpy(walker->path + prefixLength, name, nameLength + 1);
+        lua_pop(L, 1);
+
+        walktype_t type;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+            type = WALK_LINK;
+        else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            type = WALK_DIR;
+        else
+            type = WALK_FILE;
+
+      #else
+
+        errno = 0;
+        struct dirent* e = readdir(level->dir);
+        if (!e) {
+            if (errno) {
+                luaL_error(L, "can't read dir \"%s/%s\": %s",
+                    walker->root, lua_pushlstring(L, walker->path, prefixLength), strerror(errno));
+            }
+            closeLevel(level);
+            --walker->depth;
+            continue;
+        }
+
+        const char* name = e->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+
+        size_t nameLength = strlen(name);
+        reservePath(L, walker, prefixLength + nameLength + 1);
+        memcpy(walker->path + prefixLength, name, nameLength + 1);
+
+        walktype_t type = WALK_OTHER;
+        bool haveStat = false;
+        struct stat st;
+
+       #ifdef DT_UNKNOWN
+        switch (e->d_type) {
+            case DT_REG: type = WALK_FILE; break;
+            case DT_DIR: type = WALK_DIR; break;
+            case DT_LNK: type = WALK_LINK; break;
+            case DT_UNKNOWN: haveStat = true; break;
+            default: break;
+        }
+       #else
+        haveStat = true;
+       #endif
+
+        if (haveStat) {
+            if (fstatat(dirfd(level->dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;               /* removed while walking */
+            if (S_ISREG(st.st_mode))
+                type = WALK_FILE;
+            else if (S_ISDIR(st.st_mode))
+                type = WALK_DIR;
+            else if (S_ISLNK(st.st_mode))
+                type = WALK_LINK;
+        }
+
+      #endif
+
+        const char* path = walker->path;
+        if (matchAny(walker->patterns + walker->includeCount, walker->excludeCount, path))
+            continue;
+
+        bool included = (walker->includeCount == 0
+            || matchAny(walker->patterns, walker->includeCount, path));
+
+        outEntry->size = 0;
+        outEntry->mtime = 0;
+
+        if (included && walker->withStat) {
+          #ifdef _WIN32
+            uint64_t ft = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+            outEntry->size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+            outEntry->mtime = (lua_Number)((int64_t)ft - 116444736000000000LL) / 10000000.0;
+          #else
+            if (!haveStat) {
+                if (fstatat(dirfd(level->dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+            }
+            outEntry->size = (uint64_t)st.st_size;
+           #ifdef __linux__
+            outEntry->mtime = (lua_Number)st.st_mtim.tv_sec + (lua_Number)st.st_mtim.tv_nsec / 1000000000.0;
+           #else
+            outEntry->mtime = (lua_Number)st.st_mtime;
+           #endif
+          #endif
+        }
+
+        if (type == WALK_DIR) {
+            if (!included) {
+                openLevel(L, walker, prefixLength + nameLength + 1);
+                continue;
+            }
+            walker->pendingDir = prefixLength + nameLength + 1;     /* entered after returning this entry */
+        } else if (!included)
+            continue;
+
+        outEntry->path = walker->path;
+        outEntry->name = walker->path + prefixLength;
+        outEntry->type = type;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,40 @@
+#ifndef COMMON_WALK_H
+#define COMMON_WALK_H
+
+#include <common/common.h>
+
+/*
+ * Recursive directory walker. Entry type comes from the directory listing itself, sizes and times are
+ * only queried for entries which are actually returned, relative to the already open directory.
+ *
+ * Patterns use '/' as separator and support '*', '?', '[...]' and '**' (any number of directories).
+ * Patterns without '/' are matched against the entry name only, other patterns against the path relative
+ * to the root. Excluded directories are not entered.
+ */
+
+typedef enum walktype_t {
+    WALK_FILE = 0,
+    WALK_DIR,
+    WALK_LINK,
+    WALK_OTHER,
+} walktype_t;
+
+STRUCT(Walker);
+
+#define WALKER_MT "Walker*"
+
+STRUCT(WalkEntry) {
+    const char* path;           /* relative to the root, '/' separated */
+    const char* name;
+    walktype_t type;
+    uint64_t size;
+    lua_Number mtime;           /* seconds since the Unix epoch */
+};
+
+Walker* Walk_PushOpen(lua_State* L, const char* root, int includeIdx, int excludeIdx, bool withStat);
+bool Walk_Next(lua_State* L, Walker* walker, WalkEntry* outEntry);
+void Walk_Close(Walker* walker);
+
+bool Walk_Match(const char* pattern, const char* path);
+
+#endif
@@ -4,6 +4,7 @@
 #include <common/common.h>
 
 extern const uint8_t bootCodeNone[];
+extern const uint8_t bootCodeNone32[];
 extern const uint8_t bootCode95[];
 extern const uint8_t bootCodeNT[];
 
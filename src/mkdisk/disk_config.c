@@ -1,5 +1,7 @@
 #include <common/common.h>
 #include <mkdisk/disk_config.h>
+#include <mkdisk/vhd_defs.h>
+#include <string.h>
 
 const disk_config_t disk_3M = {
     0x00300000, /* vhd_size */
@@ -130,3 +132,120 @@ const disk_config_t disk_1G = {
 };
 
 const disk_config_t* disk_config = &disk_500M;
+
+/********************************************************************************************************************/
+
+STRUCT(disk_preset_t) {
+    const char* name;
+    const disk_config_t* config;
+};
+
+static const disk_preset_t presets[] = {
+    { "3m", &disk_3M },
+    { "20m", &disk_20M },
+    { "100m", &disk_100M },
+    { "400m", &disk_400M },
+    { "500m", &disk_500M },
+    { "510m", &disk_510M },
+    { "520m", &disk_520M },
+    { "1g", &disk_1G },
+    { NULL, NULL }
+};
+
+const disk_config_t* DiskConfig_FindPreset(const char* name)
+{
+    for (const disk_preset_t* p = presets; p->name; p++) {
+        if (!strcmp(p->name, name))
+            return p->config;
+    }
+    return NULL;
+}
+
+/* CHS geometry reported in the VHD footer, as specified in the VHD format specification */
+static void vhd_geometry(disk_config_t* config, long long totalSectors)
+{
+    long long sectorsPerTrack, heads, cylinderTimesHeads;
+
+    if (totalSectors > 65535 * 16 * 255)
+        totalSectors = 65535 * 16 * 255;
+
+    if (totalSectors >= 65535 * 16 * 63) {
+        sectorsPerTrack = 255;
+        heads = 16;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+    } else {
+        sectorsPerTrack = 17;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        heads = (cylinderTimesHeads + 1023) / 1024;
+        if (heads < 4)
+            heads = 4;
+        if (cylinderTimesHeads >= heads * 1024 || heads > 16) {
+            sectorsPerTrack = 31;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+        if (cylinderTimesHeads >= heads * 1024) {
+            sectorsPerTrack = 63;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+    }
+
+    config->vhd_cylinders = (int)(cylinderTimesHeads / heads);
+    config->vhd_heads = (int)heads;
+    config->vhd_sectors_per_track = (int)sectorsPerTrack;
+}
+
+/*
+ * Computes the configuration of a disk of the given size, rounded down to a whole number of sectors. The partition
+ * starts at the second track and extends to the end of the disk. The BIOS geometry used for the partition table and
+ * the FAT boot sector has 63 sectors per track and as few heads as keep the disk within 1024 cylinders (up to 255);
+ * the cluster size is the smallest one that keeps FAT16 within 65524 clusters. For the sizes of the 100m, 400m, 500m,
+ * 520m and 1g presets this gives exactly the presets.
+ */
+bool DiskConfig_Compute(disk_config_t* config, long long size)
+{
+    const long long sectorsPerTrack = 63;
+
+    if (size < DISK_CONFIG_MIN_SIZE || size > DISK_CONFIG_MAX_SIZE)
+        return false;
+
+    long long totalSectors = size / VHD_SECTOR_SIZE;
+    memset(config, 0, sizeof(*config));
+
+    config->vhd_size = totalSectors * VHD_SECTOR_SIZE;
+    config->vhd_bat_size = (int)((config->vhd_size + VHD_BLOCK_SIZE - 1) / VHD_BLOCK_SIZE);
+    config->vhd_next_offset = 1 /* footer copy */ + 2 /* dynamic disk header */
+        + (int)((config->vhd_bat_size + BAT_ENTRIES_PER_SECTOR - 1) / BAT_ENTRIES_PER_SECTOR);
+    vhd_geometry(config, totalSectors);
+
+    long long heads = 1;
+    while (heads < 128 && totalSectors / (heads * sectorsPerTrack) > 1024)
+        heads *= 2;
+    if (totalSectors / (heads * sectorsPerTrack) > 1024)
+        heads = 255;
+
+    config->mbr_disk_start = sectorsPerTrack;
+    config->mbr_disk_size = totalSectors - sectorsPerTrack;
+
+    long long lastSector = totalSectors - 1;
+    long long cylinder = lastSector / (heads * sectorsPerTrack);
+    long long head = (lastSector / sectorsPerTrack) % heads;
+    long long sector = lastSector % sectorsPerTrack + 1;
+    if (cylinder > 1023) {
+        cylinder = 1023;
+        head = heads - 1;
+        sector = sectorsPerTrack;
+    }
+    config->mbr_chs_end_0 = (int)head;
+    config->mbr_chs_end_1 = (int)(sector | ((cylinder >> 2) & 0xC0));
+    config->mbr_chs_end_2 = (int)(cylinder & 0xFF);
+
+    int sectorsPerCluster = 1;
+    while (sectorsPerCluster < 64 && config->mbr_disk_size / sectorsPerCluster > 65524)
+        sectorsPerCluster *= 2;
+    config->fat_sectors_per_cluster = sectorsPerCluster;
+    config->fat_head_count = (int)heads;
+
+    return true;
+}
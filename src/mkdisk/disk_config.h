@@ -28,4 +28,10 @@ extern const disk_config_t disk_510M;
 extern const disk_config_t disk_520M;
 extern const disk_config_t disk_1G;
 
+#define DISK_CONFIG_MIN_SIZE (4ll << 20) /* FAT16 needs at least 4085 clusters */
+#define DISK_CONFIG_MAX_SIZE (2040ll << 30) /* limit of the VHD format */
+
+const disk_config_t* DiskConfig_FindPreset(const char* name);
+bool DiskConfig_Compute(disk_config_t* config, long long size);
+
 #endif
@@ -14,12 +14,14 @@
 #include <mkdisk/disk_config.h>
 #include <mkdisk/ext2.h>
 #include <mkdisk/vhd.h>
+#include <mkdisk/layout.h>
 #include <mkdisk/mbr.h>
 #include <mkdisk/ext2_defs.h>
 #include <mkdisk/mbr_defs.h>
 #include <mkdisk/vhd_defs.h>
 
 #define MAX_DIR_ENTRIES 16384
+#define EXT2_MIN_LAST_GROUP_DATA 50
 
 typedef struct direntry {
     size_t inode;
@@ -30,6 +32,7 @@ struct FSDir {
     struct FSDir* next;
     struct FSDir* parent;
     Disk* disk;
+    const char* path;
     size_t inode;
     size_t entryCount;
     direntry entries[MAX_DIR_ENTRIES];
@@ -51,6 +54,8 @@ typedef struct stream_t {
     size_t nextDoublyInnerBlockOffset;
     uint8_t buffer[EXT2_BLOCKSIZE];
     uint8_t* bufferPtr;
+    const LayoutEntry* previous;    /* blocks used by the same file or directory last time */
+    size_t allocatedBlocks;
     bool isDir;
 } stream_t;
 
@@ -76,28 +81,50 @@ struct Ext2 {
     size_t dir_size;
 };
 
-static size_t ext2_alloc_inode(Ext2* e2)
+static size_t ext2_take_inode(Ext2* e2, size_t i, size_t j)
 {
     lua_State* L = e2->L;
 
-    for (size_t i = 0; i < e2->block_group_count; i++) {
-        for (size_t j = 0; j < e2->inodes_per_group; j++) {
-            if ((e2->inode_usage_bitmap[i][j >> 3] & (1 << (j & 7))) == 0) {
-                e2->inode_usage_bitmap[i][j >> 3] |= (1 << (j & 7));
-                if (e2->blockgroups[i].free_inodes == 0)
-                    luaL_error(L, "mismatch of free_inodes counter for block group %d.", (int)i);
-                if (e2->superblock.free_inodes == 0)
-                    luaL_error(L, "mismatch of ext2_superblock.free_inodes.");
-                e2->blockgroups[i].free_inodes--;
-                e2->superblock.free_inodes--;
-                return (i * e2->inodes_per_group + j) + 1;
-            }
-        }
+    e2->inode_usage_bitmap[i][j >> 3] |= (1 << (j & 7));
+    if (e2->blockgroups[i].free_inodes == 0)
+        luaL_error(L, "mismatch of free_inodes counter for block group %d.", (int)i);
+    if (e2->superblock.free_inodes == 0)
+        luaL_error(L, "mismatch of ext2_superblock.free_inodes.");
+    e2->blockgroups[i].free_inodes--;
+    e2->superblock.free_inodes--;
+    return (i * e2->inodes_per_group + j) + 1;
+}
 
-        if (e2->blockgroups[i].free_inodes != 0)
-            luaL_error(L, "free_inodes counter is not zero for block group %d.", (int)i);
+static size_t ext2_alloc_inode(Ext2* e2, const LayoutEntry* previous)
+{
+    lua_State* L = e2->L;
+    Layout* layout = e2->disk->layout;
+
+    if (previous && previous->inode != 0) {
+        size_t i = (previous->inode - 1) / e2->inodes_per_group;
+        size_t j = (previous->inode - 1) % e2->inodes_per_group;
+        if (i < e2->block_group_count && (e2->inode_usage_bitmap[i][j >> 3] & (1 << (j & 7))) == 0)
+            return ext2_take_inode(e2, i, j);
     }
 
+    do {
+        for (size_t i = 0; i < e2->block_group_count; i++) {
+            bool skipped = false;
+            for (size_t j = 0; j < e2->inodes_per_group; j++) {
+                if ((e2->inode_usage_bitmap[i][j >> 3] & (1 << (j & 7))) == 0) {
+                    if (layout && Layout_IsInodeReserved(layout, i * e2->inodes_per_group + j + 1)) {
+                        skipped = true;
+                        continue;
+                    }
+                    return ext2_take_inode(e2, i, j);
+                }
+            }
+
+            if (!skipped && e2->blockgroups[i].free_inodes != 0)
+                luaL_error(L, "free_inodes counter is not zero for block group %d.", (int)i);
+        }
+    } while (layout && Layout_ReleaseReservations(layout));
+
     if (e2->superblock.free_inodes != 0)
         luaL_error(L, "mismatch of ext2_superblock.free_inodes.");
 
@@ -114,29 +141,44 @@ static ext2_inode* ext2_get_inode(Ext2* e2, size_t inode)
     return &e2->inode_table[EXT2_BLOCKGROUP_FOR_INODE(e2->superblock, inode)][EXT2_INODE_INDEX(e2->superblock, inode)];
 }
 
-static size_t ext2_alloc_block(Ext2* e2, bool is_directory)
+static size_t ext2_take_block(Ext2* e2, size_t i, size_t j, bool is_directory)
 {
     lua_State* L = e2->L;
 
-    for (size_t i = 0; i < e2->block_group_count; i++) {
-        for (size_t j = 0; j < e2->blocks_per_group; j++) {
-            if ((e2->block_usage_bitmap[i][j >> 3] & (1 << (j & 7))) == 0) {
-                e2->block_usage_bitmap[i][j >> 3] |= (1 << (j & 7));
-                if (e2->blockgroups[i].free_blocks == 0)
-                    luaL_error(L, "mismatch of free_blocks counter for block group %d.", (int)i);
-                if (e2->superblock.free_blocks == 0)
-                    luaL_error(L, "mismatch of ext2_superblock.free_blocks.");
-                if (is_directory)
-                    ++e2->blockgroups[i].num_directories;
-                e2->blockgroups[i].free_blocks--;
-                e2->superblock.free_blocks--;
-                return i * e2->blocks_per_group + j;
+    e2->block_usage_bitmap[i][j >> 3] |= (1 << (j & 7));
+    if (e2->blockgroups[i].free_blocks == 0)
+        luaL_error(L, "mismatch of free_blocks counter for block group %d.", (int)i);
+    if (e2->superblock.free_blocks == 0)
+        luaL_error(L, "mismatch of ext2_superblock.free_blocks.");
+    if (is_directory)
+        ++e2->blockgroups[i].num_directories;
+    e2->blockgroups[i].free_blocks--;
+    e2->superblock.free_blocks--;
+    return i * e2->blocks_per_group + j;
+}
+
+static size_t ext2_alloc_block(Ext2* e2, bool is_directory)
+{
+    lua_State* L = e2->L;
+    Layout* layout = e2->disk->layout;
+
+    do {
+        for (size_t i = 0; i < e2->block_group_count; i++) {
+            bool skipped = false;
+            for (size_t j = 0; j < e2->blocks_per_group; j++) {
+                if ((e2->block_usage_bitmap[i][j >> 3] & (1 << (j & 7))) == 0) {
+                    if (layout && Layout_IsUnitReserved(layout, i * e2->blocks_per_group + j)) {
+                        skipped = true;
+                        continue;
+                    }
+                    return ext2_take_block(e2, i, j, is_directory);
+                }
             }
-        }
 
-        if (e2->blockgroups[i].free_blocks != 0)
-            luaL_error(L, "free_blocks counter is not zero for block group %d.", (int)i);
-    }
+            if (!skipped && e2->blockgroups[i].free_blocks != 0)
+                luaL_error(L, "free_blocks counter is not zero for block group %d.", (int)i);
+        }
+    } while (layout && Layout_ReleaseReservations(layout));
 
     if (e2->superblock.free_blocks != 0)
         luaL_error(L, "mismatch of ext2_superblock.free_blocks.");
@@ -175,6 +217,8 @@ static void ext2_open(stream_t* stream, Ext2* e2, ext2_inode* inode, bool isDir)
     stream->nextDoublyBlockOffset = 0;
     stream->nextDoublyInnerBlockOffset = 0;
     stream->bufferPtr = stream->buffer + EXT2_BLOCKSIZE;
+    stream->previous = NULL;
+    stream->allocatedBlocks = 0;
     stream->isDir = isDir;
 }
 
@@ -208,6 +252,31 @@ static void ext2_close(stream_t* stream)
             * EXT2_BLOCKSIZE / VHD_SECTOR_SIZE;
 }
 
+static size_t ext2_stream_next_block(stream_t* stream)
+{
+    Ext2* e2 = stream->e2;
+    Layout* layout = e2->disk->layout;
+    size_t block = 0;
+
+    /* blocks are requested in the same order as last time, so the n-th block goes to the same place again */
+    const LayoutEntry* previous = stream->previous;
+    if (previous && stream->allocatedBlocks < previous->unitCount) {
+        size_t i = previous->units[stream->allocatedBlocks] / e2->blocks_per_group;
+        size_t j = previous->units[stream->allocatedBlocks] % e2->blocks_per_group;
+        if (i < e2->block_group_count && (e2->block_usage_bitmap[i][j >> 3] & (1 << (j & 7))) == 0)
+            block = ext2_take_block(e2, i, j, stream->isDir);
+    }
+
+    if (block == 0)
+        block = ext2_alloc_block(e2, stream->isDir);
+
+    ++stream->allocatedBlocks;
+    if (layout)
+        Layout_AddUnit(layout, block);
+
+    return block;
+}
+
 static void ext2_stream_alloc_block(stream_t* stream)
 {
     ext2_write_current_block(stream);
@@ -218,7 +287,7 @@ static void ext2_stream_alloc_block(stream_t* stream)
     /* direct */
 
     if (stream->nextBlockOffset < EXT2_NUM_DIRECT_BLOCKS) {
-        stream->currentBlock = ext2_alloc_block(stream->e2, stream->isDir);
+        stream->currentBlock = ext2_stream_next_block(stream);
         //printf("direct: %d\n", (int)stream->currentBlock);
         stream->inode->block_pointers[stream->nextBlockOffset] = stream->currentBlock;
         ++stream->nextBlockOffset;
@@ -229,13 +298,13 @@ static void ext2_stream_alloc_block(stream_t* stream)
 
     if (!stream->singly) {
         ++stream->extraAllocatedBlocks;
-        stream->inode->indirect_singly = ext2_alloc_block(stream->e2, stream->isDir);
+        stream->inode->indirect_singly = ext2_stream_next_block(stream);
         //printf("  singly @ %d\n", (int)stream->inode->indirect_singly);
         stream->singly = (uint32_t*)calloc(1, EXT2_BLOCKSIZE);
     }
 
     if (stream->nextSinglyBlockOffset < EXT2_BLOCKSIZE / sizeof(uint32_t)) {
-        stream->currentBlock = ext2_alloc_block(stream->e2, stream->isDir);
+        stream->currentBlock = ext2_stream_next_block(stream);
         //printf("  singly[%d]: %d\n", (int)stream->nextSinglyBlockOffset, (int)stream->currentBlock);
         stream->singly[stream->nextSinglyBlockOffset] = stream->currentBlock;
         ++stream->nextSinglyBlockOffset;
@@ -247,11 +316,11 @@ static void ext2_stream_alloc_block(stream_t* stream)
     if (!stream->doubly) {
         stream->extraAllocatedBlocks += 2;
 
-        stream->inode->indirect_doubly = ext2_alloc_block(stream->e2, stream->isDir);
+        stream->inode->indirect_doubly = ext2_stream_next_block(stream);
         //printf("  doubly @ %d\n", (int)stream->inode->indirect_doubly);
         stream->doubly = (uint32_t*)calloc(1, EXT2_BLOCKSIZE);
 
-        size_t doublyBlock = ext2_alloc_block(stream->e2, stream->isDir);
+        size_t doublyBlock = ext2_stream_next_block(stream);
         stream->doublyInner = (uint32_t*)calloc(1, EXT2_BLOCKSIZE);
         //printf("  doubly[%d] @ %d\n", (int)stream->nextDoublyBlockOffset, (int)doublyBlock);
         stream->doubly[stream->nextDoublyBlockOffset] = doublyBlock;
@@ -260,7 +329,7 @@ static void ext2_stream_alloc_block(stream_t* stream)
 
     if (stream->nextDoublyInnerBlockOffset < EXT2_BLOCKSIZE / sizeof(uint32_t)) {
       doInner:
-        stream->currentBlock = ext2_alloc_block(stream->e2, stream->isDir);
+        stream->currentBlock = ext2_stream_next_block(stream);
         //printf("    doublyInner[%d]: %d\n", (int)stream->nextDoublyInnerBlockOffset, (int)stream->currentBlock);
         stream->doublyInner[stream->nextDoublyInnerBlockOffset] = stream->currentBlock;
         ++stream->nextDoublyInnerBlockOffset;
@@ -274,7 +343,7 @@ static void ext2_stream_alloc_block(stream_t* stream)
 
         ++stream->extraAllocatedBlocks;
 
-        size_t doublyBlock = ext2_alloc_block(stream->e2, stream->isDir);
+        size_t doublyBlock = ext2_stream_next_block(stream);
         memset(stream->doublyInner, 0, EXT2_BLOCKSIZE);
         //printf("  doubly[%d] @ %d\n", (int)stream->nextDoublyBlockOffset, (int)doublyBlock);
         stream->doubly[stream->nextDoublyBlockOffset] = doublyBlock;
@@ -322,7 +391,13 @@ static void Ext2_BuildDir(Ext2* e2, const FSDir* d)
     e2->dir_entry.name_length = 0;
     e2->dir_entry.entry_size = sizeof(e2->dir_entry);
 
+    Layout* layout = e2->disk->layout;
     ext2_open(&e2->dir_stream, e2, ext2_get_inode(e2, d->inode), true);
+    if (layout) {
+        e2->dir_stream.previous = Layout_Find(layout, d->path);
+        Layout_BeginEntry(layout, d->path, d->inode);
+    }
+
     for (size_t i = 0; i < d->entryCount; i++) {
         size_t nameLength = strlen(d->entries[i].name);
         size_t entrySize = sizeof(ext2_direntry) + nameLength;
@@ -359,6 +434,8 @@ static void Ext2_BuildDir(Ext2* e2, const FSDir* d)
     ext2_flush_dir_entry(e2);
 
     ext2_close(&e2->dir_stream);
+    if (layout)
+        Layout_EndEntry(layout);
 
     assert(e2->dir_size == EXT2_BLOCKSIZE);
 }
@@ -388,6 +465,7 @@ Ext2* Ext2_Init(Disk* dsk, FSDir** outRoot)
 
     memset(&e2->root_dir, 0, sizeof(e2->root_dir));
     e2->root_dir.disk = dsk;
+    e2->root_dir.path = "/";
 
     size_t disk_size = MBR_DISK_SIZE * VHD_SECTOR_SIZE;
 
@@ -395,12 +473,23 @@ Ext2* Ext2_Init(Disk* dsk, FSDir** outRoot)
     e2->blocks_per_group = EXT2_BLOCKSIZE * 8; /* bitmap = 1 block, 8 bits per byte */;
     size_t first_data_block = (EXT2_BLOCKSIZE == EXT2_SUPERBLOCK_START_OFFSET ? 1 : 0);
 
-    size_t group_count = ((block_count - first_data_block) + (e2->blocks_per_group - 1)) / e2->blocks_per_group;
+    /* a partial last group too small for its bitmaps and inode table is left unused, like mke2fs does */
+    size_t group_count;
+    for (;;) {
+        group_count = ((block_count - first_data_block) + (e2->blocks_per_group - 1)) / e2->blocks_per_group;
+
+        const size_t inode_ratio = 8192;
+        e2->inodes_per_group = ((disk_size / inode_ratio) / group_count + 7) / 8 * 8;
+        e2->total_inode_count = e2->inodes_per_group * group_count;
+        e2->inode_table_blocks = (e2->inodes_per_group * sizeof(ext2_inode) + EXT2_BLOCKSIZE - 1) / EXT2_BLOCKSIZE;
 
-    const size_t inode_ratio = 8192;
-    e2->inodes_per_group = ((disk_size / inode_ratio) / group_count + 7) / 8 * 8;
-    e2->total_inode_count = e2->inodes_per_group * group_count;
-    e2->inode_table_blocks = (e2->inodes_per_group * sizeof(ext2_inode) + EXT2_BLOCKSIZE - 1) / EXT2_BLOCKSIZE;
+        size_t lastGroupBlocks = block_count % e2->blocks_per_group;
+        if (lastGroupBlocks == 0 || group_count == 1
+                || lastGroupBlocks >= first_data_block + 2 + e2->inode_table_blocks + EXT2_MIN_LAST_GROUP_DATA)
+            break;
+
+        block_count -= lastGroupBlocks;
+    }
 
     e2->block_group_count = (block_count + e2->blocks_per_group - 1) / e2->blocks_per_group;
     size_t initialMetadataBlocks = (EXT2_GROUP_TABLE_START_OFFSET + e2->block_group_count * sizeof(ext2_blockgroupdesc) + EXT2_BLOCKSIZE - 1) / EXT2_BLOCKSIZE;
@@ -517,9 +606,22 @@ FSDir* Ext2_CreateDirectory(Ext2* e2, FSDir* parent, const char* name, const ext
         exit(1);
     }
 
+    size_t parentPathLen = strlen(parent->path);
+    size_t nameLen = strlen(name);
+    char* path = (char*)malloc(parentPathLen + nameLen + 2);
+    if (!path) {
+        fprintf(stderr, "memory allocation failed.\n");
+        exit(1);
+    }
+    memcpy(path, parent->path, parentPathLen);
+    memcpy(path + parentPathLen, name, nameLen);
+    memcpy(path + parentPathLen + nameLen, "/", 2);
+    d->path = path;
+
     assert((meta->type_and_perm & EXT2_TYPE_MASK) == EXT2_TYPE_DIRECTORY);
 
-    size_t inode = ext2_alloc_inode(e2);
+    Layout* layout = e2->disk->layout;
+    size_t inode = ext2_alloc_inode(e2, (layout ? Layout_Find(layout, path) : NULL));
     ext2_inode* inode_ptr = ext2_get_inode(e2, inode);
     inode_ptr->type_and_perm = meta->type_and_perm;
     inode_ptr->last_access_time = e2->t;
@@ -541,9 +643,20 @@ FSDir* Ext2_CreateDirectory(Ext2* e2, FSDir* parent, const char* name, const ext
     return d;
 }
 
-void Ext2_AddFile(Ext2* e2, FSDir* parent, const char* name, const void* data, size_t size, const ext2_meta* meta)
+/* when the layout is enabled, starts its entry; blocks used by this file last time are returned in outPrevious */
+static ext2_inode* ext2_add_file_inode(Ext2* e2, FSDir* parent, const char* name, const ext2_meta* meta,
+    const LayoutEntry** outPrevious)
 {
-    size_t inode = ext2_alloc_inode(e2);
+    Layout* layout = e2->disk->layout;
+    const LayoutEntry* previous = NULL;
+    const char* path = NULL;
+
+    if (layout) {
+        path = lua_pushfstring(e2->L, "%s%s", parent->path, name);
+        previous = Layout_Find(layout, path);
+    }
+
+    size_t inode = ext2_alloc_inode(e2, previous);
     ext2_inode* inode_ptr = ext2_get_inode(e2, inode);
     inode_ptr->type_and_perm = meta->type_and_perm;
     inode_ptr->user_id = meta->uid;
@@ -559,8 +672,23 @@ void Ext2_AddFile(Ext2* e2, FSDir* parent, const char* name, const void* data, s
 
     ext2_add_direntry(e2, parent, name, inode);
 
+    if (layout) {
+        Layout_BeginEntry(layout, path, inode);
+        lua_pop(e2->L, 1);
+    }
+
+    *outPrevious = previous;
+
+    assert((meta->type_and_perm & EXT2_TYPE_MASK) != EXT2_TYPE_DIRECTORY);
+    return inode_ptr;
+}
+
+void Ext2_AddFile(Ext2* e2, FSDir* parent, const char* name, const void* data, size_t size, const ext2_meta* meta)
+{
+    const LayoutEntry* previous;
+    ext2_inode* inode_ptr = ext2_add_file_inode(e2, parent, name, meta, &previous);
+
     unsigned type = (meta->type_and_perm & EXT2_TYPE_MASK);
-    assert(type != EXT2_TYPE_DIRECTORY);
     if (type == EXT2_TYPE_SYMLINK && size <= EXT2_SMALL_SYMLINK_LEN) {
         memcpy(inode_ptr->block_pointers, data, size);
         inode_ptr->file_size = size;
@@ -577,9 +705,75 @@ void Ext2_AddFile(Ext2* e2, FSDir* parent, const char* name, const void* data, s
     } else {
         stream_t stream;
         ext2_open(&stream, e2, inode_ptr, false);
+        stream.previous = previous;
         ext2_append(&stream, data, size);
         ext2_close(&stream);
     }
+
+    if (e2->disk->layout)
+        Layout_EndEntry(e2->disk->layout);
+}
+
+void Ext2_AddFileFrom(Ext2* e2, FSDir* parent, const char* name, File* file, size_t size, const ext2_meta* meta)
+{
+    unsigned type = (meta->type_and_perm & EXT2_TYPE_MASK);
+    if ((type == EXT2_TYPE_SYMLINK && size <= EXT2_SMALL_SYMLINK_LEN)
+            || type == EXT2_TYPE_CHAR_DEV || type == EXT2_TYPE_BLOCK_DEV) {
+        /* contents are stored in the inode itself */
+        char buf[EXT2_SMALL_SYMLINK_LEN];
+        if (size > sizeof(buf))
+            luaL_error(e2->L, "invalid device file!");
+        File_Read(file, buf, size);
+        Ext2_AddFile(e2, parent, name, buf, size, meta);
+        return;
+    }
+
+    const LayoutEntry* previous;
+    ext2_inode* inode_ptr = ext2_add_file_inode(e2, parent, name, meta, &previous);
+
+    /* contents are read straight into the block buffer of the stream, one block at a time */
+    stream_t stream;
+    ext2_open(&stream, e2, inode_ptr, false);
+    stream.previous = previous;
+    while (size != 0) {
+        if (stream.bufferPtr >= stream.buffer + sizeof(stream.buffer))
+            ext2_stream_alloc_block(&stream);
+
+        size_t space = (size_t)(stream.buffer + sizeof(stream.buffer) - stream.bufferPtr);
+        size_t chunk = (size < space ? size : space);
+        File_Read(file, stream.bufferPtr, chunk);
+        stream.bufferPtr += chunk;
+        stream.currentSize += chunk;
+        size -= chunk;
+    }
+    ext2_close(&stream);
+
+    if (e2->disk->layout)
+        Layout_EndEntry(e2->disk->layout);
+}
+
+void Ext2_SetTime(Ext2* e2, time_t t)
+{
+    e2->t = t;
+
+    e2->superblock.last_mount_time = t;
+    e2->superblock.last_write_time = t;
+    e2->superblock.last_check_time = t;
+
+    ext2_inode* root = ext2_get_inode(e2, e2->root_dir.inode);
+    root->last_access_time = t;
+    root->creation_time = t;
+    root->last_modify_time = t;
+}
+
+size_t Ext2_GetBlockCount(const Ext2* e2)
+{
+    return e2->superblock.total_blocks;
+}
+
+size_t Ext2_GetInodeCount(const Ext2* e2)
+{
+    return e2->superblock.total_inodes;
 }
 
 void Ext2_Write(Ext2* e2)
@@ -2,6 +2,8 @@
 #define MKDISK_EXT2_H
 
 #include <mkdisk/mkdisk.h>
+#include <common/file.h>
+#include <time.h>
 
 STRUCT(ext2_meta) {
     unsigned type_and_perm;
@@ -11,6 +13,10 @@ STRUCT(ext2_meta) {
 Ext2* Ext2_Init(Disk* dsk, FSDir** outRoot);
 FSDir* Ext2_CreateDirectory(Ext2* e2, FSDir* parent, const char* name, const ext2_meta* meta);
 void Ext2_AddFile(Ext2* e2, FSDir* parent, const char* name, const void* data, size_t size, const ext2_meta* meta);
+void Ext2_AddFileFrom(Ext2* e2, FSDir* parent, const char* name, File* file, size_t size, const ext2_meta* meta);
+void Ext2_SetTime(Ext2* e2, time_t t);
+size_t Ext2_GetBlockCount(const Ext2* e2);
+size_t Ext2_GetInodeCount(const Ext2* e2);
 void Ext2_Write(Ext2* e2);
 
 #endif
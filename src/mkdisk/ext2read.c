@@ -5,6 +5,8 @@
 #include <common/console.h>
 #include <common/byteswap.h>
 #include <common/file.h>
+#include <common/buffer.h>
+#include <common/batchio.h>
 #include <string.h>
 
 typedef struct stream_t {
@@ -127,7 +129,7 @@ static int skip(stream_t* stream, size_t bytes)
     return 1;
 }
 
-static bool write_meta(lua_State* L, const char* path, const ext2_inode* inode)
+static void queue_meta(lua_State* L, BatchIO* batch, const char* path, const ext2_inode* inode)
 {
     const char* types = NULL;
     switch (inode->type_and_perm & EXT2_TYPE_MASK) {
@@ -144,40 +146,42 @@ static bool write_meta(lua_State* L, const char* path, const ext2_inode* inode)
     sprintf(buf, "%s %04o %d:%d\n",
         types, inode->type_and_perm & EXT2_PERM_MASK, inode->user_id, inode->group_id);
 
-    return File_MaybeOverwrite(L, path, buf, strlen(buf));
+    BatchIO_AddWrite(L, batch, path, buf, strlen(buf));
 }
 
-static bool dump_file(lua_State* L, const char* name, const ext2_inode* inode)
+/* queues the file and its meta file, in that order; returns number of bytes queued */
+static size_t queue_file(lua_State* L, BatchIO* batch, const char* name, const ext2_inode* inode)
 {
-    bool written = false;
+    size_t size;
 
     char path[1025];
     sprintf(path, "%s/%s", g_dst_dir, name);
 
     int type = (inode->type_and_perm & EXT2_TYPE_MASK);
     if (type == EXT2_TYPE_SYMLINK && inode->file_size <= EXT2_SMALL_SYMLINK_LEN) {
-        written = File_MaybeOverwrite(L, path, inode->block_pointers, inode->file_size);
+        size = inode->file_size;
+        BatchIO_AddWrite(L, batch, path, inode->block_pointers, size);
     } else if (type == EXT2_TYPE_CHAR_DEV || type == EXT2_TYPE_BLOCK_DEV) {
         int major = (inode->block_pointers[0] >> 16) & 0xffff;
         int minor = inode->block_pointers[0] & 0xffff;
         char buf[32];
         sprintf(buf, "%d:%d\n", major, minor);
-        written = File_MaybeOverwrite(L, path, buf, strlen(buf));
+        size = strlen(buf);
+        BatchIO_AddWrite(L, batch, path, buf, size);
     } else {
-        uint8_t* ptr = (uint8_t*)lua_newuserdatauv(L, inode->file_size, 0);
-        uint8_t* dst = ptr;
+        /* decoded straight into the request, no intermediate copy */
+        size = inode->file_size;
+        uint8_t* dst = (uint8_t*)BatchIO_AddWriteBuffer(L, batch, path, size);
         stream_t stream;
         begin(L, &stream, inode);
         while (read_byte(&stream, dst))
             ++dst;
-        written = File_MaybeOverwrite(L, path, ptr, inode->file_size);
-        lua_pop(L, 1);
     }
 
     strcat(path, "[meta]");
-    written = write_meta(L, path, inode) || written;
+    queue_meta(L, batch, path, inode);
 
-    return written;
+    return size;
 }
 
 typedef struct pending_dir_t {
@@ -188,6 +192,49 @@ typedef struct pending_dir_t {
 
 static bool lf_pending = false;
 
+/* files of a directory are written in batches, results are reported in directory order */
+#define DUMP_BATCH_MAX_REQUESTS 256
+#define DUMP_BATCH_MAX_BYTES (64u << 20)
+
+static void write_batch(lua_State* L, BatchIO* batch, bool with_dir_meta)
+{
+    BatchIO_Run(L, batch);
+
+    size_t count = BatchIO_GetCount(batch);
+    size_t index = 0;
+
+    if (with_dir_meta) {
+        BatchRequest* meta = BatchIO_Get(batch, index++);
+        BatchIO_Check(L, meta);
+        if (!g_verbose) {
+            lf_pending = true;
+            Con_PrintF(L, COLOR_PROGRESS, "%c", (meta->written ? '+' : '.'));
+        }
+    }
+
+    for (; index + 1 < count; index += 2) {
+        BatchRequest* file = BatchIO_Get(batch, index);
+        BatchRequest* meta = BatchIO_Get(batch, index + 1);
+        BatchIO_Check(L, file);
+        BatchIO_Check(L, meta);
+
+        if (!g_verbose) {
+            if (!file->written && !meta->written) {
+                lf_pending = true;
+                Con_Print(L, COLOR_PROGRESS, ".");
+            } else {
+                if (lf_pending) {
+                    lf_pending = false;
+                    Con_Print(L, COLOR_PROGRESS, "\n");
+                }
+                Con_PrintF(L, COLOR_STATUS, "%s\n", file->path + g_dst_dir_prefix_len);
+            }
+        }
+    }
+
+    BatchIO_Clear(batch);
+}
+
 static void dump_directory(lua_State* L, const char* name, const ext2_inode* inode)
 {
     const char* path;
@@ -210,13 +257,14 @@ static void dump_directory(lua_State* L, const char* name, const ext2_inode* ino
         path = lua_pushfstring(L, "%s/", g_dst_dir);
     }
 
+    BatchIO* batch = BatchIO_PushNew(L);
+    size_t batch_bytes = 0;
+    bool with_dir_meta = true;
+
     sprintf(entry_name, "%s/[meta]", g_dst_dir);
-    bool written = write_meta(L, entry_name, inode);
+    queue_meta(L, batch, entry_name, inode);
 
-    if (!g_verbose) {
-        lf_pending = true;
-        Con_PrintF(L, COLOR_PROGRESS, "%c", (written ? '+' : '.'));
-    } else {
+    if (g_verbose) {
         Con_PrintF(L, COLOR_STATUS, "\n%s\n", path + g_dst_dir_prefix_len);
         Con_PrintSeparator(L);
     }
@@ -292,18 +340,11 @@ static void dump_directory(lua_State* L, const char* name, const ext2_inode* ino
                 continue;
 
             if ((inode->type_and_perm & EXT2_TYPE_MASK) != EXT2_TYPE_DIRECTORY) {
-                bool written = dump_file(L, entry_name, inode);
-                if (!g_verbose) {
-                    if (!written) {
-                        lf_pending = true;
-                        Con_Print(L, COLOR_PROGRESS, ".");
-                    } else {
-                        if (lf_pending) {
-                            lf_pending = false;
-                            Con_Print(L, COLOR_PROGRESS, "\n");
-                        }
-                        Con_PrintF(L, COLOR_STATUS, "%s\n", buf + g_dst_dir_prefix_len);
-                    }
+                batch_bytes += queue_file(L, batch, entry_name, inode);
+                if (BatchIO_GetCount(batch) >= DUMP_BATCH_MAX_REQUESTS || batch_bytes >= DUMP_BATCH_MAX_BYTES) {
+                    write_batch(L, batch, with_dir_meta);
+                    with_dir_meta = false;
+                    batch_bytes = 0;
                 }
             } else {
                 if (!strcmp(entry_name, ".") || !strcmp(entry_name, ".."))
@@ -323,6 +364,8 @@ static void dump_directory(lua_State* L, const char* name, const ext2_inode* ino
         }
     }
 
+    write_batch(L, batch, with_dir_meta);
+
     if (!g_verbose)
         Con_Flush(L);
 
@@ -333,9 +376,11 @@ static void dump_directory(lua_State* L, const char* name, const ext2_inode* ino
     g_dst_dir = old_dst_dir;
 }
 
-static void load_img(lua_State* L, const char* img)
+static Buffer* load_img(lua_State* L, const char* img)
 {
-    g_disk = (uint8_t*)File_PushContents(L, img, NULL);
+    Buffer* buffer = File_PushMapped(L, img, FILE_ACCESS_RANDOM);
+    g_disk = (uint8_t*)buffer->data;
+    return buffer;
 }
 
 STRUCT(Vhd) {
@@ -361,11 +406,13 @@ static const uint8_t* vhd_get_sector(const Vhd* vhd, size_t index)
     return vhd->data + offset + (sectorIndex * VHD_SECTOR_SIZE);
 }
 
-static void load_vhd(lua_State* L, const char* file)
+static Buffer* load_vhd(lua_State* L, const char* file)
 {
     Vhd vhd;
     vhd.L = L;
-    vhd.data = (uint8_t*)File_PushContents(L, file, NULL);
+
+    Buffer* vhdBuffer = File_PushMapped(L, file, FILE_ACCESS_SEQUENTIAL);
+    vhd.data = (uint8_t*)vhdBuffer->data;
 
     const vhd_footer* footer = (const vhd_footer*)vhd.data;
     const vhd_dynhdr* dynhdr = (const vhd_dynhdr*)(footer + 1);
@@ -385,14 +432,18 @@ static void load_vhd(lua_State* L, const char* file)
     size_t start = pMBR->entries[0].lba_start;
     size_t sectors = pMBR->entries[0].lba_size;
 
-    uint8_t* dst = (uint8_t*)lua_newuserdatauv(L, sectors * VHD_SECTOR_SIZE, 0);
+    Buffer* buffer = Buffer_PushNew(L, sectors * VHD_SECTOR_SIZE);
+    uint8_t* dst = (uint8_t*)buffer->data;
     g_disk = dst;
     for (size_t i = 0; i < sectors; i++) {
         memcpy(dst, vhd_get_sector(&vhd, start + i), VHD_SECTOR_SIZE);
         dst += VHD_SECTOR_SIZE;
     }
 
+    Buffer_Close(vhdBuffer);
     lua_remove(L, -2);
+
+    return buffer;
 }
 
 static void ext2read_dump(lua_State* L, const char* dstDir, size_t dstDirLen)
@@ -508,8 +559,12 @@ static int ext2read_dump_img(lua_State* L)
     const char* file = luaL_checkstring(L, 1);
     const char* dstDir = luaL_checklstring(L, 2, &dstDirLen);
 
-    load_img(L, file);
+    Buffer* buffer = load_img(L, file);
+    File_BeginSyncBatch(L);
     ext2read_dump(L, dstDir, dstDirLen);
+    File_EndSyncBatch(L);
+    Buffer_Close(buffer);
+    g_disk = NULL;
 
     return 0;
 }
@@ -520,8 +575,12 @@ static int ext2read_dump_vhd(lua_State* L)
     const char* file = luaL_checkstring(L, 1);
     const char* dstDir = luaL_checklstring(L, 2, &dstDirLen);
 
-    load_vhd(L, file);
+    Buffer* buffer = load_vhd(L, file);
+    File_BeginSyncBatch(L);
     ext2read_dump(L, dstDir, dstDirLen);
+    File_EndSyncBatch(L);
+    Buffer_Close(buffer);
+    g_disk = NULL;
 
     return 0;
 }
@@ -14,6 +14,7 @@
 #include <mkdisk/mkdisk.h>
 #include <mkdisk/fat.h>
 #include <mkdisk/vhd.h>
+#include <mkdisk/layout.h>
 #include <mkdisk/mbr.h>
 #include <mkdisk/fat_defs.h>
 #include <mkdisk/mbr_defs.h>
@@ -23,17 +24,22 @@
 #define FAT_SIZE (MBR_DISK_SIZE / SECTORS_PER_CLUSTER)
 #define SECTORS_PER_FAT (FAT_SIZE * sizeof(uint16_t) + SECTOR_SIZE - 1) / SECTOR_SIZE
 
-#define CLUSTER_SIZE (SECTOR_SIZE * SECTORS_PER_CLUSTER)
+#define CLUSTER_SIZE (SECTOR_SIZE * sectorsPerCluster)
 
 #define MAX_DIR_ENTRIES 16384
+#define FAT16_MIN_CLUSTERS 4085 /* drivers take volumes with fewer clusters for FAT12 */
+#define FAT16_MAX_CLUSTERS 65524
+#define FAT32_MIN_CLUSTERS 65525
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF5
 
 struct FSDir {
     struct FSDir* next;
     struct FSDir* parent;
     Disk* disk;
+    const char* path;
     size_t parentIndex;
     size_t entryCount;
-    uint16_t cluster;
+    uint32_t cluster;
     fat_direntry entries[MAX_DIR_ENTRIES];
 };
 
@@ -42,29 +48,35 @@ struct Fat {
     int x;
 };
 
+static bool isFat32;
+static uint32_t endOfChain;
+static size_t sectorsPerCluster;
+static size_t sectorsPerFat;
+static size_t reservedSectors;
+static size_t firstDataSector;
 static size_t fatSize;
-static uint16_t* fat;
+static uint32_t* fat;
+static uint32_t nextFreeCluster;    /* clusters below are in use or reserved by the layout */
 static FSDir root_dir;
 static FSDir* last_dir;
 
-Fat* Fat_Init(Disk* dsk, const uint8_t* bootCode, FSDir** outRoot)
+/* cluster sizes used by Windows for FAT32 */
+static size_t fat32_sectors_per_cluster(size_t totalSectors)
 {
-    lua_State* L = dsk->L;
-    const disk_config_t* disk_config = dsk->config;
-
-    Fat* fatT = (Fat*)lua_newuserdatauv(L, sizeof(Fat), 0);
-
-    if (sizeof(fat_bootsector) != VHD_SECTOR_SIZE) {
-        luaL_error(L, "invalid boot sector size (%I) - expected %I.",
-            (lua_Integer)sizeof(fat_bootsector), (lua_Integer)VHD_SECTOR_SIZE);
-    }
+    if (totalSectors <= 532480)         /* 260 MB */
+        return 1;
+    if (totalSectors <= 16777216)       /* 8 GB */
+        return 8;
+    if (totalSectors <= 33554432)       /* 16 GB */
+        return 16;
+    if (totalSectors <= 67108864)       /* 32 GB */
+        return 32;
+    return 64;
+}
 
-    fatSize = FAT_SIZE;
-    fat = calloc(sizeof(uint16_t), fatSize);
-    if (!fat) {
-        fprintf(stderr, "memory allocation failed.\n");
-        exit(1);
-    }
+static void fat16_init_bootsector(Disk* dsk, const uint8_t* bootCode)
+{
+    const disk_config_t* disk_config = dsk->config;
 
     fat_bootsector* p = (fat_bootsector*)VHD_Sector(dsk, MBR_DISK_START);
     if (bootCode) {
@@ -74,13 +86,13 @@ Fat* Fat_Init(Disk* dsk, const uint8_t* bootCode, FSDir** outRoot)
     }
     memcpy(p->oem, "MSDOS5.0", 8);
     p->bytesPerSector = SECTOR_SIZE;
-    p->sectorsPerCluster = SECTORS_PER_CLUSTER;
-    p->reservedSectors = 1;
+    p->sectorsPerCluster = sectorsPerCluster;
+    p->reservedSectors = reservedSectors;
     p->fatCount = 2;
     p->maxRootDirEntries = MAX_ROOT_DIR_ENTRIES;
     p->totalSectorsOld = 0;
     p->mediaDescriptor = 0xF8; // fixed disk
-    p->sectorsPerFat = SECTORS_PER_FAT;
+    p->sectorsPerFat = sectorsPerFat;
     p->sectorsPerTrack = 0x3F;
     p->headCount = disk_config->fat_head_count;
     p->hiddenSectors = MBR_DISK_START;
@@ -92,15 +104,119 @@ Fat* Fat_Init(Disk* dsk, const uint8_t* bootCode, FSDir** outRoot)
     memcpy(p->fileSystem, "FAT16   ", 8);
     memcpy(p->code, bootCode + 3, BOOT_CODE_SIZE);
     p->signature = SIGNATURE;
+}
 
-    fat[0] = 0xFFF8; // FAT ID
-    fat[1] = 0xFFFF;
+static void fat32_init_bootsector(Disk* dsk, const uint8_t* bootCode)
+{
+    const disk_config_t* disk_config = dsk->config;
+
+    fat32_bootsector b;
+    memset(&b, 0, sizeof(b));
+    b.jump[0] = bootCode[0];
+    b.jump[1] = bootCode[1];
+    b.jump[2] = bootCode[2];
+    memcpy(b.oem, (dsk->fat32Win95 ? "MSWIN4.1" : "MSDOS5.0"), 8);
+    b.bytesPerSector = SECTOR_SIZE;
+    b.sectorsPerCluster = sectorsPerCluster;
+    b.reservedSectors = reservedSectors;
+    b.fatCount = 2;
+    b.maxRootDirEntries = 0;
+    b.totalSectorsOld = 0;
+    b.mediaDescriptor = 0xF8; // fixed disk
+    b.sectorsPerFatOld = 0;
+    b.sectorsPerTrack = 0x3F;
+    b.headCount = disk_config->fat_head_count;
+    b.hiddenSectors = MBR_DISK_START;
+    b.totalSectors = MBR_DISK_SIZE;
+    b.sectorsPerFat = sectorsPerFat;
+    b.flags = 0; // FAT is mirrored
+    b.version = 0;
+    b.rootDirCluster = root_dir.cluster;
+    b.fsInfoSector = FAT32_FSINFO_SECTOR;
+    b.backupBootSector = FAT32_BACKUP_BOOT_SECTOR;
+    b.physicalDriveNumber = 0x80; // first HDD
+    b.extendedBootSignature = 0x29;
+    memcpy(b.serial, "\x9E\xE9\x11\x00", 4);
+    memcpy(b.volumeLabel, "NO NAME    ", 11);
+    memcpy(b.fileSystem, "FAT32   ", 8);
+    memcpy(b.code, bootCode + 3, FAT32_BOOT_CODE_SIZE);
+    b.signature = SIGNATURE;
+
+    VHD_WriteSectors(dsk, MBR_DISK_START, &b, sizeof(b));
+    VHD_WriteSectors(dsk, MBR_DISK_START + FAT32_BACKUP_BOOT_SECTOR, &b, sizeof(b));
+}
+
+Fat* Fat_Init(Disk* dsk, const uint8_t* bootCode, FSDir** outRoot)
+{
+    lua_State* L = dsk->L;
+    const disk_config_t* disk_config = dsk->config;
+
+    Fat* fatT = (Fat*)lua_newuserdatauv(L, sizeof(Fat), 0);
+
+    if (sizeof(fat_bootsector) != VHD_SECTOR_SIZE || sizeof(fat32_bootsector) != VHD_SECTOR_SIZE) {
+        luaL_error(L, "invalid boot sector size (%I) - expected %I.",
+            (lua_Integer)sizeof(fat_bootsector), (lua_Integer)VHD_SECTOR_SIZE);
+    }
+
+    isFat32 = dsk->fat32;
+    if (!isFat32) {
+        if (FAT_SIZE > FAT16_MAX_CLUSTERS)
+            luaL_error(L, "disk is too large for FAT16.");
+
+        endOfChain = 0xFFFF;
+        sectorsPerCluster = SECTORS_PER_CLUSTER;
+        sectorsPerFat = SECTORS_PER_FAT;
+        reservedSectors = 1;
+        firstDataSector = MBR_DISK_START + reservedSectors + sectorsPerFat * 2 + ROOT_DIR_SECTORS;
+        fatSize = FAT_SIZE;
+
+        size_t metadataSectors = firstDataSector - (size_t)MBR_DISK_START;
+        if ((size_t)MBR_DISK_SIZE < metadataSectors + FAT16_MIN_CLUSTERS * sectorsPerCluster)
+            luaL_error(L, "disk is too small for FAT16.");
+    } else {
+        size_t totalSectors = (size_t)MBR_DISK_SIZE;
+        endOfChain = 0x0FFFFFFF;
+        sectorsPerCluster = fat32_sectors_per_cluster(totalSectors);
+        reservedSectors = FAT32_RESERVED_SECTORS;
+
+        /* the FAT is sized for all sectors after the reserved ones, which is slightly more than needed */
+        size_t clusterCount = (totalSectors - reservedSectors) / sectorsPerCluster;
+        sectorsPerFat = ((clusterCount + 2) * sizeof(uint32_t) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        clusterCount = (totalSectors - reservedSectors - sectorsPerFat * 2) / sectorsPerCluster;
+        if (clusterCount < FAT32_MIN_CLUSTERS)
+            luaL_error(L, "disk is too small for FAT32.");
+        if (clusterCount > FAT32_MAX_CLUSTERS)
+            luaL_error(L, "disk is too large for FAT32.");
+
+        firstDataSector = MBR_DISK_START + reservedSectors + sectorsPerFat * 2;
+        fatSize = clusterCount + 2;
+    }
+
+    fat = calloc(sizeof(uint32_t), fatSize);
+    if (!fat) {
+        fprintf(stderr, "memory allocation failed.\n");
+        exit(1);
+    }
+
+    fat[0] = endOfChain & 0x0FFFFFF8; // FAT ID
+    fat[1] = endOfChain;
+    nextFreeCluster = 2;
 
     memset(&root_dir, 0, sizeof(root_dir));
     root_dir.disk = dsk; /* FIXME */
+    root_dir.path = "/";
     last_dir = &root_dir;
     *outRoot = &root_dir;
 
+    if (!isFat32)
+        fat16_init_bootsector(dsk, bootCode);
+    else {
+        /* root directory is a cluster chain; it starts at the first cluster and is extended as needed by Fat_Write */
+        root_dir.cluster = 2;
+        fat[root_dir.cluster] = endOfChain;
+        fat32_init_bootsector(dsk, bootCode);
+    }
+
     return fatT;
 }
 
@@ -273,6 +389,18 @@ FSDir* fat_create_directory(FSDir* parent, const char* name)
         exit(1);
     }
 
+    size_t parentPathLen = strlen(parent->path);
+    size_t nameLen = strlen(name);
+    char* path = (char*)malloc(parentPathLen + nameLen + 2);
+    if (!path) {
+        fprintf(stderr, "memory allocation failed.\n");
+        exit(1);
+    }
+    memcpy(path, parent->path, parentPathLen);
+    memcpy(path + parentPathLen, name, nameLen);
+    memcpy(path + parentPathLen + nameLen, "/", 2);
+    d->path = path;
+
     d->entryCount = 2;
     memcpy(d->entries[0].name, ".       ", 8);
     memcpy(d->entries[0].ext, "   ", 3);
@@ -294,49 +422,99 @@ FSDir* fat_create_directory(FSDir* parent, const char* name)
     return d;
 }
 
-static uint16_t alloc_cluster(Disk* dsk, uint16_t start)
+static uint32_t find_free_cluster(const Layout* layout, size_t start)
 {
-    const disk_config_t* disk_config = dsk->config;
-
-    for (size_t i = start; i < (size_t)FAT_SIZE; i++) {
-        if (fat[i] == 0)
-            return (uint16_t)i;
+    for (size_t i = start; i < fatSize; i++) {
+        if (fat[i] == 0 && !(layout && Layout_IsUnitReserved(layout, i)))
+            return (uint32_t)i;
     }
+    return 0;
+}
+
+/* after: last cluster of the chain being extended, the next free cluster after it is preferred; 0 if none */
+static uint32_t alloc_cluster(Disk* dsk, uint32_t after)
+{
+    Layout* layout = dsk->layout;
+
+    do {
+        uint32_t cluster = 0;
+        if (after >= nextFreeCluster)
+            cluster = find_free_cluster(layout, after);
+        if (!cluster) {
+            cluster = find_free_cluster(layout, nextFreeCluster);
+            if (cluster)
+                nextFreeCluster = cluster + 1;
+        }
+        if (cluster)
+            return cluster;
+
+        /* reserved clusters below the hint become available */
+        nextFreeCluster = 2;
+    } while (layout && Layout_ReleaseReservations(layout));
 
     fprintf(stderr, "Output full!\n");
     exit(1);
 }
 
-static void alloc_file(Disk* dsk, uint16_t cluster, size_t size)
+/*
+ * path: key in the layout manifest, clusters listed there for it are taken again if they are still free
+ * first: cluster the chain already starts with, or 0
+ */
+static uint32_t alloc_chain(Disk* dsk, const char* path, size_t size, uint32_t first)
 {
-    const disk_config_t* disk_config = dsk->config;
-
-    for (;;) {
-        size_t srcSize = (size > (size_t)CLUSTER_SIZE ? (size_t)CLUSTER_SIZE : size);
+    Layout* layout = (path ? dsk->layout : NULL);
+    const LayoutEntry* previous = NULL;
 
-        fat[cluster] = 0xffff;
+    if (layout) {
+        previous = Layout_Find(layout, path);
+        Layout_BeginEntry(layout, path, 0);
+    }
 
-        size -= srcSize;
-        if (size == 0)
-            break;
+    size_t count = (size + (size_t)CLUSTER_SIZE - 1) / (size_t)CLUSTER_SIZE;
+    if (count == 0)
+        count = 1;
+
+    uint32_t cluster = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t nextCluster;
+        if (i == 0 && first)
+            nextCluster = first;
+        else if (previous && i < previous->unitCount && fat[previous->units[i]] == 0)
+            nextCluster = previous->units[i];
+        else
+            nextCluster = alloc_cluster(dsk, cluster);
 
-        uint16_t nextCluster = alloc_cluster(dsk, cluster);
-        fat[cluster] = nextCluster;
+        fat[nextCluster] = endOfChain;
+        if (cluster)
+            fat[cluster] = nextCluster;
+        else
+            first = nextCluster;
         cluster = nextCluster;
+
+        if (layout)
+            Layout_AddUnit(layout, cluster);
     }
+
+    if (layout)
+        Layout_EndEntry(layout);
+
+    return first;
 }
 
-static void write_file(Disk* dsk, uint16_t cluster, const void* data, size_t size)
+static uint32_t alloc_file(Disk* dsk, const char* path, size_t size)
+{
+    return alloc_chain(dsk, path, size, 0);
+}
+
+static void write_file(Disk* dsk, uint32_t cluster, const void* data, size_t size)
 {
-    const disk_config_t* disk_config = dsk->config;
     const uint8_t* src = (const uint8_t*)data;
 
     if (size > 0) {
         for (;;) {
             size_t srcSize = (size > (size_t)CLUSTER_SIZE ? (size_t)CLUSTER_SIZE : size);
 
-            VHD_WriteSectors(dsk, MBR_DISK_START + 1 + SECTORS_PER_FAT * 2 + ROOT_DIR_SECTORS +
-                (cluster - 2) * SECTORS_PER_CLUSTER, src, srcSize);
+            VHD_WriteSectors(dsk, firstDataSector + (cluster - 2) * sectorsPerCluster, src, srcSize);
 
             size -= srcSize;
             src += CLUSTER_SIZE;
@@ -348,12 +526,38 @@ static void write_file(Disk* dsk, uint16_t cluster, const void* data, size_t siz
         }
     }
 
-    if (fat[cluster] != 0xffff) {
+    if (fat[cluster] != endOfChain) {
         fprintf(stderr, "sanity check failed: invalid calculation of FAT chain.\n");
         exit(1);
     }
 }
 
+/* high word of the cluster number is only used by FAT32, on FAT16 it is always zero */
+static void set_first_cluster(fat_direntry* entry, uint32_t cluster)
+{
+    entry->firstCluster = (uint16_t)cluster;
+    entry->reserved[8] = (uint8_t)(cluster >> 16);
+    entry->reserved[9] = (uint8_t)(cluster >> 24);
+}
+
+static void add_file_entry(FSDir* parent, const char* name, uint32_t cluster, size_t size)
+{
+    Disk* dsk = parent->disk;
+
+    fat_write_lfn(parent, name);
+
+    size_t index = parent->entryCount++;
+    set_name(&parent->entries[index], name);
+    parent->entries[index].attrib = ATTR_ARCHIVE;
+    set_first_cluster(&parent->entries[index], cluster);
+    parent->entries[index].size = size;
+
+    for (size_t i = 0; i < index; i++) {
+        if (!strcmp(parent->entries[i].name, parent->entries[index].name))
+            luaL_error(dsk->L, "duplicate file name \"%s\".", name);
+    }
+}
+
 void fat_add_file(FSDir* parent, const char* name, const void* data, size_t size)
 {
     Disk* dsk = parent->disk;
@@ -363,27 +567,93 @@ void fat_add_file(FSDir* parent, const char* name, const void* data, size_t size
         exit(1);
     }
 
-    uint16_t cluster;
+    uint32_t cluster;
     if (size == 0)
         cluster = 0;
     else {
-        cluster = alloc_cluster(dsk, 2);
-        alloc_file(dsk, cluster, size);
+        const char* path = (dsk->layout ? lua_pushfstring(dsk->L, "%s%s", parent->path, name) : NULL);
+        cluster = alloc_file(dsk, path, size);
         write_file(dsk, cluster, data, size);
+        if (path)
+            lua_pop(dsk->L, 1);
     }
 
-    fat_write_lfn(parent, name);
+    add_file_entry(parent, name, cluster, size);
+}
 
-    size_t index = parent->entryCount++;
-    set_name(&parent->entries[index], name);
-    parent->entries[index].attrib = ATTR_ARCHIVE;
-    parent->entries[index].firstCluster = cluster;
-    parent->entries[index].size = size;
+/* largest cluster of any disk configuration */
+static uint8_t clusterBuffer[64 * SECTOR_SIZE];
 
-    for (size_t i = 0; i < index; i++) {
-        if (!strcmp(parent->entries[i].name, parent->entries[index].name))
-            luaL_error(dsk->L, "duplicate file name \"%s\".", name);
+void fat_add_file_from(FSDir* parent, const char* name, File* file, size_t size)
+{
+    Disk* dsk = parent->disk;
+
+    if (parent->entryCount >= MAX_DIR_ENTRIES) {
+        fprintf(stderr, "too many directory entries!\n");
+        exit(1);
+    }
+
+    assert((size_t)CLUSTER_SIZE <= sizeof(clusterBuffer));
+
+    uint32_t cluster = 0;
+    if (size != 0) {
+        const char* path = (dsk->layout ? lua_pushfstring(dsk->L, "%s%s", parent->path, name) : NULL);
+        cluster = alloc_file(dsk, path, size);
+        if (path)
+            lua_pop(dsk->L, 1);
+
+        /* same as write_file, but contents are read one cluster at a time */
+        uint32_t current = cluster;
+        size_t remaining = size;
+        for (;;) {
+            size_t srcSize = (remaining > (size_t)CLUSTER_SIZE ? (size_t)CLUSTER_SIZE : remaining);
+
+            File_Read(file, clusterBuffer, srcSize);
+            VHD_WriteSectors(dsk, firstDataSector + (current - 2) * sectorsPerCluster, clusterBuffer, srcSize);
+
+            remaining -= srcSize;
+            if (remaining == 0)
+                break;
+
+            current = fat[current];
+        }
+
+        if (fat[current] != endOfChain) {
+            fprintf(stderr, "sanity check failed: invalid calculation of FAT chain.\n");
+            exit(1);
+        }
+    }
+
+    add_file_entry(parent, name, cluster, size);
+}
+
+size_t Fat_GetClusterCount(Disk* dsk)
+{
+    DONT_WARN_UNUSED(dsk);
+    return fatSize;
+}
+
+static void fat32_write_fsinfo(Disk* dsk)
+{
+    const disk_config_t* disk_config = dsk->config;
+
+    fat32_fsinfo info;
+    memset(&info, 0, sizeof(info));
+    info.leadSignature = FAT32_FSINFO_LEAD_SIGNATURE;
+    info.structSignature = FAT32_FSINFO_STRUCT_SIGNATURE;
+    info.freeClusters = 0;
+    info.nextFreeCluster = 0xFFFFFFFF;
+    info.trailSignature = FAT32_FSINFO_TRAIL_SIGNATURE;
+
+    for (size_t i = 2; i < fatSize; i++) {
+        if (fat[i] == 0) {
+            if (info.freeClusters++ == 0)
+                info.nextFreeCluster = (uint32_t)i;
+        }
     }
+
+    VHD_WriteSectors(dsk, MBR_DISK_START + FAT32_FSINFO_SECTOR, &info, sizeof(info));
+    VHD_WriteSectors(dsk, MBR_DISK_START + FAT32_BACKUP_BOOT_SECTOR + FAT32_FSINFO_SECTOR, &info, sizeof(info));
 }
 
 void Fat_Write(Disk* dsk)
@@ -391,18 +661,37 @@ void Fat_Write(Disk* dsk)
     const disk_config_t* disk_config = dsk->config;
 
     for (FSDir* p = root_dir.next; p; p = p->next) {
-        p->cluster = alloc_cluster(dsk, 2);
-        p->entries[0].firstCluster = p->cluster;
-        p->parent->entries[p->parentIndex].firstCluster = p->cluster;
-        alloc_file(dsk, p->cluster, p->entryCount * sizeof(fat_direntry));
+        p->cluster = alloc_file(dsk, p->path, p->entryCount * sizeof(fat_direntry));
+        set_first_cluster(&p->entries[0], p->cluster);
+        set_first_cluster(&p->parent->entries[p->parentIndex], p->cluster);
     }
 
+    if (isFat32)
+        alloc_chain(dsk, root_dir.path, root_dir.entryCount * sizeof(fat_direntry), root_dir.cluster);
+
     for (FSDir* p = root_dir.next; p; p = p->next) {
-        p->entries[1].firstCluster = p->parent->cluster;
+        /* ".." of a subdirectory of the root refers to cluster 0, also on FAT32 */
+        set_first_cluster(&p->entries[1], (p->parent == &root_dir ? 0 : p->parent->cluster));
         write_file(dsk, p->cluster, p->entries, p->entryCount * sizeof(fat_direntry));
     }
 
-    VHD_WriteSectors(dsk, MBR_DISK_START + 1, fat, fatSize * sizeof(uint16_t));
-    VHD_WriteSectors(dsk, MBR_DISK_START + 1 + SECTORS_PER_FAT, fat, fatSize * sizeof(uint16_t));
-    VHD_WriteSectors(dsk, MBR_DISK_START + 1 + SECTORS_PER_FAT * 2, root_dir.entries, ROOT_DIR_SIZE);
+    if (!isFat32) {
+        uint16_t* fat16 = (uint16_t*)malloc(fatSize * sizeof(uint16_t));
+        if (!fat16) {
+            fprintf(stderr, "memory allocation failed.\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < fatSize; i++)
+            fat16[i] = (uint16_t)fat[i];
+
+        VHD_WriteSectors(dsk, MBR_DISK_START + reservedSectors, fat16, fatSize * sizeof(uint16_t));
+        VHD_WriteSectors(dsk, MBR_DISK_START + reservedSectors + sectorsPerFat, fat16, fatSize * sizeof(uint16_t));
+        VHD_WriteSectors(dsk, MBR_DISK_START + reservedSectors + sectorsPerFat * 2, root_dir.entries, ROOT_DIR_SIZE);
+        free(fat16);
+    } else {
+        write_file(dsk, root_dir.cluster, root_dir.entries, root_dir.entryCount * sizeof(fat_direntry));
+        VHD_WriteSectors(dsk, MBR_DISK_START + reservedSectors, fat, fatSize * sizeof(uint32_t));
+        VHD_WriteSectors(dsk, MBR_DISK_START + reservedSectors + sectorsPerFat, fat, fatSize * sizeof(uint32_t));
+        fat32_write_fsinfo(dsk);
+    }
 }
@@ -2,11 +2,14 @@
 #define MKDISK_FAT_H
 
 #include <mkdisk/mkdisk.h>
+#include <common/file.h>
 
 Fat* Fat_Init(Disk* dsk, const uint8_t* bootCode, FSDir** outRoot);
 void fat_normalize_name(char* dst, const char* name);
 FSDir* fat_create_directory(FSDir* parent, const char* name);
 void fat_add_file(FSDir* parent, const char* name, const void* data, size_t size);
+void fat_add_file_from(FSDir* parent, const char* name, File* file, size_t size);
+size_t Fat_GetClusterCount(Disk* dsk);
 void Fat_Write(Disk* dsk);
 
 #endif
@@ -7,6 +7,14 @@
 #define MAX_ROOT_DIR_ENTRIES 512
 #define SIGNATURE 0xAA55
 #define BOOT_CODE_SIZE 0x1C0
+#define FAT32_BOOT_CODE_SIZE 0x1A4
+
+#define FAT32_RESERVED_SECTORS 32
+#define FAT32_FSINFO_SECTOR 1
+#define FAT32_BACKUP_BOOT_SECTOR 6
+#define FAT32_FSINFO_LEAD_SIGNATURE 0x41615252
+#define FAT32_FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FAT32_FSINFO_TRAIL_SIGNATURE 0xAA550000
 
 #define ROOT_DIR_SIZE (MAX_ROOT_DIR_ENTRIES * sizeof(fat_direntry))
 #define ROOT_DIR_SECTORS ((ROOT_DIR_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE)
@@ -41,6 +49,48 @@ STRUCT(fat_bootsector) {
     uint16_t signature;
 };
 
+STRUCT(fat32_bootsector) {
+    uint8_t jump[3];
+    char oem[8];
+    uint16_t bytesPerSector;
+    uint8_t sectorsPerCluster;
+    uint16_t reservedSectors;
+    uint8_t fatCount;
+    uint16_t maxRootDirEntries;
+    uint16_t totalSectorsOld;
+    uint8_t mediaDescriptor;
+    uint16_t sectorsPerFatOld;
+    uint16_t sectorsPerTrack;
+    uint16_t headCount;
+    uint32_t hiddenSectors;
+    uint32_t totalSectors;
+    uint32_t sectorsPerFat;
+    uint16_t flags;
+    uint16_t version;
+    uint32_t rootDirCluster;
+    uint16_t fsInfoSector;
+    uint16_t backupBootSector;
+    uint8_t reserved[12];
+    uint8_t physicalDriveNumber;
+    uint8_t reserved1;
+    uint8_t extendedBootSignature;
+    uint8_t serial[4];
+    char volumeLabel[11];
+    char fileSystem[8];
+    uint8_t code[FAT32_BOOT_CODE_SIZE];
+    uint16_t signature;
+};
+
+STRUCT(fat32_fsinfo) {
+    uint32_t leadSignature;
+    uint8_t reserved1[480];
+    uint32_t structSignature;
+    uint32_t freeClusters;
+    uint32_t nextFreeCluster;
+    uint8_t reserved2[12];
+    uint32_t trailSignature;
+};
+
 STRUCT(fat_direntry) {
     char name[8];
     char ext[3];
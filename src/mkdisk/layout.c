@@ -0,0 +1,370 @@
+#include <common/common.h>
+#include <common/console.h>
+#include <common/file.h>
+#include <mkdisk/layout.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Manifest is a text file. The first line identifies the file system and its size:
+ *
+ *     pour-layout 1 <fs> <unit count> <inode count>
+ *
+ * followed by one line per file or directory (directory paths end with '/'):
+ *
+ *     <inode> <unit count> <unit>... <path>
+ *
+ * Units are listed in the order they were allocated in. For FAT, the inode is always 0.
+ */
+
+#define LAYOUT_MT "mkdisk.layout"
+#define LAYOUT_VERSION 1
+
+struct Layout
+{
+    lua_State* L;
+    const char* fsName;
+    char* file;
+    size_t unitCount;
+    size_t inodeCount;
+    uint8_t* reservedUnits;
+    uint8_t* reservedInodes;
+    bool hasReservations;
+    int pathsRef;               /* path => index in entries */
+    LayoutEntry* entries;
+    size_t entryCount;
+    uint32_t* units;
+    char* out;
+    size_t outSize;
+    size_t outCapacity;
+    char* curPath;
+    size_t curInode;
+    uint32_t* curUnits;
+    size_t curUnitCount;
+    size_t curUnitCapacity;
+};
+
+/********************************************************************************************************************/
+
+static void* growArray(lua_State* L, void* ptr, size_t* capacity, size_t needed, size_t elementSize)
+{
+    if (needed <= *capacity)
+        return ptr;
+
+    size_t newCapacity = (*capacity ? *capacity : 64);
+    while (newCapacity < needed)
+        newCapacity *= 2;
+
+    void* newPtr = realloc(ptr, newCapacity * elementSize);
+    if (!newPtr)
+        luaL_error(L, "out of memory.");
+
+    *capacity = newCapacity;
+    return newPtr;
+}
+
+static void appendOut(Layout* layout, const char* str, size_t len)
+{
+    layout->out = (char*)growArray(layout->L, layout->out,
+        &layout->outCapacity, layout->outSize + len, sizeof(char));
+    memcpy(layout->out + layout->outSize, str, len);
+    layout->outSize += len;
+}
+
+static void appendNumber(Layout* layout, size_t value, char separator)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%lu%c", (unsigned long)value, separator);
+    appendOut(layout, buf, (size_t)len);
+}
+
+/********************************************************************************************************************/
+
+static void freeEntries(Layout* layout)
+{
+    free(layout->entries);
+    layout->entries = NULL;
+    layout->entryCount = 0;
+
+    free(layout->units);
+    layout->units = NULL;
+
+    layout->hasReservations = false;
+}
+
+static bool parseNumber(const char** p, size_t* out)
+{
+    char* end;
+    unsigned long value = strtoul(*p, &end, 10);
+    if (end == *p || *end != ' ')
+        return false;
+
+    *out = (size_t)value;
+    *p = end + 1;
+    return true;
+}
+
+static bool parseManifest(Layout* layout, const char* p)
+{
+    lua_State* L = layout->L;
+    size_t unitCapacity = 0, entryCapacity = 0, unitTotal = 0;
+
+    size_t version, unitCount, inodeCount;
+    size_t fsNameLen = strlen(layout->fsName);
+    if (strncmp(p, "pour-layout ", 12) != 0)
+        return false;
+    p += 12;
+    if (!parseNumber(&p, &version) || version != LAYOUT_VERSION)
+        return false;
+    if (strncmp(p, layout->fsName, fsNameLen) != 0 || p[fsNameLen] != ' ')
+        return false;
+    p += fsNameLen + 1;
+    if (!parseNumber(&p, &unitCount) || unitCount != layout->unitCount)
+        return false;
+    char* end;
+    inodeCount = (size_t)strtoul(p, &end, 10);
+    if (end == p || *end != '\n' || inodeCount != layout->inodeCount)
+        return false;
+    p = end + 1;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, layout->pathsRef);
+
+    while (*p) {
+        size_t inode, count;
+        if (!parseNumber(&p, &inode) || !parseNumber(&p, &count) || inode > layout->inodeCount)
+            return false;
+
+        /* each unit belongs to one entry at most, so all entries together can't have more units than the disk */
+        if (count > layout->unitCount - unitTotal)
+            return false;
+
+        layout->units = (uint32_t*)growArray(L, layout->units, &unitCapacity, unitTotal + count, sizeof(uint32_t));
+        for (size_t i = 0; i < count; i++) {
+            size_t unit;
+            if (!parseNumber(&p, &unit) || unit >= layout->unitCount)
+                return false;
+
+            uint8_t bit = (uint8_t)(1 << (unit & 7));
+            if (layout->reservedUnits[unit >> 3] & bit)
+                return false;
+            layout->reservedUnits[unit >> 3] |= bit;
+
+            layout->units[unitTotal++] = (uint32_t)unit;
+        }
+
+        const char* path = p;
+        while (*p && *p != '\n')
+            ++p;
+        if (*p != '\n' || p == path)
+            return false;
+
+        layout->entries = (LayoutEntry*)growArray(L, layout->entries,
+            &entryCapacity, layout->entryCount + 1, sizeof(LayoutEntry));
+        LayoutEntry* entry = &layout->entries[layout->entryCount];
+        entry->inode = inode;
+        entry->unitCount = count;
+        entry->units = NULL; /* set below, array may still move */
+
+        lua_pushlstring(L, path, (size_t)(p - path));
+        lua_pushinteger(L, (lua_Integer)layout->entryCount++);
+        lua_rawset(L, -3);
+
+        ++p;
+    }
+
+    lua_pop(L, 1);
+
+    size_t firstUnit = 0;
+    for (size_t i = 0; i < layout->entryCount; i++) {
+        LayoutEntry* entry = &layout->entries[i];
+        entry->units = layout->units + firstUnit;
+        firstUnit += entry->unitCount;
+
+        if (entry->inode != 0)
+            layout->reservedInodes[entry->inode >> 3] |= (uint8_t)(1 << (entry->inode & 7));
+    }
+
+    layout->hasReservations = true;
+    return true;
+}
+
+static void loadManifest(Layout* layout)
+{
+    lua_State* L = layout->L;
+
+    if (!File_Exists(L, layout->file))
+        return;
+
+    int top = lua_gettop(L);
+    const char* contents = File_PushContents(L, layout->file, NULL);
+    if (!parseManifest(layout, contents)) {
+        Con_PrintF(L, COLOR_WARNING,
+            "WARNING: layout manifest \"%s\" is invalid or doesn't match the disk, ignored.\n", layout->file);
+        freeEntries(layout);
+        memset(layout->reservedUnits, 0, (layout->unitCount + 7) / 8);
+        memset(layout->reservedInodes, 0, (layout->inodeCount + 1 + 7) / 8);
+
+        lua_newtable(L);
+        lua_rawseti(L, LUA_REGISTRYINDEX, layout->pathsRef);
+    }
+
+    lua_settop(L, top);
+}
+
+/********************************************************************************************************************/
+
+static int layout_gc(lua_State* L)
+{
+    Layout* layout = (Layout*)luaL_checkudata(L, 1, LAYOUT_MT);
+
+    freeEntries(layout);
+
+    free(layout->file);
+    free(layout->reservedUnits);
+    free(layout->reservedInodes);
+    free(layout->out);
+    free(layout->curPath);
+    free(layout->curUnits);
+
+    layout->file = NULL;
+    layout->reservedUnits = NULL;
+    layout->reservedInodes = NULL;
+    layout->out = NULL;
+    layout->curPath = NULL;
+    layout->curUnits = NULL;
+
+    if (layout->pathsRef != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, layout->pathsRef);
+        layout->pathsRef = LUA_NOREF;
+    }
+
+    return 0;
+}
+
+Layout* Layout_PushNew(lua_State* L, const char* fsName, size_t unitCount, size_t inodeCount, const char* file)
+{
+    Layout* layout = (Layout*)lua_newuserdatauv(L, sizeof(Layout), 0);
+    memset(layout, 0, sizeof(Layout));
+    layout->L = L;
+    layout->fsName = fsName;
+    layout->unitCount = unitCount;
+    layout->inodeCount = inodeCount;
+    layout->pathsRef = LUA_NOREF;
+
+    if (luaL_newmetatable(L, LAYOUT_MT)) {
+        lua_pushcfunction(L, layout_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    size_t fileLen = strlen(file) + 1;
+    layout->file = (char*)malloc(fileLen);
+    layout->reservedUnits = (uint8_t*)calloc(1, (unitCount + 7) / 8);
+    layout->reservedInodes = (uint8_t*)calloc(1, (inodeCount + 1 + 7) / 8);
+    if (!layout->file || !layout->reservedUnits || !layout->reservedInodes)
+        luaL_error(L, "out of memory.");
+    memcpy(layout->file, file, fileLen);
+
+    lua_newtable(L);
+    layout->pathsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    loadManifest(layout);
+
+    char header[128];
+    int len = snprintf(header, sizeof(header), "pour-layout %d %s %lu %lu\n",
+        LAYOUT_VERSION, fsName, (unsigned long)unitCount, (unsigned long)inodeCount);
+    appendOut(layout, header, (size_t)len);
+
+    return layout;
+}
+
+void Layout_Save(Layout* layout)
+{
+    File_MaybeOverwrite(layout->L, layout->file, layout->out, layout->outSize);
+}
+
+/********************************************************************************************************************/
+
+const LayoutEntry* Layout_Find(Layout* layout, const char* path)
+{
+    lua_State* L = layout->L;
+
+    if (layout->entryCount == 0)
+        return NULL;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, layout->pathsRef);
+    lua_getfield(L, -1, path);
+    int isnum = 0;
+    lua_Integer index = lua_tointegerx(L, -1, &isnum);
+    lua_pop(L, 2);
+
+    return (isnum ? &layout->entries[index] : NULL);
+}
+
+bool Layout_IsUnitReserved(const Layout* layout, size_t unit)
+{
+    return layout->hasReservations && unit < layout->unitCount
+        && (layout->reservedUnits[unit >> 3] & (1 << (unit & 7))) != 0;
+}
+
+bool Layout_IsInodeReserved(const Layout* layout, size_t inode)
+{
+    return layout->hasReservations && inode <= layout->inodeCount
+        && (layout->reservedInodes[inode >> 3] & (1 << (inode & 7))) != 0;
+}
+
+bool Layout_ReleaseReservations(Layout* layout)
+{
+    if (!layout->hasReservations)
+        return false;
+
+    Con_Print(layout->L, COLOR_WARNING,
+        "\nWARNING: disk is full, space reserved by the layout manifest is used for other files.\n");
+
+    layout->hasReservations = false;
+    return true;
+}
+
+/********************************************************************************************************************/
+
+void Layout_BeginEntry(Layout* layout, const char* path, size_t inode)
+{
+    free(layout->curPath);
+    layout->curPath = NULL;
+    layout->curInode = inode;
+    layout->curUnitCount = 0;
+
+    /* paths with line breaks can't be stored in the manifest, such entries are simply allocated anew each time */
+    if (strchr(path, '\n'))
+        return;
+
+    size_t pathLen = strlen(path) + 1;
+    layout->curPath = (char*)malloc(pathLen);
+    if (!layout->curPath)
+        luaL_error(layout->L, "out of memory.");
+    memcpy(layout->curPath, path, pathLen);
+}
+
+void Layout_AddUnit(Layout* layout, size_t unit)
+{
+    layout->curUnits = (uint32_t*)growArray(layout->L, layout->curUnits,
+        &layout->curUnitCapacity, layout->curUnitCount + 1, sizeof(uint32_t));
+    layout->curUnits[layout->curUnitCount++] = (uint32_t)unit;
+}
+
+void Layout_EndEntry(Layout* layout)
+{
+    if (!layout->curPath)
+        return;
+
+    appendNumber(layout, layout->curInode, ' ');
+    appendNumber(layout, layout->curUnitCount, ' ');
+    for (size_t i = 0; i < layout->curUnitCount; i++)
+        appendNumber(layout, layout->curUnits[i], ' ');
+    appendOut(layout, layout->curPath, strlen(layout->curPath));
+    appendOut(layout, "\n", 1);
+
+    free(layout->curPath);
+    layout->curPath = NULL;
+}
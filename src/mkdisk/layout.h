@@ -0,0 +1,31 @@
+#ifndef MKDISK_LAYOUT_H
+#define MKDISK_LAYOUT_H
+
+#include <mkdisk/mkdisk.h>
+
+/*
+ * Layout manifest for incremental rebuilds. The clusters (FAT) or blocks and inodes (ext2) used by each file and
+ * directory are saved next to the disk image. When the image is built again, these units are reserved: new
+ * allocations avoid them as long as there is other free space, and an entry that is added again under the same
+ * path gets its old units back. Unchanged parts of the image then stay where they were.
+ */
+
+STRUCT(LayoutEntry) {
+    size_t inode;
+    size_t unitCount;
+    const uint32_t* units;
+};
+
+Layout* Layout_PushNew(lua_State* L, const char* fsName, size_t unitCount, size_t inodeCount, const char* file);
+void Layout_Save(Layout* layout);
+
+const LayoutEntry* Layout_Find(Layout* layout, const char* path);
+bool Layout_IsUnitReserved(const Layout* layout, size_t unit);
+bool Layout_IsInodeReserved(const Layout* layout, size_t inode);
+bool Layout_ReleaseReservations(Layout* layout);
+
+void Layout_BeginEntry(Layout* layout, const char* path, size_t inode);
+void Layout_AddUnit(Layout* layout, size_t unit);
+void Layout_EndEntry(Layout* layout);
+
+#endif
@@ -54,7 +54,12 @@ void MBR_Init(Disk* dsk, void* dst)
     p->entries[0].chs_start[2] = 0x00;
 
     switch (dsk->fs) {
-        case FS_FAT: p->entries[0].type = 6 /* FAT16 */; break;
+        case FS_FAT:
+            if (!dsk->fat32)
+                p->entries[0].type = 6 /* FAT16 */;
+            else
+                p->entries[0].type = (dsk->fat32Win95 ? 0x0B /* FAT32 */ : 0x0C /* FAT32 LBA */);
+            break;
         case FS_EXT2: p->entries[0].type = (dsk->mbrFAT ? 6 /* FAT16 */ : 0x83 /* linux native */); break;
     }
 
@@ -1,7 +1,9 @@
 #include <common/common.h>
 #include <common/file.h>
+#include <common/buffer.h>
 #include <common/console.h>
 #include <common/dirs.h>
+#include <common/batchio.h>
 #include <common/script.h>
 #include <mkdisk/mkdisk.h>
 #include <mkdisk/vhd.h>
@@ -9,10 +11,12 @@
 #include <mkdisk/fat.h>
 #include <mkdisk/ext2.h>
 #include <mkdisk/ext2_defs.h>
+#include <mkdisk/layout.h>
 #include <mkdisk/bootcode.h>
 #include <mkdisk/disk_config.h>
 #include <grp/grpfile.h>
 #include <patch/patch.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define CLASS_DIRECTORY "mkdisk.directory"
@@ -29,25 +33,30 @@ static char marker_LIST;
 
 /********************************************************************************************************************/
 
-static bool MkDisk_ReadMetaFile(Disk* dsk, uint16_t default_perm, const char* file, ext2_meta* out)
+/* prefetched: contents of the meta file read ahead of time, or NULL to look for the file */
+static bool MkDisk_ReadMetaFile(Disk* dsk, uint16_t default_perm, const char* file, const char* prefetched,
+    ext2_meta* out)
 {
     lua_State* L = dsk->L;
+    int n = lua_gettop(L);
 
     out->type_and_perm = default_perm;
     out->uid = 0;
     out->gid = 0;
 
-    if (!File_Exists(L, file))
-        return false;
-
-    const char* str = File_PushContents(L, file, NULL);
+    const char* str = prefetched;
+    if (!str) {
+        if (!File_Exists(L, file))
+            return false;
+        str = File_PushContents(L, file, NULL);
+    }
 
     unsigned t, u, g;
     char type;
     if (sscanf(str, "%c %o %u:%u", &type, &t, &u, &g) != 4)
         luaL_error(L, "invalid meta file: %s", file);
 
-    lua_pop(L, 1);
+    lua_settop(L, n);
 
     switch (type) {
         case 'D': out->type_and_perm = EXT2_TYPE_DIRECTORY; break;
@@ -70,33 +79,27 @@ static bool MkDisk_ReadMetaFile(Disk* dsk, uint16_t default_perm, const char* fi
     return true;
 }
 
-static void MkDisk_ReadMetaFileForDirectory(Disk* dsk, const char* dirName, ext2_meta* out)
+static void MkDisk_ReadMetaFileForDirectory(Disk* dsk, const char* dirName, const char* prefetched, ext2_meta* out)
 {
     lua_State* L = dsk->L;
     const char* buf = lua_pushfstring(L, "%s/[meta]", dirName);
 
-    MkDisk_ReadMetaFile(dsk, EXT2_TYPE_DIRECTORY | 0755, buf, out);
+    MkDisk_ReadMetaFile(dsk, EXT2_TYPE_DIRECTORY | 0755, buf, prefetched, out);
     if ((out->type_and_perm & EXT2_TYPE_MASK) != EXT2_TYPE_DIRECTORY)
         luaL_error(L, "invalid meta file for directory: %s", buf);
 
     lua_pop(L, 1);
 }
 
-static void MkDisk_ReadMetaFileForFile(Disk* dsk, const char* fileName, ext2_meta* out)
+static void MkDisk_ReadMetaFileForFile(Disk* dsk, const char* fileName, bool isElf, const char* prefetched,
+    ext2_meta* out)
 {
     lua_State* L = dsk->L;
     const char* buf = lua_pushfstring(L, "%s[meta]", fileName);
 
-    if (!MkDisk_ReadMetaFile(dsk, EXT2_TYPE_FILE | 0644, buf, out)) {
-        File* f = File_PushOpen(L, fileName, FILE_OPEN_SEQUENTIAL_READ);
-        if (File_GetSize(f) > 4) {
-            char buf[4];
-            File_Read(f, buf, 4);
-            if (buf[0] == 0x7F && buf[1] == 'E' && buf[2] == 'L' && buf[3] == 'F')
-                out->type_and_perm |= 0755;
-        }
-        File_Close(f);
-        lua_pop(L, 1);
+    if (!MkDisk_ReadMetaFile(dsk, EXT2_TYPE_FILE | 0644, buf, prefetched, out)) {
+        if (isElf)
+            out->type_and_perm |= 0755;
     }
 
     if ((out->type_and_perm & EXT2_TYPE_MASK) == EXT2_TYPE_DIRECTORY)
@@ -210,45 +213,28 @@ static const DiskDir* MkDisk_PushMakeDir(Disk* dsk, int dskIndex, const DiskDir*
 
 /********************************************************************************************************************/
 
-static void MkDisk_AddFile(Disk* dsk, const DiskDir* dstDir,
-    const char* name, const char* fileName, const uint64_t* pFileSize)
+static const char* MkDisk_GetFSName(Disk* dsk, const char* name, char* fatShortName)
 {
-    lua_State* L = dsk->L;
-
-    int n = lua_gettop(L);
-    char fatShortName[13];
-
-    if (dstDir->disk != dsk)
-        luaL_error(L, "dstDir disk mismatch!");
-
-    File* f = File_PushOpen(L, fileName, FILE_OPEN_SEQUENTIAL_READ);
-
-    const char* fsName;
     if (dsk->fs != FS_FAT || dsk->fatEnableLFN)
-        fsName = name;
-    else {
-        fat_normalize_name(fatShortName, name);
-        fsName = fatShortName;
-    }
+        return name;
 
-    if (!pFileSize)
-        Con_PrintF(L, COLOR_STATUS, "\n=> %s%s\n", dstDir->path, fsName);
-
-    PATCH* patch = patch_find(L, fsName);
+    fat_normalize_name(fatShortName, name);
+    return fatShortName;
+}
 
-    size_t fileSize;
-    if (!pFileSize)
-        fileSize = File_GetSize(f);
-    else {
-        if (*pFileSize > MAX_FILE_SIZE)
-            luaL_error(L, "file too large: %s", name);
-        fileSize = (size_t)*pFileSize;
-    }
+static bool MkDisk_IsElf(const void* data, size_t fileSize)
+{
+    const uint8_t* header = (const uint8_t*)data;
+    return (fileSize > 4 && header[0] == 0x7F && header[1] == 'E' && header[2] == 'L' && header[3] == 'F');
+}
 
-    void* ptr = lua_newuserdatauv(L, fileSize + (patch ? patch->extraBytes : 0), 0);
+static void MkDisk_AddFileData(Disk* dsk, const DiskDir* dstDir, const char* name, const char* fileName,
+    const char* prefetchedMeta, PATCH* patch, void* ptr, size_t fileSize)
+{
+    lua_State* L = dsk->L;
 
-    File_Read(f, ptr, fileSize);
-    File_Close(f);
+    /* executables without a meta file are made executable, based on the contents before patching */
+    bool isElf = MkDisk_IsElf(ptr, fileSize);
 
     if (patch)
         patch_apply(L, name, patch, &ptr, &fileSize);
@@ -259,17 +245,47 @@ static void MkDisk_AddFile(Disk* dsk, const DiskDir* dstDir,
             break;
         case FS_EXT2: {
             ext2_meta meta;
-            MkDisk_ReadMetaFileForFile(dsk, fileName, &meta);
+            MkDisk_ReadMetaFileForFile(dsk, fileName, isElf, prefetchedMeta, &meta);
             Ext2_AddFile(dsk->ext2, dstDir->dir, name, ptr, fileSize, &meta);
             break;
         }
     }
+}
 
-    lua_settop(L, n);
+/* unpatched files are copied from the source file to the disk through a fixed-size buffer */
+static void MkDisk_AddFileStream(Disk* dsk, const DiskDir* dstDir, const char* name, const char* fileName,
+    const char* prefetchedMeta, File* f, size_t fileSize)
+{
+    switch (dsk->fs) {
+        case FS_FAT:
+            fat_add_file_from(dstDir->dir, name, f, fileSize);
+            break;
+        case FS_EXT2: {
+            uint8_t header[4];
+            bool isElf = false;
+            if (fileSize > 4) {
+                File_Read(f, header, sizeof(header));
+                File_SetPosition(f, 0);
+                isElf = MkDisk_IsElf(header, fileSize);
+            }
+
+            ext2_meta meta;
+            MkDisk_ReadMetaFileForFile(dsk, fileName, isElf, prefetchedMeta, &meta);
+            Ext2_AddFileFrom(dsk->ext2, dstDir->dir, name, f, fileSize, &meta);
+            break;
+        }
+    }
 }
 
-void MkDisk_AddFileContent(Disk* dsk, const DiskDir* dstDir,
-    const char* name, const char* data, size_t dataLen)
+static size_t MkDisk_GetFileSize(Disk* dsk, File* f, const char* name)
+{
+    uint64_t size = File_GetSize(f);
+    if (size > (uint64_t)(SIZE_MAX >> 1))
+        luaL_error(dsk->L, "file too large: %s", name);
+    return (size_t)size;
+}
+
+static void MkDisk_AddFile(Disk* dsk, const DiskDir* dstDir, const char* name, const char* fileName)
 {
     lua_State* L = dsk->L;
 
@@ -279,14 +295,39 @@ void MkDisk_AddFileContent(Disk* dsk, const DiskDir* dstDir,
     if (dstDir->disk != dsk)
         luaL_error(L, "dstDir disk mismatch!");
 
-    const char* fsName;
-    if (dsk->fs != FS_FAT || dsk->fatEnableLFN)
-        fsName = name;
+    File* f = File_PushOpen(L, fileName, FILE_OPEN_SEQUENTIAL_READ);
+
+    const char* fsName = MkDisk_GetFSName(dsk, name, fatShortName);
+    Con_PrintF(L, COLOR_STATUS, "\n=> %s%s\n", dstDir->path, fsName);
+
+    PATCH* patch = patch_find(L, fsName);
+    size_t fileSize = MkDisk_GetFileSize(dsk, f, name);
+
+    if (!patch)
+        MkDisk_AddFileStream(dsk, dstDir, name, fileName, NULL, f, fileSize);
     else {
-        fat_normalize_name(fatShortName, name);
-        fsName = fatShortName;
+        Buffer* buffer = Buffer_PushNew(L, fileSize + patch->extraBytes);
+        File_Read(f, buffer->data, fileSize);
+        MkDisk_AddFileData(dsk, dstDir, name, fileName, NULL, patch, buffer->data, fileSize);
+        Buffer_Close(buffer);
     }
 
+    File_Close(f);
+    lua_settop(L, n);
+}
+
+void MkDisk_AddFileContent(Disk* dsk, const DiskDir* dstDir,
+    const char* name, const char* data, size_t dataLen)
+{
+    lua_State* L = dsk->L;
+
+    int n = lua_gettop(L);
+    char fatShortName[13];
+
+    if (dstDir->disk != dsk)
+        luaL_error(L, "dstDir disk mismatch!");
+
+    const char* fsName = MkDisk_GetFSName(dsk, name, fatShortName);
     Con_PrintF(L, COLOR_STATUS, "\n=> %s%s (generated)\n", dstDir->path, fsName);
 
     switch (dsk->fs) {
@@ -315,21 +356,166 @@ typedef enum recursive_t {
     NON_RECURSIVE,
 } recursive_t;
 
-static void MkDisk_ScanDir(Disk* dsk, int dskIndex,
-    const char* prefix, const DiskDir* d, int dirIndex, const char* path, recursive_t recursive)
+/*
+ * add_directory works in two stages. The source tree is walked first, recording the directories and files to add
+ * in order. Then a pool of worker threads reads the files and their meta files ahead, while the calling thread
+ * lays them out on the disk in walk order, so that the image doesn't depend on which read completes first.
+ */
+
+#define CLASS_SCAN_LIST "mkdisk.scanlist"
+
+/* how much file contents may be read ahead of the layout */
+#define SCAN_READ_AHEAD_BYTES (64u << 20)
+
+/* large unpatched files are not read ahead, but streamed to the disk instead */
+#define SCAN_STREAM_MIN_BYTES (8u << 20)
+
+#define NO_REQUEST ((size_t)-1)
+
+typedef enum scanop_t {
+    SCAN_ENTER_DIR,
+    SCAN_LEAVE_DIR,
+    SCAN_FILE,
+    SCAN_STREAM_FILE,
+} scanop_t;
+
+STRUCT(ScanOp) {
+    scanop_t op;
+    char* path;
+    size_t nameOffset;
+    size_t request;             /* FILE: contents */
+    size_t metaRequest;         /* ENTER_DIR, FILE, STREAM_FILE: [meta] file, or NO_REQUEST */
+};
+
+STRUCT(ScanList) {
+    ScanOp* ops;
+    size_t count;
+    size_t capacity;
+};
+
+static int MkDisk_ScanListGC(lua_State* L)
+{
+    ScanList* list = (ScanList*)luaL_checkudata(L, 1, CLASS_SCAN_LIST);
+
+    for (size_t i = 0; i < list->count; i++)
+        free(list->ops[i].path);
+    free(list->ops);
+
+    list->ops = NULL;
+    list->count = 0;
+    list->capacity = 0;
+
+    return 0;
+}
+
+static ScanList* MkDisk_PushScanList(lua_State* L)
+{
+    ScanList* list = (ScanList*)lua_newuserdatauv(L, sizeof(ScanList), 0);
+    memset(list, 0, sizeof(ScanList));
+
+    if (luaL_newmetatable(L, CLASS_SCAN_LIST)) {
+        lua_pushcfunction(L, MkDisk_ScanListGC);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    return list;
+}
+
+static size_t MkDisk_AddScanOp(lua_State* L, ScanList* list, scanop_t op, const char* path, size_t nameOffset)
+{
+    if (list->count == list->capacity) {
+        size_t newCapacity = (list->capacity ? list->capacity * 2 : 256);
+        ScanOp* newOps = (ScanOp*)realloc(list->ops, newCapacity * sizeof(ScanOp));
+        if (!newOps)
+            luaL_error(L, "out of memory.");
+        list->ops = newOps;
+        list->capacity = newCapacity;
+    }
+
+    size_t pathLen = strlen(path) + 1;
+    char* pathCopy = (char*)malloc(pathLen);
+    if (!pathCopy)
+        luaL_error(L, "out of memory.");
+    memcpy(pathCopy, path, pathLen);
+
+    ScanOp* p = &list->ops[list->count];
+    p->op = op;
+    p->path = pathCopy;
+    p->nameOffset = nameOffset;
+    p->request = NO_REQUEST;
+    p->metaRequest = NO_REQUEST;
+
+    return list->count++;
+}
+
+static int MkDisk_CompareNames(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/* enterOp: operation that creates the directory being walked, or NO_REQUEST */
+static void MkDisk_WalkDir(Disk* dsk, ScanList* list, BatchIO* batch,
+    const char* prefix, const char* path, recursive_t recursive, size_t enterOp)
 {
     lua_State* L = dsk->L;
     int top = lua_gettop(L);
 
-    if (d->disk != dsk)
-        luaL_error(L, "dir disk mismatch!");
+    const char* dirPath = lua_pushfstring(L, "%s%s", prefix, path);
+    size_t nameOffset = strlen(dirPath);
 
-    Dir* it = File_PushOpenDir(L, lua_pushfstring(L, "%s%s", prefix, path));
+    /* directory is listed completely first, so that [meta] files are known without probing for them */
+    lua_newtable(L);
+    int namesIndex = lua_gettop(L);
+    lua_newtable(L);
+    int nameSetIndex = lua_gettop(L);
+    int nameCount = 0;
 
+    Dir* it = File_PushOpenDir(L, dirPath);
     for (;;) {
         const char* d_name = File_ReadDir(it);
         if (!d_name)
             break;
+        lua_pushstring(L, d_name);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, namesIndex, ++nameCount);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, nameSetIndex);
+    }
+    File_CloseDir(it);
+
+    /* in sorted mode, entries are taken in byte order of their names instead of the order the OS lists them in */
+    const char** sortedNames = NULL;
+    if (dsk->sorted && nameCount > 0) {
+        sortedNames = (const char**)lua_newuserdatauv(L, (size_t)nameCount * sizeof(const char*), 0);
+        for (int i = 1; i <= nameCount; i++) {
+            lua_rawgeti(L, namesIndex, i);
+            sortedNames[i - 1] = lua_tostring(L, -1); /* still referenced by the names table */
+            lua_pop(L, 1);
+        }
+        qsort(sortedNames, (size_t)nameCount, sizeof(const char*), MkDisk_CompareNames);
+    }
+
+    bool wantMeta = (dsk->fs == FS_EXT2);
+    if (wantMeta && enterOp != NO_REQUEST) {
+        lua_getfield(L, nameSetIndex, "[meta]");
+        if (lua_toboolean(L, -1)) {
+            const char* metaPath = lua_pushfstring(L, "%s[meta]", dirPath);
+            list->ops[enterOp].metaRequest = BatchIO_AddRead(L, batch, metaPath, 0);
+        }
+    }
+
+    int loopTop = lua_gettop(L);
+
+    for (int i = 1; i <= nameCount; i++) {
+        lua_settop(L, loopTop);
+        const char* d_name;
+        if (sortedNames)
+            d_name = sortedNames[i - 1];
+        else {
+            lua_rawgeti(L, namesIndex, i);
+            d_name = lua_tostring(L, -1);
+        }
 
         size_t d_name_len = strlen(d_name);
         if (d_name_len == 1 && d_name[0] == '.')
@@ -352,25 +538,17 @@ static void MkDisk_ScanDir(Disk* dsk, int dskIndex,
 
         if (isDir) {
             if (recursive != NON_RECURSIVE) {
-                int top2 = lua_gettop(L);
-
-                const DiskDir* subdir;
-                int subdirIndex;
-
-                if (recursive == RECURSIVE_FLAT || recursive == RECURSIVE_FLAT_SKIP_CMAKE) {
-                    subdir = d;
-                    subdirIndex = dirIndex;
-                } else {
-                    ext2_meta meta;
-                    MkDisk_ReadMetaFileForDirectory(dsk, buf, &meta);
-                    subdir = MkDisk_PushMakeDir(dsk, dskIndex, d, dirIndex, d_name, &meta);
-                    subdirIndex = lua_gettop(L);
-                }
+                bool flat = (recursive == RECURSIVE_FLAT || recursive == RECURSIVE_FLAT_SKIP_CMAKE);
+
+                size_t subdirOp = NO_REQUEST;
+                if (!flat)
+                    subdirOp = MkDisk_AddScanOp(L, list, SCAN_ENTER_DIR, buf, nameOffset);
 
                 const char* subname = lua_pushfstring(L, "%s%s/", path, d_name);
-                MkDisk_ScanDir(dsk, dskIndex, prefix, subdir, subdirIndex, subname, recursive);
+                MkDisk_WalkDir(dsk, list, batch, prefix, subname, recursive, subdirOp);
 
-                lua_settop(L, top2);
+                if (!flat)
+                    MkDisk_AddScanOp(L, list, SCAN_LEAVE_DIR, buf, nameOffset);
             }
         } else {
             /* ignore files ending with '[meta]' */
@@ -378,21 +556,129 @@ static void MkDisk_ScanDir(Disk* dsk, int dskIndex,
             if (len >= 5 && !memcmp(d_name + len - 6, "[meta]", 6))
                 continue;
 
-            Con_Print(L, COLOR_PROGRESS, "+");
-            Con_Flush(L);
+            char fatShortName[13];
+            PATCH* patch = patch_find(L, MkDisk_GetFSName(dsk, d_name, fatShortName));
 
-            MkDisk_AddFile(dsk, d, d_name, buf, &fileSize);
-        }
+            size_t op;
+            if (!patch && fileSize >= SCAN_STREAM_MIN_BYTES)
+                op = MkDisk_AddScanOp(L, list, SCAN_STREAM_FILE, buf, nameOffset);
+            else {
+                op = MkDisk_AddScanOp(L, list, SCAN_FILE, buf, nameOffset);
+                list->ops[op].request = BatchIO_AddRead(L, batch, buf, (patch ? patch->extraBytes : 0));
+            }
 
-        lua_pop(L, 1);
+            if (wantMeta) {
+                lua_pushfstring(L, "%s[meta]", d_name);
+                if (lua_rawget(L, nameSetIndex) != LUA_TNIL) {
+                    const char* metaPath = lua_pushfstring(L, "%s[meta]", buf);
+                    list->ops[op].metaRequest = BatchIO_AddRead(L, batch, metaPath, 0);
+                }
+            }
+        }
     }
 
-    File_CloseDir(it);
     lua_settop(L, top);
 }
 
+static const char* MkDisk_WaitForMeta(lua_State* L, BatchIO* batch, size_t request)
+{
+    if (request == NO_REQUEST)
+        return NULL;
+
+    BatchRequest* meta = BatchIO_Wait(batch, request);
+    BatchIO_Check(L, meta);
+
+    char* str = (char*)meta->data;
+    str[meta->size] = 0;
+    return str;
+}
+
+static void MkDisk_LayoutScanList(Disk* dsk, int dskIndex, int dirIndex, ScanList* list, BatchIO* batch)
+{
+    lua_State* L = dsk->L;
+    char fatShortName[13];
+
+    /* directory that receives the files is always at the top of the stack */
+    lua_pushvalue(L, dirIndex);
+    int base = lua_gettop(L);
+
+    BatchIO_Start(L, batch, SCAN_READ_AHEAD_BYTES);
+
+    for (size_t i = 0; i < list->count; i++) {
+        const ScanOp* op = &list->ops[i];
+        int curIndex = lua_gettop(L);
+        const DiskDir* cur = MkDisk_GetDirectory(L, curIndex);
+        const char* name = op->path + op->nameOffset;
+
+        switch (op->op) {
+            case SCAN_ENTER_DIR: {
+                luaL_checkstack(L, 4, "MkDisk_LayoutScanList");
+
+                ext2_meta meta;
+                const char* prefetched = MkDisk_WaitForMeta(L, batch, op->metaRequest);
+                MkDisk_ReadMetaFileForDirectory(dsk, op->path, prefetched, &meta);
+                if (prefetched)
+                    BatchIO_Release(batch, op->metaRequest);
+
+                MkDisk_PushMakeDir(dsk, dskIndex, cur, curIndex, name, &meta);
+                break;
+            }
+
+            case SCAN_LEAVE_DIR:
+                lua_pop(L, 1);
+                break;
+
+            case SCAN_FILE: {
+                Con_Print(L, COLOR_PROGRESS, "+");
+                Con_Flush(L);
+
+                BatchRequest* request = BatchIO_Wait(batch, op->request);
+                BatchIO_Check(L, request);
+                const char* prefetched = MkDisk_WaitForMeta(L, batch, op->metaRequest);
+
+                PATCH* patch = patch_find(L, MkDisk_GetFSName(dsk, name, fatShortName));
+                MkDisk_AddFileData(dsk, cur, name, op->path, prefetched, patch, request->data, request->size);
+
+                BatchIO_Release(batch, op->request);
+                if (prefetched)
+                    BatchIO_Release(batch, op->metaRequest);
+                break;
+            }
+
+            case SCAN_STREAM_FILE: {
+                Con_Print(L, COLOR_PROGRESS, "+");
+                Con_Flush(L);
+
+                const char* prefetched = MkDisk_WaitForMeta(L, batch, op->metaRequest);
+
+                File* f = File_PushOpen(L, op->path, FILE_OPEN_SEQUENTIAL_READ);
+                MkDisk_AddFileStream(dsk, cur, name, op->path, prefetched, f, MkDisk_GetFileSize(dsk, f, name));
+                File_Close(f);
+                lua_pop(L, 1);
+
+                if (prefetched)
+                    BatchIO_Release(batch, op->metaRequest);
+                break;
+            }
+        }
+    }
+
+    BatchIO_Finish(batch);
+
+    assert(lua_gettop(L) == base);
+    lua_settop(L, base - 1);
+}
+
 /****************************************************************************/
 
+#define USERVAL_FILE_NAME 1
+#define USERVAL_ROOT_DIRECTORY 2
+#define USERVAL_FILESYSTEM 3
+#define USERVAL_LAYOUT 4
+
+/* timestamp of files on ext2 disks in sorted mode: 2000-01-01 00:00:00 UTC */
+#define SORTED_DEFAULT_TIME 946684800
+
 static int mkdisk_enable_lfn(lua_State* L)
 {
     Disk* dsk = (Disk*)luaL_checkudata(L, 1, CLASS_DISK);
@@ -400,6 +686,67 @@ static int mkdisk_enable_lfn(lua_State* L)
     return 0;
 }
 
+/*
+ * Places files and directories where they were in the previous build of the same disk, as recorded in the layout
+ * manifest (by default "<output file>.layout"), so that unchanged files don't move around in the image. Has to be
+ * called before anything is added to the disk.
+ */
+static int mkdisk_enable_incremental(lua_State* L)
+{
+    const int dskIndex = 1;
+    Disk* dsk = (Disk*)luaL_checkudata(L, dskIndex, CLASS_DISK);
+    if (dsk->built)
+        return luaL_error(L, "enable_incremental(): already finished.");
+    if (dsk->layout)
+        return luaL_error(L, "enable_incremental(): already enabled.");
+
+    const char* file;
+    if (lua_isnoneornil(L, 2))
+        file = lua_pushfstring(L, "%s.layout", dsk->outFile);
+    else {
+        char fileName[DIR_MAX];
+        Script_GetString(L, 2, fileName, sizeof(fileName), "layout file name is too long");
+        file = Dir_PushAbsolutePath(L, fileName);
+    }
+
+    switch (dsk->fs) {
+        case FS_FAT:
+            dsk->layout = Layout_PushNew(L, (dsk->fat32 ? "fat32" : "fat16"), Fat_GetClusterCount(dsk), 0, file);
+            break;
+        case FS_EXT2:
+            dsk->layout = Layout_PushNew(L, "ext2",
+                Ext2_GetBlockCount(dsk->ext2), Ext2_GetInodeCount(dsk->ext2), file);
+            break;
+    }
+
+    lua_setiuservalue(L, dskIndex, USERVAL_LAYOUT);
+    return 0;
+}
+
+/*
+ * Makes the image a function of its inputs only:
+ *
+ *  - add_directory() adds the entries of each source directory in byte order of their names, depth first;
+ *  - FAT clusters, ext2 inodes and ext2 blocks of files are taken first-fit, lowest number first, in the order files
+ *    are added; blocks of directories are taken the same way when the disk is written, in the order directories
+ *    were created;
+ *  - ext2 timestamps are set to the given time (default is 2000-01-01 00:00:00 UTC) instead of the current date;
+ *  - VHD blocks are stored in the order of their disk offsets.
+ */
+static int mkdisk_enable_sorted(lua_State* L)
+{
+    Disk* dsk = (Disk*)luaL_checkudata(L, 1, CLASS_DISK);
+    lua_Integer t = luaL_optinteger(L, 2, SORTED_DEFAULT_TIME);
+    if (dsk->built)
+        return luaL_error(L, "enable_sorted(): already finished.");
+
+    dsk->sorted = true;
+    if (dsk->ext2)
+        Ext2_SetTime(dsk->ext2, (time_t)t);
+
+    return 0;
+}
+
 static int mkdisk_add_directory(lua_State* L)
 {
     size_t srcDirLen;
@@ -439,8 +786,11 @@ static int mkdisk_add_directory(lua_State* L)
         srcDir = lua_tolstring(L, -1, &srcDirLen);
     }
 
-    luaL_checkstack(L, 1000, "MkDisk_ScanDir");
-    MkDisk_ScanDir(dsk, dskIndex, srcDir, dstDir, dstDirIndex, "", recursive);
+    luaL_checkstack(L, 1000, "MkDisk_WalkDir");
+    ScanList* list = MkDisk_PushScanList(L);
+    BatchIO* batch = BatchIO_PushNew(L);
+    MkDisk_WalkDir(dsk, list, batch, srcDir, "", recursive, NO_REQUEST);
+    MkDisk_LayoutScanList(dsk, dskIndex, dstDirIndex, list, batch);
 
     Con_Print(L, COLOR_PROGRESS_SIDE, "]\n");
 
@@ -481,7 +831,7 @@ static int mkdisk_add_file(lua_State* L)
     if (dsk->built)
         return luaL_error(L, "add_file(): already finished.");
 
-    MkDisk_AddFile(dsk, dstDir, name, srcPath, NULL);
+    MkDisk_AddFile(dsk, dstDir, name, srcPath);
     return 0;
 }
 
@@ -491,7 +841,7 @@ static int mkdisk_add_file_content(lua_State* L)
     Disk* dsk = (Disk*)luaL_checkudata(L, 1, CLASS_DISK);
     const DiskDir* dstDir = MkDisk_GetDirectory(L, 2);
     const char* name = luaL_checkstring(L, 3);
-    const char* content = luaL_checklstring(L, 4, &contentLen);
+    const char* content = Buffer_CheckBytes(L, 4, &contentLen);
 
     if (dstDir->disk != dsk)
         luaL_error(L, "dstDir disk mismatch!");
@@ -510,6 +860,11 @@ static void MkDisk_EnsureDiskBuilt(Disk* dsk)
             case FS_FAT: Fat_Write(dsk); break;
             case FS_EXT2: Ext2_Write(dsk->ext2); break;
         }
+        /* the layout of the image file itself should not depend on the order files were written in either */
+        if (dsk->layout || dsk->sorted)
+            VHD_OrderBlocksByIndex(dsk);
+        if (dsk->layout)
+            Layout_Save(dsk->layout);
         dsk->built = true;
     }
 }
@@ -607,6 +962,8 @@ static int mkdisk_destructor(lua_State* L)
 
 static const luaL_Reg disk_funcs[] = {
     { "enable_lfn", mkdisk_enable_lfn },
+    { "enable_incremental", mkdisk_enable_incremental },
+    { "enable_sorted", mkdisk_enable_sorted },
     { "add_directory", mkdisk_add_directory },
     { "make_directory", mkdisk_make_directory },
     { "add_file", mkdisk_add_file },
@@ -618,9 +975,29 @@ static const luaL_Reg disk_funcs[] = {
     { NULL, NULL }
 };
 
-#define USERVAL_FILE_NAME 1
-#define USERVAL_ROOT_DIRECTORY 2
-#define USERVAL_FILESYSTEM 3
+/* "<number>" in bytes, or "<number>k", "<number>m", "<number>g" */
+static bool MkDisk_ParseSize(const char* str, long long* outSize)
+{
+    char* end;
+    long long value = strtoll(str, &end, 10);
+    if (end == str || value <= 0)
+        return false;
+
+    int shift = 0;
+    switch (*end) {
+        case 0: break;
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        default: return false;
+    }
+
+    if (*end || value > (DISK_CONFIG_MAX_SIZE >> shift))
+        return false;
+
+    *outSize = value << shift;
+    return true;
+}
 
 static int mkdisk_create(lua_State* L)
 {
@@ -629,15 +1006,19 @@ static int mkdisk_create(lua_State* L)
     const char* size = luaL_checkstring(L, 2);
     const char* boot = luaL_checkstring(L, 3);
 
-    Disk* dsk = (Disk*)lua_newuserdatauv(L, sizeof(Disk), 3);
+    Disk* dsk = (Disk*)lua_newuserdatauv(L, sizeof(Disk), 4);
     int resultIdx = lua_gettop(L);
 
     dsk->L = L;
     dsk->name = NULL;
     dsk->mbrFAT = false;
+    dsk->fat32 = false;
+    dsk->fat32Win95 = false;
     dsk->fatEnableLFN = false;
+    dsk->sorted = false;
     dsk->ext2 = NULL;
     dsk->fat = NULL;
+    dsk->layout = NULL;
     dsk->inList = false;
     dsk->built = false;
 
@@ -648,24 +1029,13 @@ static int mkdisk_create(lua_State* L)
     dsk->outFile = Dir_PushAbsolutePath(L, fileName);
     lua_setiuservalue(L, resultIdx, USERVAL_FILE_NAME);
 
-    if (!strcmp(size, "3m"))
-        dsk->config = &disk_3M;
-    else if (!strcmp(size, "20m"))
-        dsk->config = &disk_20M;
-    else if (!strcmp(size, "100m"))
-        dsk->config = &disk_100M;
-    else if (!strcmp(size, "400m"))
-        dsk->config = &disk_400M;
-    else if (!strcmp(size, "500m"))
-        dsk->config = &disk_500M;
-    else if (!strcmp(size, "510m"))
-        dsk->config = &disk_510M;
-    else if (!strcmp(size, "520m"))
-        dsk->config = &disk_520M;
-    else if (!strcmp(size, "1g"))
-        dsk->config = &disk_1G;
-    else
-        return luaL_error(L, "disk:create(): invalid disk size.");
+    dsk->config = DiskConfig_FindPreset(size);
+    if (!dsk->config) {
+        long long bytes;
+        if (!MkDisk_ParseSize(size, &bytes) || !DiskConfig_Compute(&dsk->customConfig, bytes))
+            return luaL_error(L, "disk:create(): invalid disk size.");
+        dsk->config = &dsk->customConfig;
+    }
 
     const uint8_t* bootCode = NULL;
     if (!strcmp(boot, "fat16"))
@@ -674,6 +1044,10 @@ static int mkdisk_create(lua_State* L)
         dsk->fs = FS_FAT, bootCode = bootCode95;
     else if (!strcmp(boot, "fat16-nt3.1"))
         dsk->fs = FS_FAT, bootCode = bootCodeNT;
+    else if (!strcmp(boot, "fat32"))
+        dsk->fs = FS_FAT, dsk->fat32 = true, bootCode = bootCodeNone32;
+    else if (!strcmp(boot, "fat32-win95"))
+        dsk->fs = FS_FAT, dsk->fat32 = true, dsk->fat32Win95 = true, bootCode = bootCodeNone32;
     else if (!strcmp(boot, "ext2"))
         dsk->fs = FS_EXT2;
     else if (!strcmp(boot, "ext2;mbr=fat"))
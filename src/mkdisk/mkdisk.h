@@ -2,33 +2,38 @@
 #define MKDISK_MKDISK_H
 
 #include <common/common.h>
+#include <mkdisk/disk_config.h>
 
 typedef enum fs_t {
     FS_FAT,
     FS_EXT2,
 } fs_t;
 
-struct disk_config_t;
-
 STRUCT(Ext2);
 STRUCT(Fat);
 STRUCT(FSDir);
+STRUCT(Layout);
 
 STRUCT(Disk) {
     Disk* prev;
     Disk* next;
     lua_State* L;
-    const struct disk_config_t* config;
+    const disk_config_t* config;
     const char* name;
     const char* outFile;
     Fat* fat;
     Ext2* ext2;
+    Layout* layout;
     lua_Integer ref;
     fs_t fs;
     bool mbrFAT;
+    bool fat32;
+    bool fat32Win95;
     bool fatEnableLFN;
+    bool sorted;
     bool inList;
     bool built;
+    disk_config_t customConfig; /* when not created with one of the presets */
 };
 
 STRUCT(DiskDir) {
@@ -123,6 +123,33 @@ uint8_t* VHD_Sector(Disk* dsk, size_t index)
     return &block->data.data[sectorIndex * VHD_SECTOR_SIZE];
 }
 
+/* blocks are normally stored in the order they were first written to; this puts them in the order of disk offsets */
+void VHD_OrderBlocksByIndex(Disk* dsk)
+{
+    const disk_config_t* disk_config = dsk->config;
+    nextOffset = disk_config->vhd_next_offset;
+
+    first = NULL;
+    last = NULL;
+
+    for (size_t i = 0; i < (size_t)disk_config->vhd_bat_size; i++) {
+        vhd_blockchain* block = blocks[i];
+        if (!block)
+            continue;
+
+        bat[i] = MSB32(nextOffset);
+        block->offset = nextOffset * VHD_SECTOR_SIZE;
+        nextOffset += sizeof(vhd_block) / VHD_SECTOR_SIZE;
+
+        block->next = NULL;
+        if (!first)
+            first = block;
+        else
+            last->next = block;
+        last = block;
+    }
+}
+
 static const uint8_t zeros[VHD_SECTOR_SIZE];
 
 const uint8_t* vhd_read_sector(size_t index)
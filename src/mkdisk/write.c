@@ -1,6 +1,7 @@
 #include <common/common.h>
 #include <common/console.h>
 #include <common/file.h>
+#include <common/buffer.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +13,8 @@ struct Write
     const char* fileName;
     char* dst;
     const char* dstEnd;
+    Buffer* oldBuf;
+    Buffer* newBuf;
     char* oldBuffer;
     char* newBuffer;
     size_t oldSize;
@@ -98,10 +101,32 @@ static bool try_load_existing_file(Write* wr)
     if (!File_Exists(L, wr->fileName))
         return false;
 
-    wr->oldBuffer = File_PushContents(L, wr->fileName, &wr->oldSize);
+    wr->oldBuf = File_PushMapped(L, wr->fileName, FILE_ACCESS_SEQUENTIAL);
+    wr->oldBuffer = wr->oldBuf->data;
+    wr->oldSize = wr->oldBuf->size;
     return true;
 }
 
+static void release_old_buffer(Write* wr)
+{
+    if (wr->oldBuf) {
+        Buffer_Close(wr->oldBuf);
+        wr->oldBuf = NULL;
+    }
+
+    wr->oldBuffer = NULL;
+}
+
+static void release_buffers(Write* wr)
+{
+    release_old_buffer(wr);
+    Buffer_Close(wr->newBuf);
+
+    wr->newBuffer = NULL;
+    wr->dst = NULL;
+    wr->dstEnd = NULL;
+}
+
 static void full_write_file(Write* wr)
 {
     lua_State* L = wr->L;
@@ -111,6 +136,9 @@ static void full_write_file(Write* wr)
     Con_PrintF(L, COLOR_STATUS, "%s disk file: ", (wr->oldBuffer ? "Overwriting" : "Writing"));
     Con_Flush(L);
 
+    /* existing file is mapped, it can't be replaced on Windows otherwise */
+    release_old_buffer(wr);
+
     File_OverwriteSparse(L, wr->fileName, wr->newBuffer, wr->newSize);
 
     Con_Print(L, COLOR_SUCCESS, "Done.\n");
@@ -119,6 +147,14 @@ static void full_write_file(Write* wr)
 
 #define MIN_OVERWRITE 512 /* to avoid thrashing */
 
+static bool differs_soon(const char* pOrig, const char* pNew, const char* pOrigEnd)
+{
+    size_t count = pOrigEnd - pOrig;
+    if (count > MIN_OVERWRITE)
+        count = MIN_OVERWRITE;
+    return memcmp(pOrig, pNew, count) != 0;
+}
+
 static void partial_update_file(Write* wr, File* file)
 {
     lua_State* L = wr->L;
@@ -148,17 +184,18 @@ static void partial_update_file(Write* wr, File* file)
         indicator_add(wr, skipped, 0);
         skipped = 0;
 
-        /* calculate amount of bytes to overwrite */
+        /* calculate amount of bytes to overwrite; short matching gaps are included, so that long zeroed
+           ranges reach File_Write in one piece and become holes in the file */
         const char* start = pNew;
         do {
             ++pOrig;
             ++pNew;
-        } while (pOrig < pOrigEnd && (*pOrig != *pNew || (pNew - start) < MIN_OVERWRITE));
+        } while (pOrig < pOrigEnd
+            && (*pOrig != *pNew || (pNew - start) < MIN_OVERWRITE || differs_soon(pOrig, pNew, pOrigEnd)));
 
         size_t offset = start - wr->newBuffer;
         size_t count = pNew - start;
-        File_SetPosition(file, offset);
-        File_Write(file, wr->newBuffer + offset, count);
+        File_WriteAt(file, offset, wr->newBuffer + offset, count);
         indicator_add(wr, 0, count);
     }
 
@@ -167,8 +204,7 @@ static void partial_update_file(Write* wr, File* file)
     if (pNew < pNewEnd) {
         size_t offset = pNew - wr->newBuffer;
         size_t count = pNewEnd - pNew;
-        File_SetPosition(file, offset);
-        File_Write(file, wr->newBuffer + offset, count);
+        File_WriteAt(file, offset, wr->newBuffer + offset, count);
         indicator_add(wr, 0, count);
     }
 
@@ -196,20 +232,14 @@ static void validate_written_file(Write* wr)
 {
     lua_State* L = wr->L;
 
-    if (wr->newSize > wr->oldSize)
-        wr->oldBuffer = (char*)lua_newuserdatauv(L, wr->newSize, 0);
+    release_old_buffer(wr);
 
-    File* file = File_PushOpen(L, wr->fileName, FILE_OPEN_SEQUENTIAL_READ);
-    if (File_GetSize(file) != wr->newSize) {
-        File_Close(file);
-        goto failed;
-    }
-
-    File_Read(file, wr->oldBuffer, wr->newSize);
-    File_Close(file);
+    Buffer* written = File_PushMapped(L, wr->fileName, FILE_ACCESS_SEQUENTIAL);
+    bool identical = (written->size == wr->newSize && !memcmp(written->data, wr->newBuffer, wr->newSize));
+    Buffer_Close(written);
+    lua_pop(L, 1);
 
-    if (memcmp(wr->oldBuffer, wr->newBuffer, wr->newSize) != 0) {
-      failed:
+    if (!identical) {
         File_TryDelete(L, wr->fileName);
         luaL_error(L, "**** VALIDATION FAILED -- WRITTEN FILE MISMATCH! ****");
     }
@@ -219,11 +249,15 @@ static void validate_written_file(Write* wr)
 
 Write* Write_Begin(lua_State* L, const char* file, size_t fileSize)
 {
-    Write* wr = (Write*)lua_newuserdatauv(L, sizeof(Write) + fileSize, 0);
-    char* newBuffer = (char*)(wr + 1);
-
+    Write* wr = (Write*)lua_newuserdatauv(L, sizeof(Write), 1);
     memset(wr, 0, sizeof(Write));
+
+    Buffer* newBuf = Buffer_PushNew(L, fileSize);
+    lua_setiuservalue(L, -2, 1);
+    char* newBuffer = newBuf->data;
+
     wr->L = L;
+    wr->newBuf = newBuf;
     wr->fileName = file;
     wr->dst = newBuffer;
     wr->dstEnd = newBuffer + fileSize;
@@ -262,24 +296,32 @@ void Write_Commit(Write* wr)
         Con_Print(L, COLOR_SEPARATOR, "\n===============================================\n");
         Con_Print(L, COLOR_SUCCESS,     " Existing disk file is identical, not writing.\n");
         Con_Print(L, COLOR_SEPARATOR,   "===============================================\n\n");
+        release_buffers(wr);
         return;
     }
 
     File* file = File_PushOpen(L, wr->fileName, FILE_OPEN_MODIFY);
     File_MakeSparse(file);
 
-    if (wr->newSize < wr->oldSize) {
+    /* the old file is truncated after the update, it can't be done while it is still mapped */
+    bool truncate = (wr->newSize < wr->oldSize);
+    if (truncate)
+        wr->oldSize = wr->newSize;
+
+    partial_update_file(wr, file);
+
+    if (truncate) {
+        release_old_buffer(wr);
         if (!File_TrySetSize(file, wr->newSize)) {
+            File_Close(file);
             full_write_file(wr);
             goto validate;
         }
-
-        wr->oldSize = wr->newSize;
     }
 
-    partial_update_file(wr, file);
     File_Close(file);
 
   validate:
     validate_written_file(wr);
+    release_buffers(wr);
 }
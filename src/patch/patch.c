@@ -1,4 +1,5 @@
 #include <common/common.h>
+#include <common/buffer.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -11,6 +12,14 @@ static const char g_table;
 
 static const char* pinned_string(lua_State* L, int index, size_t* len)
 {
+    Buffer* buffer = Buffer_Test(L, index);
+    if (buffer) {
+        /* keep the storage even if the buffer gets closed */
+        const char* data = Buffer_CheckBytes(L, index, len);
+        Buffer_Retain(buffer);
+        return data;
+    }
+
     const char* str = luaL_checklstring(L, index, len);
     lua_pushvalue(L, index);
     luaL_ref(L, LUA_REGISTRYINDEX);
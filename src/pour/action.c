@@ -0,0 +1,359 @@
+#include <pour/action.h>
+#include <common/console.h>
+#include <common/dirs.h>
+#include <common/env.h>
+#include <common/file.h>
+#include <common/hash.h>
+#include <common/hashcache.h>
+#include <string.h>
+
+/*
+ * Action database is stored in file ".pour-actions" in the current directory. It is a text file with lines:
+ *
+ *   A <action id> <key> <outputs hash>
+ *
+ * Action id identifies the command line and the set of declared outputs. Key additionally covers tool identity
+ * and contents of all declared inputs. File contents are hashed through the shared hash cache (see hashcache.c).
+ */
+
+#define ACTIONS_FILE ".pour-actions"
+#define ACTIONS_HEADER "# pour action database, do not edit\n"
+
+#define ACTION_RECORD_LENGTH (2 * HASH_STRING_LENGTH - 1)
+
+static char ACTIONS;
+
+/********************************************************************************************************************/
+
+static void loadDatabase(lua_State* L, int dbIdx, const char* path)
+{
+    int n = lua_gettop(L);
+
+    if (!File_Exists(L, path))
+        return;
+
+    const char* p = File_PushContentsAsString(L, path);
+
+    lua_getfield(L, dbIdx, "actions");
+    int actionsIdx = lua_gettop(L);
+    while (*p) {
+        const char* end = strchr(p, '\n');
+        if (!end)
+            end = p + strlen(p);
+
+        size_t len = (size_t)(end - p);
+        if (len > 0 && p[len - 1] == '\r')
+            --len;
+
+        if (p[0] == 'A' && len == 2 + HASH_STRING_LENGTH + ACTION_RECORD_LENGTH) {
+            lua_pushlstring(L, p + 2, HASH_STRING_LENGTH - 1);
+            lua_pushlstring(L, p + 2 + HASH_STRING_LENGTH, ACTION_RECORD_LENGTH);
+            lua_rawset(L, actionsIdx);
+        }
+
+        p = (*end ? end + 1 : end);
+    }
+
+    lua_settop(L, n);
+}
+
+static void saveDatabase(lua_State* L, int dbIdx)
+{
+    int n = lua_gettop(L);
+
+    lua_getfield(L, dbIdx, "path");
+    const char* path = lua_tostring(L, -1);
+
+    lua_newtable(L);
+    int linesIdx = lua_gettop(L);
+    int lineCount = 0;
+
+    lua_getfield(L, dbIdx, "actions");
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pushliteral(L, "A ");
+        lua_pushvalue(L, -3);
+        lua_pushliteral(L, " ");
+        lua_pushvalue(L, -4);
+        lua_pushliteral(L, "\n");
+        lua_concat(L, 5);
+        lua_rawseti(L, linesIdx, ++lineCount);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, ACTIONS_HEADER);
+    for (int i = 1; i <= lineCount; i++) {
+        lua_rawgeti(L, linesIdx, i);
+        luaL_addvalue(&b);
+    }
+    luaL_pushresult(&b);
+
+    size_t dataLen;
+    const char* data = lua_tolstring(L, -1, &dataLen);
+    File_MaybeOverwrite(L, path, data, dataLen);
+
+    lua_settop(L, n);
+}
+
+static int pushDatabase(lua_State* L)
+{
+    File_PushCurrentDirectory(L);
+    lua_pushliteral(L, DIR_SEPARATOR ACTIONS_FILE);
+    lua_concat(L, 2);
+    int pathIdx = lua_gettop(L);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &ACTIONS) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &ACTIONS);
+    }
+
+    lua_pushvalue(L, pathIdx);
+    if (lua_rawget(L, -2) != LUA_TTABLE) {
+        lua_pop(L, 1);
+
+        lua_newtable(L);
+        int dbIdx = lua_gettop(L);
+
+        lua_pushvalue(L, pathIdx);
+        lua_setfield(L, dbIdx, "path");
+        lua_newtable(L);
+        lua_setfield(L, dbIdx, "actions");
+
+        loadDatabase(L, dbIdx, lua_tostring(L, pathIdx));
+
+        lua_pushvalue(L, pathIdx);
+        lua_pushvalue(L, dbIdx);
+        lua_rawset(L, -4);
+    }
+
+    lua_replace(L, pathIdx);
+    lua_settop(L, pathIdx);
+
+    return pathIdx;
+}
+
+/********************************************************************************************************************/
+
+static bool tryHashOutputs(lua_State* L, int outputsIdx, uint64_t* outHash)
+{
+    Hash hash;
+    Hash_Init(&hash);
+
+    lua_Integer count = luaL_len(L, outputsIdx);
+    for (lua_Integer i = 1; i <= count; i++) {
+        lua_rawgeti(L, outputsIdx, i);
+        const char* path = lua_tostring(L, -1);
+
+        uint64_t fileHash;
+        if (!HashCache_TryHashFile(L, path, &fileHash)) {
+            lua_pop(L, 1);
+            return false;
+        }
+
+        Hash_UpdateString(&hash, path);
+        Hash_UpdateInteger(&hash, fileHash);
+        lua_pop(L, 1);
+    }
+
+    *outHash = Hash_Final(&hash);
+    return true;
+}
+
+static const char* pushToolPath(lua_State* L, const char* tool)
+{
+    if (Dir_IsAbsolutePath(tool) || strchr(tool, '/') || strchr(tool, '\\')) {
+        if (!File_Exists(L, tool))
+            return NULL;
+        lua_pushstring(L, tool);
+        return lua_tostring(L, -1);
+    }
+
+    const char* path = Env_PushGet(L, "PATH");
+    if (!path)
+        return NULL;
+
+  #ifdef _WIN32
+    static const char* const extensions[] = { "", ".exe", ".cmd", ".bat", NULL };
+    const char separator = ';';
+  #else
+    static const char* const extensions[] = { "", NULL };
+    const char separator = ':';
+  #endif
+
+    int n = lua_gettop(L);
+    while (*path) {
+        const char* end = strchr(path, separator);
+        if (!end)
+            end = path + strlen(path);
+
+        if (end != path) {
+            for (const char* const* ext = extensions; *ext; ++ext) {
+                lua_pushlstring(L, path, (size_t)(end - path));
+                lua_pushliteral(L, DIR_SEPARATOR);
+                lua_pushstring(L, tool);
+                lua_pushstring(L, *ext);
+                lua_concat(L, 4);
+
+                FileStat st;
+                if (File_TryStat(L, lua_tostring(L, -1), &st) && !st.isDir) {
+                    lua_replace(L, n);
+                    lua_settop(L, n);
+                    return lua_tostring(L, -1);
+                }
+
+                lua_pop(L, 1);
+            }
+        }
+
+        path = (*end ? end + 1 : end);
+    }
+
+    lua_settop(L, n - 1);
+    return NULL;
+}
+
+static void hashTool(lua_State* L, Hash* hash, const char* tool)
+{
+    const char* toolPath = pushToolPath(L, tool);
+    if (!toolPath) {
+        /* tool is not a file (e.g. a shell builtin), its name is the only identity we have */
+        Hash_UpdateString(hash, tool);
+        return;
+    }
+
+    uint64_t toolHash;
+    if (!HashCache_TryHashFile(L, toolPath, &toolHash))
+        toolHash = 0;
+
+    Hash_UpdateString(hash, toolPath);
+    Hash_UpdateInteger(hash, toolHash);
+
+    lua_pop(L, 1);
+}
+
+static void checkPathList(lua_State* L, int tableIdx, const char* what)
+{
+    lua_Integer count = luaL_len(L, tableIdx);
+    for (lua_Integer i = 1; i <= count; i++) {
+        if (lua_rawgeti(L, tableIdx, i) != LUA_TSTRING)
+            luaL_error(L, "%s[%d]: string expected, got %s.", what, (int)i, luaL_typename(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+/********************************************************************************************************************/
+
+bool Pour_CachedExec(lua_State* L, int inputsIdx, int outputsIdx, const char* const* argv, int argc)
+{
+    int n = lua_gettop(L);
+    inputsIdx = lua_absindex(L, inputsIdx);
+    outputsIdx = lua_absindex(L, outputsIdx);
+
+    checkPathList(L, inputsIdx, "inputs");
+    checkPathList(L, outputsIdx, "outputs");
+
+    int dbIdx = pushDatabase(L);
+    lua_getfield(L, dbIdx, "actions");
+    int actionsIdx = lua_gettop(L);
+    Hash hash;
+
+    /* action identity: command line and declared outputs */
+
+    Hash_Init(&hash);
+    Hash_UpdateInteger(&hash, (uint64_t)argc);
+    for (int i = 0; i < argc; i++)
+        Hash_UpdateString(&hash, argv[i]);
+
+    lua_Integer outputCount = luaL_len(L, outputsIdx);
+    Hash_UpdateInteger(&hash, (uint64_t)outputCount);
+    for (lua_Integer i = 1; i <= outputCount; i++) {
+        lua_rawgeti(L, outputsIdx, i);
+        Hash_UpdateString(&hash, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    uint64_t actionId = Hash_Final(&hash);
+
+    /* action key: identity, tool and contents of all inputs */
+
+    Hash_Init(&hash);
+    Hash_UpdateInteger(&hash, actionId);
+    hashTool(L, &hash, argv[0]);
+
+    lua_Integer inputCount = luaL_len(L, inputsIdx);
+    Hash_UpdateInteger(&hash, (uint64_t)inputCount);
+    for (lua_Integer i = 1; i <= inputCount; i++) {
+        lua_rawgeti(L, inputsIdx, i);
+        const char* path = lua_tostring(L, -1);
+
+        uint64_t fileHash;
+        if (!HashCache_TryHashFile(L, path, &fileHash))
+            luaL_error(L, "input file \"%s\" not found.", path);
+
+        Hash_UpdateString(&hash, path);
+        Hash_UpdateInteger(&hash, fileHash);
+        lua_pop(L, 1);
+    }
+
+    uint64_t key = Hash_Final(&hash);
+
+    /* check whether previous run is still valid */
+
+    char id[HASH_STRING_LENGTH];
+    Hash_Format(id, actionId);
+
+    char record[ACTION_RECORD_LENGTH + 1];
+    Hash_Format(record, key);
+    record[HASH_STRING_LENGTH - 1] = ' ';
+
+    bool upToDate = false;
+    uint64_t outputsHash;
+
+    lua_pushstring(L, id);
+    lua_rawget(L, actionsIdx);
+    size_t oldLen;
+    const char* old = lua_tolstring(L, -1, &oldLen);
+    if (old && oldLen == ACTION_RECORD_LENGTH && !memcmp(old, record, HASH_STRING_LENGTH)
+            && tryHashOutputs(L, outputsIdx, &outputsHash)) {
+        Hash_Format(record + HASH_STRING_LENGTH, outputsHash);
+        upToDate = !memcmp(old, record, ACTION_RECORD_LENGTH);
+    }
+    lua_pop(L, 1);
+
+    if (upToDate) {
+        if (g_verbose)
+            Con_PrintF(L, COLOR_STATUS, "# (up to date) %s\n", argv[0]);
+        lua_settop(L, n);
+        return false;
+    }
+
+    /* run the command and record the result */
+
+    if (!Exec_CommandV(L, argv[0], argv, argc, NULL, RUN_WAIT))
+        luaL_error(L, "command execution failed.");
+
+    for (lua_Integer i = 1; i <= outputCount; i++) {
+        lua_rawgeti(L, outputsIdx, i);
+        const char* path = lua_tostring(L, -1);
+        if (!File_Exists(L, path))
+            luaL_error(L, "command did not produce output file \"%s\".", path);
+        lua_pop(L, 1);
+    }
+
+    if (!tryHashOutputs(L, outputsIdx, &outputsHash))
+        luaL_error(L, "unable to hash outputs of command \"%s\".", argv[0]);
+
+    Hash_Format(record + HASH_STRING_LENGTH, outputsHash);
+    lua_pushstring(L, id);
+    lua_pushlstring(L, record, ACTION_RECORD_LENGTH);
+    lua_rawset(L, actionsIdx);
+    saveDatabase(L, dbIdx);
+
+    lua_settop(L, n);
+    return true;
+}
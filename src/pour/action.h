@@ -0,0 +1,8 @@
+#ifndef POUR_ACTION_H
+#define POUR_ACTION_H
+
+#include <pour/pour.h>
+
+bool Pour_CachedExec(lua_State* L, int inputsIdx, int outputsIdx, const char* const* argv, int argc);
+
+#endif
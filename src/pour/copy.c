@@ -0,0 +1,96 @@
+#include <pour/copy.h>
+#include <common/batchio.h>
+#include <common/file.h>
+#include <common/walk.h>
+#include <string.h>
+
+/*
+ * Files are copied by batched I/O workers, see copyFile in batchio.c. Copies keep the modification time of the
+ * source, so targets which already have the same size and time are skipped. Directories are created on the
+ * calling thread while walking, before any file is copied.
+ */
+
+/********************************************************************************************************************/
+
+bool Pour_Copy(lua_State* L, const char* srcPath, const char* dstPath)
+{
+    int n = lua_gettop(L);
+
+    BatchIO* batch = BatchIO_PushNew(L);
+    BatchIO_AddCopy(L, batch, srcPath, dstPath);
+    BatchIO_Run(L, batch);
+
+    BatchRequest* request = BatchIO_Get(batch, 0);
+    BatchIO_Check(L, request);
+    bool copied = request->written;
+
+    BatchIO_Clear(batch);
+    lua_settop(L, n);
+
+    return copied;
+}
+
+/* include patterns may skip directories, so parents of files are created as needed */
+static void createParentDirectories(lua_State* L, const char* dstDir, const char* path)
+{
+    for (const char* p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+        File_TryCreateDirectory(L, lua_pushfstring(L, "%s/%s", dstDir, lua_pushlstring(L, path, (size_t)(p - path))));
+        lua_pop(L, 2);
+    }
+}
+
+int Pour_CopyTree(lua_State* L, const char* srcDir, const char* dstDir, int includeIdx, int excludeIdx)
+{
+    int n = lua_gettop(L);
+
+    BatchIO* batch = BatchIO_PushNew(L);
+    File_TryCreateDirectory(L, dstDir);
+
+    lua_pushnil(L);
+    int lastParentIdx = lua_gettop(L);
+    size_t lastParentLength = 0;
+    const char* lastParent = NULL;
+
+    Walker* walker = Walk_PushOpen(L, srcDir, includeIdx, excludeIdx, false);
+
+    WalkEntry entry;
+    while (Walk_Next(L, walker, &entry)) {
+        const char* dstPath = lua_pushfstring(L, "%s/%s", dstDir, entry.path);
+
+        if (entry.type == WALK_DIR)
+            File_TryCreateDirectory(L, dstPath);
+        else if (entry.type == WALK_FILE) {
+            size_t parentLength = (size_t)(entry.name - entry.path);
+            if (parentLength > 0 && (parentLength != lastParentLength || memcmp(lastParent, entry.path, parentLength))) {
+                createParentDirectories(L, dstDir, entry.path);
+                lua_pushlstring(L, entry.path, parentLength);
+                lua_replace(L, lastParentIdx);
+                lastParent = lua_tostring(L, lastParentIdx);
+                lastParentLength = parentLength;
+            }
+
+            BatchIO_AddCopy(L, batch, lua_pushfstring(L, "%s/%s", srcDir, entry.path), dstPath);
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    Walk_Close(walker);
+
+    BatchIO_Run(L, batch);
+
+    int copied = 0;
+    size_t count = BatchIO_GetCount(batch);
+    for (size_t i = 0; i < count; i++) {
+        BatchRequest* request = BatchIO_Get(batch, i);
+        BatchIO_Check(L, request);
+        if (request->written)
+            ++copied;
+    }
+
+    BatchIO_Clear(batch);
+    lua_settop(L, n);
+
+    return copied;
+}
@@ -0,0 +1,9 @@
+#ifndef POUR_COPY_H
+#define POUR_COPY_H
+
+#include <pour/pour.h>
+
+bool Pour_Copy(lua_State* L, const char* srcPath, const char* dstPath);
+int Pour_CopyTree(lua_State* L, const char* srcDir, const char* dstDir, int includeIdx, int excludeIdx);
+
+#endif
@@ -0,0 +1,223 @@
+#include <pour/parallel.h>
+#include <common/script.h>
+#include <common/serialize.h>
+#include <common/thread.h>
+#include <common/alloc.h>
+#include <common/loop.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Each worker thread has its own Lua state. Tasks and their results are passed between states in serialized
+ * form; buffers are not copied, their storage is shared instead. Workers only take the next task index
+ * under the lock, everything else runs without synchronization.
+ */
+
+#define PARALLEL_MT "Parallel*"
+
+STRUCT(ParallelTask) {
+    Serialized input;
+    Serialized output;
+    char* error;
+};
+
+STRUCT(Parallel) {
+    ParallelTask* tasks;
+    int taskCount;
+    int nextTask;
+    Mutex* mutex;
+    Thread** threads;
+    int threadCount;
+};
+
+/********************************************************************************************************************/
+
+static int runTask(lua_State* L)
+{
+    ParallelTask* task = (ParallelTask*)lua_touserdata(L, 1);
+    lua_settop(L, 0);
+
+    Serialize_PushValue(L, &task->input, 0);
+
+    int argc = 0;
+    if (lua_istable(L, 1)) {
+        argc = (int)luaL_len(L, 1) - 1;
+        luaL_checkstack(L, argc + 1, "too many arguments");
+        for (int i = 0; i <= argc; i++)
+            lua_rawgeti(L, 1, i + 1);
+        lua_remove(L, 1);
+    }
+
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        size_t len;
+        const char* chunk = lua_tolstring(L, 1, &len);
+        if (luaL_loadbufferx(L, chunk, len, "=(parallel)", "t") != LUA_OK)
+            return lua_error(L);
+        lua_replace(L, 1);
+    }
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_call(L, argc, 1);
+
+    lua_pushcfunction(L, Loop_Run);
+    lua_call(L, 0, 0);
+
+    Serialize_Value(L, -1, &task->output);
+    return 0;
+}
+
+static void setError(ParallelTask* task, const char* message)
+{
+    size_t len = strlen(message);
+    task->error = (char*)malloc(len + 1);
+    if (task->error)
+        memcpy(task->error, message, len + 1);
+}
+
+static void workerThread(void* arg)
+{
+    Parallel* p = (Parallel*)arg;
+    lua_State* L = Script_NewWorkerState();
+
+    for (;;) {
+        Mutex_Lock(p->mutex);
+        int index = p->nextTask++;
+        Mutex_Unlock(p->mutex);
+
+        if (index >= p->taskCount)
+            break;
+
+        ParallelTask* task = &p->tasks[index];
+        if (!L) {
+            setError(task, "unable to create Lua state for worker thread.");
+            continue;
+        }
+
+        lua_pushcfunction(L, Script_MessageHandler);
+        lua_pushcfunction(L, runTask);
+        lua_pushlightuserdata(L, task);
+        if (lua_pcall(L, 1, 0, 1) != LUA_OK) {
+            const char* msg = lua_tostring(L, -1);
+            setError(task, (msg && *msg ? msg : "(error message not a string)"));
+        }
+        lua_settop(L, 0);
+    }
+
+    if (L)
+        Alloc_CloseState(L);
+}
+
+/********************************************************************************************************************/
+
+static void parallel_free(Parallel* p)
+{
+    if (p->threads) {
+        for (int i = 0; i < p->threadCount; i++)
+            Thread_Join(p->threads[i]);
+        free(p->threads);
+        p->threads = NULL;
+    }
+
+    if (p->mutex) {
+        Mutex_Destroy(p->mutex);
+        p->mutex = NULL;
+    }
+
+    if (p->tasks) {
+        for (int i = 0; i < p->taskCount; i++) {
+            Serialize_Free(&p->tasks[i].input);
+            Serialize_Free(&p->tasks[i].output);
+            free(p->tasks[i].error);
+        }
+        free(p->tasks);
+        p->tasks = NULL;
+    }
+}
+
+static int parallel_gc(lua_State* L)
+{
+    parallel_free((Parallel*)luaL_checkudata(L, 1, PARALLEL_MT));
+    return 0;
+}
+
+int Pour_Parallel(lua_State* L, int tasksIdx, int threadCount)
+{
+    tasksIdx = lua_absindex(L, tasksIdx);
+    lua_Integer taskCount = luaL_len(L, tasksIdx);
+    if (taskCount > INT_MAX / (lua_Integer)sizeof(ParallelTask))
+        luaL_error(L, "too many tasks.");
+
+    Parallel* p = (Parallel*)lua_newuserdatauv(L, sizeof(Parallel), 0);
+    memset(p, 0, sizeof(Parallel));
+    if (luaL_newmetatable(L, PARALLEL_MT)) {
+        lua_pushcfunction(L, parallel_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    int parallelIdx = lua_gettop(L);
+
+    if (taskCount > 0) {
+        p->tasks = (ParallelTask*)calloc((size_t)taskCount, sizeof(ParallelTask));
+        if (!p->tasks)
+            luaL_error(L, "out of memory.");
+        p->taskCount = (int)taskCount;
+    }
+
+    for (int i = 0; i < p->taskCount; i++) {
+        lua_rawgeti(L, tasksIdx, i + 1);
+        int type = lua_type(L, -1);
+        if (type != LUA_TFUNCTION && type != LUA_TSTRING && type != LUA_TTABLE)
+            luaL_error(L, "task #%d: function, string or table expected, got %s.", i + 1, luaL_typename(L, -1));
+        Serialize_Value(L, -1, &p->tasks[i].input);
+        lua_pop(L, 1);
+    }
+
+    if (threadCount > p->taskCount)
+        threadCount = p->taskCount;
+
+    if (threadCount > 0) {
+        p->mutex = Mutex_Create();
+        p->threads = (Thread**)calloc((size_t)threadCount, sizeof(Thread*));
+        if (!p->mutex || !p->threads)
+            luaL_error(L, "out of memory.");
+
+        for (int i = 0; i < threadCount; i++) {
+            Thread* thread = Thread_Start(workerThread, p);
+            if (!thread)
+                break;
+            p->threads[p->threadCount++] = thread;
+        }
+
+        /* if no threads could be started at all, tasks are still run on the calling thread */
+        if (p->threadCount == 0)
+            workerThread(p);
+    }
+
+    for (int i = 0; i < p->threadCount; i++)
+        Thread_Join(p->threads[i]);
+    free(p->threads);
+    p->threads = NULL;
+
+    int failed = 0;
+    lua_createtable(L, p->taskCount, 0);
+    for (int i = 0; i < p->taskCount; i++) {
+        ParallelTask* task = &p->tasks[i];
+        if (task->error || !task->output.data) {
+            lua_pushstring(L, (task->error ? task->error : "out of memory."));
+            Script_Report(L, LUA_ERRRUN);
+            ++failed;
+        } else {
+            Serialize_PushValue(L, &task->output, 0);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+
+    parallel_free(p);
+    lua_remove(L, parallelIdx);
+
+    if (failed > 0)
+        luaL_error(L, "%d of %d parallel tasks failed.", failed, (int)taskCount);
+
+    return 1;
+}
@@ -0,0 +1,8 @@
+#ifndef POUR_PARALLEL_H
+#define POUR_PARALLEL_H
+
+#include <pour/pour.h>
+
+int Pour_Parallel(lua_State* L, int tasksIdx, int threadCount);
+
+#endif
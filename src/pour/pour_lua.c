@@ -1,15 +1,40 @@
 #include <pour/pour_lua.h>
+#include <pour/action.h>
 #include <pour/package.h>
+#include <pour/parallel.h>
 #include <pour/install.h>
 #include <pour/run.h>
 #include <pour/script.h>
 #include <pour/build.h>
+#include <pour/copy.h>
 #include <common/script.h>
+#include <common/alloc.h>
+#include <common/cache.h>
 #include <common/dirs.h>
 #include <common/file.h>
+#include <common/hash.h>
+#include <common/hashcache.h>
+#include <common/statcache.h>
+#include <common/loop.h>
+#include <common/buffer.h>
+#include <common/thread.h>
 #include <common/utf8.h>
+#include <common/walk.h>
 #include <string.h>
 
+static int pour_alloc_stats(lua_State* L)
+{
+    Alloc_PushStats(L);
+    return 1;
+}
+
+static int pour_async(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    Loop_PushTask(L, lua_gettop(L) - 1);
+    return 1;
+}
+
 static int pour_build(lua_State* L)
 {
     const char* target = luaL_checkstring(L, 1);
@@ -21,6 +46,43 @@ static int pour_build(lua_State* L)
     return 0;
 }
 
+static int pour_cache_get(lua_State* L)
+{
+    const char* key = luaL_checkstring(L, 1);
+    Cache_PushValue(L, key);
+    return 1;
+}
+
+static int pour_cache_set(lua_State* L)
+{
+    const char* key = luaL_checkstring(L, 1);
+    luaL_checkany(L, 2);
+    Cache_SetValue(L, key, 2);
+    return 0;
+}
+
+static int pour_cached_exec(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    int argc = lua_gettop(L) - 2;
+    luaL_argcheck(L, argc > 0, 3, "command expected");
+
+    char** argv = (char**)lua_newuserdatauv(L, argc * sizeof(char**), 0);
+    for (int i = 0; i < argc; i++) {
+        size_t argLen;
+        const char* arg = luaL_checklstring(L, i + 3, &argLen);
+
+        ++argLen;
+        argv[i] = (char*)lua_newuserdatauv(L, argLen, 0);
+        memcpy(argv[i], arg, argLen);
+    }
+
+    lua_pushboolean(L, Pour_CachedExec(L, 1, 2, (const char* const*)argv, argc));
+    return 1;
+}
+
 static int pour_chdir(lua_State* L)
 {
     const char* file = luaL_checkstring(L, 1);
@@ -33,6 +95,32 @@ static int pour_chdir(lua_State* L)
     return 1;
 }
 
+static int pour_copy(lua_State* L)
+{
+    const char* src = luaL_checkstring(L, 1);
+    const char* dst = luaL_checkstring(L, 2);
+    lua_pushboolean(L, Pour_Copy(L, src, dst));
+    return 1;
+}
+
+static int pour_copy_tree(lua_State* L)
+{
+    const char* src = luaL_checkstring(L, 1);
+    const char* dst = luaL_checkstring(L, 2);
+    int includeIdx = 0, excludeIdx = 0;
+
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "include");
+        includeIdx = lua_gettop(L);
+        lua_getfield(L, 3, "exclude");
+        excludeIdx = lua_gettop(L);
+    }
+
+    lua_pushinteger(L, Pour_CopyTree(L, src, dst, includeIdx, excludeIdx));
+    return 1;
+}
+
 static int pour_exec(lua_State* L)
 {
     int argc = lua_gettop(L);
@@ -85,11 +173,25 @@ static int pour_file_read(lua_State* L)
     return 1;
 }
 
+static int pour_file_map(lua_State* L)
+{
+    const char* file = luaL_checkstring(L, 1);
+    File_PushMapped(L, file, FILE_ACCESS_NORMAL);
+    return 1;
+}
+
+static int pour_file_read_buffer(lua_State* L)
+{
+    const char* file = luaL_checkstring(L, 1);
+    File_PushBuffer(L, file);
+    return 1;
+}
+
 static int pour_file_write(lua_State* L)
 {
     size_t dataLen;
     const char* file = luaL_checkstring(L, 1);
-    const char* data = luaL_checklstring(L, 2, &dataLen);
+    const char* data = Buffer_CheckBytes(L, 2, &dataLen);
     File_MaybeOverwrite(L, file, data, dataLen);
     return 0;
 }
@@ -102,6 +204,13 @@ static int pour_fetch(lua_State* L)
     return 0;
 }
 
+static int pour_flush_stat_cache(lua_State* L)
+{
+    DONT_WARN_UNUSED(L);
+    StatCache_Flush();
+    return 0;
+}
+
 static int pour_force_generate(lua_State* L)
 {
     const char* target = luaL_checkstring(L, 1);
@@ -124,6 +233,37 @@ static int pour_generate(lua_State* L)
     return 0;
 }
 
+static int pour_glob(lua_State* L)
+{
+    const char* dir = luaL_checkstring(L, 1);
+    int n = lua_gettop(L);
+    luaL_argcheck(L, n > 1, 2, "pattern expected");
+
+    lua_createtable(L, n - 1, 0);
+    for (int i = 2; i <= n; i++) {
+        luaL_checkstring(L, i);
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i - 1);
+    }
+    int patternsIdx = lua_gettop(L);
+
+    lua_newtable(L);
+    int resultIdx = lua_gettop(L);
+
+    Walker* walker = Walk_PushOpen(L, dir, patternsIdx, 0, false);
+
+    WalkEntry entry;
+    lua_Integer count = 0;
+    while (Walk_Next(L, walker, &entry)) {
+        lua_pushstring(L, entry.path);
+        lua_rawseti(L, resultIdx, ++count);
+    }
+
+    Walk_Close(walker);
+    lua_settop(L, resultIdx);
+    return 1;
+}
+
 static int pour_open_in_ide(lua_State* L)
 {
     const char* target = luaL_checkstring(L, 1);
@@ -135,6 +275,15 @@ static int pour_open_in_ide(lua_State* L)
     return 0;
 }
 
+static int pour_parallel(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer threadCount = luaL_optinteger(L, 2, Thread_GetCPUCount());
+    luaL_argcheck(L, threadCount > 0 && threadCount <= 1024, 2, "invalid thread count");
+
+    return Pour_Parallel(L, 1, (int)threadCount);
+}
+
 static int pour_require(lua_State* L)
 {
     const char* package = luaL_checkstring(L, 1);
@@ -187,6 +336,35 @@ static int pour_run_background(lua_State* L)
     return 0;
 }
 
+static int pour_hash(lua_State* L)
+{
+    size_t dataLen;
+    const char* data = Buffer_CheckBytes(L, 1, &dataLen);
+
+    Hash hash;
+    Hash_Init(&hash);
+    Hash_Update(&hash, data, dataLen);
+
+    char str[HASH_STRING_LENGTH];
+    Hash_Format(str, Hash_Final(&hash));
+    lua_pushstring(L, str);
+    return 1;
+}
+
+static int pour_hash_file(lua_State* L)
+{
+    const char* file = luaL_checkstring(L, 1);
+
+    uint64_t value;
+    if (!HashCache_TryHashFile(L, file, &value))
+        return luaL_error(L, "file \"%s\" not found.", file);
+
+    char str[HASH_STRING_LENGTH];
+    Hash_Format(str, value);
+    lua_pushstring(L, str);
+    return 1;
+}
+
 static int pour_invoke(lua_State* L)
 {
     const int pathIndex = 1;
@@ -211,6 +389,54 @@ static int pour_shell_open(lua_State* L)
     return 0;
 }
 
+static int spawn(lua_State* L, bool pipeOutput)
+{
+    luaL_checkstring(L, 1);
+
+    int argc = lua_gettop(L);
+    char** argv = (char**)lua_newuserdatauv(L, argc * sizeof(char**), 0);
+    for (int i = 0; i < argc; i++) {
+        size_t argLen;
+        const char* arg = luaL_checklstring(L, i + 1, &argLen);
+
+        ++argLen;
+        argv[i] = (char*)lua_newuserdatauv(L, argLen, 0);
+        memcpy(argv[i], arg, argLen);
+    }
+
+    Loop_PushProcess(L, (const char* const*)argv, argc, pipeOutput);
+    return 1;
+}
+
+static int pour_sleep(lua_State* L)
+{
+    Loop_Sleep(L, luaL_checknumber(L, 1));
+    return 0;
+}
+
+static int pour_spawn(lua_State* L)
+{
+    return spawn(L, false);
+}
+
+static int pour_spawn_piped(lua_State* L)
+{
+    return spawn(L, true);
+}
+
+static int pour_sync_batch(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    File_BeginSyncBatch(L);
+    /* files written before an error still have to reach the disk */
+    if (lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0) != LUA_OK) {
+        File_EndSyncBatch(L);
+        return lua_error(L);
+    }
+    File_EndSyncBatch(L);
+    return lua_gettop(L);
+}
+
 static int pour_terminate_background_app(lua_State* L)
 {
     DONT_WARN_UNUSED(L);
@@ -218,26 +444,113 @@ static int pour_terminate_background_app(lua_State* L)
     return 0;
 }
 
+static const char* const walkTypes[] = { "file", "dir", "link", "other" };
+
+static int walk_next(lua_State* L)
+{
+    Walker* walker = (Walker*)luaL_checkudata(L, 1, WALKER_MT);
+    int batchSize = (int)lua_tointeger(L, lua_upvalueindex(1));
+
+    lua_settop(L, 1);
+    lua_createtable(L, 0, 5);
+    for (int i = 0; i < 4; i++)
+        lua_createtable(L, batchSize, 0);
+
+    WalkEntry entry;
+    int n = 0;
+    while (n < batchSize && Walk_Next(L, walker, &entry)) {
+        ++n;
+        lua_pushstring(L, entry.path);
+        lua_rawseti(L, 3, n);
+        lua_pushstring(L, walkTypes[entry.type]);
+        lua_rawseti(L, 4, n);
+        lua_pushinteger(L, (lua_Integer)entry.size);
+        lua_rawseti(L, 5, n);
+        lua_pushnumber(L, entry.mtime);
+        lua_rawseti(L, 6, n);
+    }
+
+    if (n == 0)
+        return 0;
+
+    lua_setfield(L, 2, "mtime");
+    lua_setfield(L, 2, "size");
+    lua_setfield(L, 2, "type");
+    lua_setfield(L, 2, "path");
+    lua_pushinteger(L, n);
+    lua_setfield(L, 2, "n");
+
+    return 1;
+}
+
+static int pour_walk(lua_State* L)
+{
+    const char* dir = luaL_checkstring(L, 1);
+    lua_Integer batchSize = 1024;
+    bool withStat = true;
+    int includeIdx = 0, excludeIdx = 0;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "include");
+        includeIdx = lua_gettop(L);
+        lua_getfield(L, 2, "exclude");
+        excludeIdx = lua_gettop(L);
+        if (lua_getfield(L, 2, "batch") != LUA_TNIL)
+            batchSize = luaL_checkinteger(L, -1);
+        if (lua_getfield(L, 2, "stat") != LUA_TNIL)
+            withStat = lua_toboolean(L, -1);
+        luaL_argcheck(L, batchSize > 0 && batchSize <= 0x100000, 2, "invalid batch size");
+    }
+
+    lua_pushinteger(L, batchSize);
+    lua_pushcclosure(L, walk_next, 1);
+    Walk_PushOpen(L, dir, includeIdx, excludeIdx, withStat);
+    lua_pushnil(L);
+    lua_pushvalue(L, -2);                       /* closing value */
+
+    return 4;
+}
+
 /********************************************************************************************************************/
 
 static const luaL_Reg funcs[] = {
+    { "alloc_stats", pour_alloc_stats },
+    { "async", pour_async },
     { "build", pour_build },
+    { "cache_get", pour_cache_get },
+    { "cache_set", pour_cache_set },
+    { "cached_exec", pour_cached_exec },
     { "chdir", pour_chdir },
+    { "copy", pour_copy },
+    { "copy_tree", pour_copy_tree },
     { "exec", pour_exec },
     { "exec_background", pour_exec_background },
     { "file_exists", pour_file_exists },
     { "file_read", pour_file_read },
+    { "file_map", pour_file_map },
+    { "file_read_buffer", pour_file_read_buffer },
     { "file_write", pour_file_write },
     { "fetch", pour_fetch },
+    { "flush_stat_cache", pour_flush_stat_cache },
     { "force_generate", pour_force_generate },
     { "generate", pour_generate },
+    { "glob", pour_glob },
+    { "hash", pour_hash },
+    { "hash_file", pour_hash_file },
     { "open_in_ide", pour_open_in_ide },
+    { "parallel", pour_parallel },
     { "require", pour_require },
     { "run", pour_run },
     { "run_background", pour_run_background },
     { "invoke", pour_invoke },
     { "shell_open", pour_shell_open },
+    { "sleep", pour_sleep },
+    { "spawn", pour_spawn },
+    { "spawn_piped", pour_spawn_piped },
+    { "sync_batch", pour_sync_batch },
     { "terminate_background_app", pour_terminate_background_app },
+    { "walk", pour_walk },
     { NULL, NULL }
 };
 
@@ -247,8 +560,174 @@ static int luaopen_pour(lua_State* L)
     return 1;
 }
 
+/*
+ * Standard library functions which may change files behind the back of the stat cache invalidate it. A file
+ * opened for writing changes until it is closed, and so may anything while a pipe is open, so such handles
+ * are remembered and invalidate the cache once more when closed (explicitly, by a to-be-closed variable or by
+ * the garbage collector).
+ */
+
+typedef enum flushkind_t {
+    FLUSH_ALWAYS,               /* os.execute, os.remove, os.rename */
+    FLUSH_OPEN,                 /* io.open: only for writing, invalidates the file */
+    FLUSH_OUTPUT,               /* io.output: opens a file for writing when given a name */
+    FLUSH_PIPE,                 /* io.popen */
+} flushkind_t;
+
+static char WRITABLE_FILES;     /* weak keys: file handle -> path it was opened with, or true for a pipe */
+
+static void trackFile(lua_State* L, int fileIdx, int pathIdx)
+{
+    if (!lua_isuserdata(L, fileIdx))
+        return;
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &WRITABLE_FILES) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &WRITABLE_FILES);
+    }
+
+    lua_pushvalue(L, fileIdx);
+    if (pathIdx)
+        lua_pushvalue(L, pathIdx);
+    else
+        lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+static void forgetFile(lua_State* L, int fileIdx)
+{
+    fileIdx = lua_absindex(L, fileIdx);
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &WRITABLE_FILES) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_pushvalue(L, fileIdx);
+    int type = lua_rawget(L, -2);
+    if (type == LUA_TSTRING)
+        StatCache_Invalidate(lua_tostring(L, -1));
+    else if (type != LUA_TNIL)
+        StatCache_Flush();
+    lua_pop(L, 1);
+
+    if (type != LUA_TNIL) {
+        lua_pushvalue(L, fileIdx);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);
+}
+
+static int flushingCall(lua_State* L)
+{
+    flushkind_t kind = (flushkind_t)lua_tointeger(L, lua_upvalueindex(2));
+    int n = lua_gettop(L);
+
+    bool writesFile = false;
+    if (kind == FLUSH_OPEN && lua_type(L, 1) == LUA_TSTRING) {
+        const char* mode = luaL_optstring(L, 2, "r");
+        writesFile = (strpbrk(mode, "wa+") != NULL);
+    } else if (kind == FLUSH_OUTPUT)
+        writesFile = (lua_type(L, 1) == LUA_TSTRING);
+
+    lua_pushvalue(L, 1);                        /* file name, kept for trackFile */
+    lua_pushvalue(L, lua_upvalueindex(1));
+    for (int i = 1; i <= n; i++)
+        lua_pushvalue(L, i);
+    lua_call(L, n, LUA_MULTRET);
+
+    int pathIdx = n + 1;
+    int resultIdx = n + 2;
+    if (writesFile) {
+        StatCache_Invalidate(lua_tostring(L, pathIdx));
+        if (resultIdx <= lua_gettop(L))
+            trackFile(L, resultIdx, pathIdx);
+    } else if (kind == FLUSH_ALWAYS || kind == FLUSH_PIPE) {
+        StatCache_Flush();
+        if (kind == FLUSH_PIPE && resultIdx <= lua_gettop(L))
+            trackFile(L, resultIdx, 0);
+    }
+
+    return lua_gettop(L) - pathIdx;
+}
+
+static int closingCall(lua_State* L)
+{
+    if (lua_gettop(L) == 0) {
+        /* io.close() closes the default output file */
+        lua_getglobal(L, "io");
+        if (lua_istable(L, -1) && lua_getfield(L, -1, "output") == LUA_TFUNCTION) {
+            lua_call(L, 0, 1);
+            lua_replace(L, 1);
+        } else
+            lua_settop(L, 0);
+    }
+
+    int n = lua_gettop(L);
+    lua_pushvalue(L, 1);                        /* file handle, kept for forgetFile */
+    lua_insert(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 2);
+    lua_call(L, n, LUA_MULTRET);
+
+    forgetFile(L, 1);
+
+    return lua_gettop(L) - 1;
+}
+
+static void wrapFlushing(lua_State* L, const char* lib, const char* name, flushkind_t kind)
+{
+    int top = lua_gettop(L);
+
+    if (lua_getglobal(L, lib) == LUA_TTABLE && lua_getfield(L, -1, name) == LUA_TFUNCTION) {
+        lua_pushinteger(L, kind);
+        lua_pushcclosure(L, flushingCall, 2);
+        lua_setfield(L, -2, name);
+    }
+
+    lua_settop(L, top);
+}
+
+static void wrapClosing(lua_State* L, int tableIdx, const char* name)
+{
+    tableIdx = lua_absindex(L, tableIdx);
+
+    if (lua_istable(L, tableIdx) && lua_getfield(L, tableIdx, name) == LUA_TFUNCTION) {
+        lua_pushcclosure(L, closingCall, 1);
+        lua_setfield(L, tableIdx, name);
+    } else
+        lua_pop(L, 1);
+}
+
 void Pour_InitLua(lua_State* L)
 {
+    wrapFlushing(L, "io", "open", FLUSH_OPEN);
+    wrapFlushing(L, "io", "output", FLUSH_OUTPUT);
+    wrapFlushing(L, "io", "popen", FLUSH_PIPE);
+    wrapFlushing(L, "os", "execute", FLUSH_ALWAYS);
+    wrapFlushing(L, "os", "remove", FLUSH_ALWAYS);
+    wrapFlushing(L, "os", "rename", FLUSH_ALWAYS);
+
+    lua_getglobal(L, "io");
+    wrapClosing(L, -1, "close");
+    lua_pop(L, 1);
+
+    if (luaL_getmetatable(L, LUA_FILEHANDLE) == LUA_TTABLE) {
+        wrapClosing(L, -1, "__gc");
+        wrapClosing(L, -1, "__close");
+        lua_getfield(L, -1, "__index");
+        wrapClosing(L, -1, "close");
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
     lua_newtable(L);
     lua_pushvalue(L, -1);
     lua_rawsetp(L, LUA_REGISTRYINDEX, &PACKAGE_DIR);
@@ -257,3 +736,47 @@ void Pour_InitLua(lua_State* L)
     luaL_requiref(L, "pour", luaopen_pour, 1);
     lua_pop(L, 1);
 }
+
+/*
+ * Caches are kept in memory of the main state and written by it, so they are not shared with worker states.
+ * Functions that run scripts or commands change process-wide state (working directory, signal handlers, the
+ * current script directory, the background process), so they may only be called from the main state as well.
+ */
+static const char* const mainStateOnly[] = {
+    "build",
+    "cache_get",
+    "cache_set",
+    "cached_exec",
+    "chdir",
+    "exec",
+    "exec_background",
+    "fetch",
+    "force_generate",
+    "generate",
+    "hash_file",
+    "invoke",
+    "open_in_ide",
+    "require",
+    "run",
+    "run_background",
+    "terminate_background_app",
+    NULL
+};
+
+static int notInWorker(lua_State* L)
+{
+    return luaL_error(L, "pour.%s is not available in parallel tasks.", lua_tostring(L, lua_upvalueindex(1)));
+}
+
+void Pour_InitWorkerLua(lua_State* L)
+{
+    Pour_InitLua(L);
+
+    lua_getglobal(L, "pour");
+    for (const char* const* name = mainStateOnly; *name; ++name) {
+        lua_pushstring(L, *name);
+        lua_pushcclosure(L, notInWorker, 1);
+        lua_setfield(L, -2, *name);
+    }
+    lua_pop(L, 1);
+}
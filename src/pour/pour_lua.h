@@ -4,5 +4,6 @@
 #include <common/common.h>
 
 void Pour_InitLua(lua_State* L);
+void Pour_InitWorkerLua(lua_State* L);
 
 #endif